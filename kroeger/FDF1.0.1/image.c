@@ -373,142 +373,181 @@ convolution_t *convolution_new(const int order, const float *half_coeffs, const
     return conv;
 }
 
-static void convolve_vert_fast_3(image_t *dst, const image_t *src, const convolution_t *conv){
-    const int iterline = (src->stride>>2)+1;
+/* vector width of the 3/5-tap convolutions: 16 with AVX-512, 8 with AVX, 4 (SSE) otherwise. Rows are only 16-byte aligned, hence unaligned access */
+#if defined(__AVX512F__)
+#define CONV_VW 16
+#elif defined(__AVX__)
+#define CONV_VW 8
+#else
+#define CONV_VW 4
+#endif
+typedef float vwsf __attribute__((vector_size(4*CONV_VW), aligned(4)));
+typedef float v4sf_u __attribute__((vector_size(16), aligned(4)));
+
+/* dst[i] = c[0]*a[0][i] + ... + c[k-1]*a[k-1][i] for i<n, n multiple of 4. Accumulates left to right, same rounding as the scalar expression */
+static inline __attribute__((always_inline)) void convolve_row(float *dst, const float * const *a, const float *c, const int k, const int n){
+    int i = 0, t;
+    for( ; i+CONV_VW <= n ; i+=CONV_VW){
+        vwsf sum = c[0]*(*(const vwsf*) (a[0]+i));
+        for(t=1 ; t<k ; t++)
+            sum += c[t]*(*(const vwsf*) (a[t]+i));
+        *(vwsf*) (dst+i) = sum;
+    }
+    for( ; i < n ; i+=4){
+        v4sf_u sum = c[0]*(*(const v4sf_u*) (a[0]+i));
+        for(t=1 ; t<k ; t++)
+            sum += c[t]*(*(const v4sf_u*) (a[t]+i));
+        *(v4sf_u*) (dst+i) = sum;
+    }
+}
+
+#if CONV_VW==4 && !defined(_OPENMP)
+/* single-threaded 4-wide builds: one pass over the whole plane, faster than the row kernel without wider vectors or threads to amortize its per-row dispatch */
+static void convolve_vert_fast_3(float *dst, const float *src, const int stride, const int height, const convolution_t *conv){
+    const int iterline = (stride>>2)+1;
     const float *coeff = conv->coeffs;
-    //const float *coeff_accu = conv->coeffs_accu;
-    v4sf *srcp = (v4sf*) src->c1, *dstp = (v4sf*) dst->c1;
-    v4sf *srcp_p1 = (v4sf*) (src->c1+src->stride);
+    const v4sf *srcp = (const v4sf*) src, *srcp_p1 = (const v4sf*) (src+stride);
+    v4sf *dstp = (v4sf*) dst;
     int i;
     for(i=iterline ; --i ; ){ // first line
         *dstp = (coeff[0]+coeff[1])*(*srcp) + coeff[2]*(*srcp_p1);
         dstp+=1; srcp+=1; srcp_p1+=1;
     }
-    v4sf* srcp_m1 = (v4sf*) src->c1; 
-    for(i=src->height-1 ; --i ; ){ // others line
+    const v4sf *srcp_m1 = (const v4sf*) src;
+    for(i=height-1 ; --i ; ){ // others line
         int j;
         for(j=iterline ; --j ; ){
             *dstp = coeff[0]*(*srcp_m1) + coeff[1]*(*srcp) + coeff[2]*(*srcp_p1);
             dstp+=1; srcp_m1+=1; srcp+=1; srcp_p1+=1;
         }
-    }       
+    }
     for(i=iterline ; --i ; ){ // last line
         *dstp = coeff[0]*(*srcp_m1) + (coeff[1]+coeff[2])*(*srcp);
-        dstp+=1; srcp_m1+=1; srcp+=1; 
-    }  
+        dstp+=1; srcp_m1+=1; srcp+=1;
+    }
 }
 
-static void convolve_vert_fast_5(image_t *dst, const image_t *src, const convolution_t *conv){
-    const int iterline = (src->stride>>2)+1;
+static void convolve_vert_fast_5(float *dst, const float *src, const int stride, const int height, const convolution_t *conv){
+    const int iterline = (stride>>2)+1;
     const float *coeff = conv->coeffs;
-    //const float *coeff_accu = conv->coeffs_accu;
-    v4sf *srcp = (v4sf*) src->c1, *dstp = (v4sf*) dst->c1;
-    v4sf *srcp_p1 = (v4sf*) (src->c1+src->stride);
-    v4sf *srcp_p2 = (v4sf*) (src->c1+2*src->stride);
+    const v4sf *srcp = (const v4sf*) src, *srcp_p1 = (const v4sf*) (src+stride), *srcp_p2 = (const v4sf*) (src+2*stride);
+    v4sf *dstp = (v4sf*) dst;
     int i;
     for(i=iterline ; --i ; ){ // first line
         *dstp = (coeff[0]+coeff[1]+coeff[2])*(*srcp) + coeff[3]*(*srcp_p1) + coeff[4]*(*srcp_p2);
         dstp+=1; srcp+=1; srcp_p1+=1; srcp_p2+=1;
     }
-    v4sf* srcp_m1 = (v4sf*) src->c1;
+    const v4sf *srcp_m1 = (const v4sf*) src;
     for(i=iterline ; --i ; ){ // second line
         *dstp = (coeff[0]+coeff[1])*(*srcp_m1) + coeff[2]*(*srcp) + coeff[3]*(*srcp_p1) + coeff[4]*(*srcp_p2);
         dstp+=1; srcp_m1+=1; srcp+=1; srcp_p1+=1; srcp_p2+=1;
-    }   
-    v4sf* srcp_m2 = (v4sf*) src->c1;
-    for(i=src->height-3 ; --i ; ){ // others line
+    }
+    const v4sf *srcp_m2 = (const v4sf*) src;
+    for(i=height-3 ; --i ; ){ // others line
         int j;
         for(j=iterline ; --j ; ){
             *dstp = coeff[0]*(*srcp_m2) + coeff[1]*(*srcp_m1) + coeff[2]*(*srcp) + coeff[3]*(*srcp_p1) + coeff[4]*(*srcp_p2);
-            dstp+=1; srcp_m2+=1;srcp_m1+=1; srcp+=1; srcp_p1+=1; srcp_p2+=1;
+            dstp+=1; srcp_m2+=1; srcp_m1+=1; srcp+=1; srcp_p1+=1; srcp_p2+=1;
         }
-    }    
+    }
     for(i=iterline ; --i ; ){ // second to last line
         *dstp = coeff[0]*(*srcp_m2) + coeff[1]*(*srcp_m1) + coeff[2]*(*srcp) + (coeff[3]+coeff[4])*(*srcp_p1);
-        dstp+=1; srcp_m2+=1;srcp_m1+=1; srcp+=1; srcp_p1+=1;
-    }          
+        dstp+=1; srcp_m2+=1; srcp_m1+=1; srcp+=1; srcp_p1+=1;
+    }
     for(i=iterline ; --i ; ){ // last line
         *dstp = coeff[0]*(*srcp_m2) + coeff[1]*(*srcp_m1) + (coeff[2]+coeff[3]+coeff[4])*(*srcp);
-        dstp+=1; srcp_m2+=1;srcp_m1+=1; srcp+=1; 
-    }  
+        dstp+=1; srcp_m2+=1; srcp_m1+=1; srcp+=1;
+    }
 }
+#endif
 
-static void convolve_horiz_fast_3(image_t *dst, const image_t *src, const convolution_t *conv){
-    const int stride_minus_1 = src->stride-1;
-    const int iterline = (src->stride>>2);
+/* 3 or 5-tap vertical convolution of nplanes consecutive planes of height rows each, replicated border at the top and bottom of each plane. Rows in parallel */
+static void convolve_vert_fast(float *dst, const float *src, const int stride, const int height, const int nplanes, const convolution_t *conv){
+    int r;
+#if CONV_VW==4 && !defined(_OPENMP)
+    for(r=0 ; r<nplanes ; r++){
+        if(conv->order==1)
+            convolve_vert_fast_3(dst + r*stride*height, src + r*stride*height, stride, height, conv);
+        else
+            convolve_vert_fast_5(dst + r*stride*height, src + r*stride*height, stride, height, conv);
+    }
+#else
     const float *coeff = conv->coeffs;
-    v4sf *srcp = (v4sf*) src->c1, *dstp = (v4sf*) dst->c1;
-    // create shifted version of src
-    float *src_p1 = (float*) malloc(sizeof(float)*src->stride),
-        *src_m1 = (float*) malloc(sizeof(float)*src->stride);
-    int j;
-    for(j=0;j<src->height;j++){
-        int i;
-        float *srcptr = (float*) srcp;
-        const float right_coef = srcptr[src->width-1];
-        for(i=src->width;i<src->stride;i++)
-            srcptr[i] = right_coef;
-        src_m1[0] = srcptr[0];
-        memcpy(src_m1+1, srcptr , sizeof(float)*stride_minus_1);
-        src_p1[stride_minus_1] = right_coef;
-        memcpy(src_p1, srcptr+1, sizeof(float)*stride_minus_1);
-        v4sf *srcp_p1 = (v4sf*) src_p1, *srcp_m1 = (v4sf*) src_m1;
-        
-        for(i=0;i<iterline;i++){
-            *dstp = coeff[0]*(*srcp_m1) + coeff[1]*(*srcp) + coeff[2]*(*srcp_p1);
-            dstp+=1; srcp_m1+=1; srcp+=1; srcp_p1+=1;
+    #pragma omp parallel for schedule(static)
+    for(r=0 ; r<nplanes*height ; r++){
+        const int i = r % height;
+        const float *s = src + r*stride;
+        const float *m2 = s-2*stride, *m1 = s-stride, *p1 = s+stride, *p2 = s+2*stride;
+        float *d = dst + r*stride;
+        if(conv->order==1){
+            if(i==0){ // first line
+                const float *a[2] = {s, p1}, c[2] = {coeff[0]+coeff[1], coeff[2]};
+                convolve_row(d, a, c, 2, stride);
+            }else if(i==height-1){ // last line
+                const float *a[2] = {m1, s}, c[2] = {coeff[0], coeff[1]+coeff[2]};
+                convolve_row(d, a, c, 2, stride);
+            }else{ // others line
+                const float *a[3] = {m1, s, p1};
+                convolve_row(d, a, coeff, 3, stride);
+            }
+        }else{
+            if(i==0){ // first line
+                const float *a[3] = {s, p1, p2}, c[3] = {coeff[0]+coeff[1]+coeff[2], coeff[3], coeff[4]};
+                convolve_row(d, a, c, 3, stride);
+            }else if(i==1){ // second line
+                const float *a[4] = {m1, s, p1, p2}, c[4] = {coeff[0]+coeff[1], coeff[2], coeff[3], coeff[4]};
+                convolve_row(d, a, c, 4, stride);
+            }else if(i==height-2){ // second to last line
+                const float *a[4] = {m2, m1, s, p1}, c[4] = {coeff[0], coeff[1], coeff[2], coeff[3]+coeff[4]};
+                convolve_row(d, a, c, 4, stride);
+            }else if(i==height-1){ // last line
+                const float *a[3] = {m2, m1, s}, c[3] = {coeff[0], coeff[1], coeff[2]+coeff[3]+coeff[4]};
+                convolve_row(d, a, c, 3, stride);
+            }else{ // others line
+                const float *a[5] = {m2, m1, s, p1, p2};
+                convolve_row(d, a, coeff, 5, stride);
+            }
         }
     }
-    free(src_p1);
-    free(src_m1);
+#endif
 }
 
-static void convolve_horiz_fast_5(image_t *dst, const image_t *src, const convolution_t *conv){
-    const int stride_minus_1 = src->stride-1;
-    const int stride_minus_2 = src->stride-2;
-    const int iterline = (src->stride>>2);
+/* 3 or 5-tap horizontal convolution of rows rows, replicated border left and right. 
+   Each row is copied once with 2 replicated pixels on each side, shifted taps are unaligned loads from this copy. Rows in parallel */
+static void convolve_horiz_fast(float *dst, const float *src, const int width, const int stride, const int rows, const convolution_t *conv){
     const float *coeff = conv->coeffs;
-    v4sf *srcp = (v4sf*) src->c1, *dstp = (v4sf*) dst->c1;
-    float *src_p1 = (float*) malloc(sizeof(float)*src->stride*4);
-    float *src_p2 = src_p1+src->stride;
-    float *src_m1 = src_p2+src->stride;
-    float *src_m2 = src_m1+src->stride;
-    int j;
-    for(j=0;j<src->height;j++){
-        int i;
-        float *srcptr = (float*) srcp;
-        const float right_coef = srcptr[src->width-1];
-        for(i=src->width;i<src->stride;i++)
-            srcptr[i] = right_coef;
-        src_m1[0] = srcptr[0];
-        memcpy(src_m1+1, srcptr , sizeof(float)*stride_minus_1);
-        src_m2[0] = srcptr[0];
-        src_m2[1] = srcptr[0];
-        memcpy(src_m2+2, srcptr , sizeof(float)*stride_minus_2);
-        src_p1[stride_minus_1] = right_coef;
-        memcpy(src_p1, srcptr+1, sizeof(float)*stride_minus_1);
-        src_p2[stride_minus_1] = right_coef;
-        src_p2[stride_minus_2] = right_coef;
-        memcpy(src_p2, srcptr+2, sizeof(float)*stride_minus_2);
-                
-        v4sf *srcp_p1 = (v4sf*) src_p1, *srcp_p2 = (v4sf*) src_p2, *srcp_m1 = (v4sf*) src_m1, *srcp_m2 = (v4sf*) src_m2;
-        
-        for(i=0;i<iterline;i++){
-            *dstp = coeff[0]*(*srcp_m2) + coeff[1]*(*srcp_m1) + coeff[2]*(*srcp) + coeff[3]*(*srcp_p1) + coeff[4]*(*srcp_p2);
-            dstp+=1; srcp_m2 +=1; srcp_m1+=1; srcp+=1; srcp_p1+=1; srcp_p2+=1;
+    const int k = 2*conv->order+1, off = 2-conv->order;
+    #pragma omp parallel
+    {
+        float *buf = (float*) malloc(sizeof(float)*(stride+4));
+        if(buf == NULL){
+            fprintf(stderr, "Error: convolve_horiz_fast() - not enough memory !\n");
+            exit(1);
         }
+        const float *a[5] = {buf+off, buf+off+1, buf+off+2, buf+off+3, buf+off+4};
+        int j, i;
+        #pragma omp for schedule(static)
+        for(j=0 ; j<rows ; j++){
+            const float *srcptr = src + j*stride;
+            const float right_coef = srcptr[width-1];
+            buf[0] = buf[1] = srcptr[0];
+            memcpy(buf+2, srcptr, sizeof(float)*width);
+            for(i=width+2 ; i<stride+4 ; i++)
+                buf[i] = right_coef;
+            if(k==3) // constant number of taps, fully unrolled
+                convolve_row(dst + j*stride, a, coeff, 3, stride);
+            else
+                convolve_row(dst + j*stride, a, coeff, 5, stride);
+        }
+        free(buf);
     }
-    free(src_p1);
 }
 
 /* perform an horizontal convolution of an image */
 void convolve_horiz(image_t *dest, const image_t *src, const convolution_t *conv){
-    if(conv->order==1){
-        convolve_horiz_fast_3(dest,src,conv);
+    if(conv->order==1 || conv->order==2){
+        convolve_horiz_fast(dest->c1, src->c1, src->width, src->stride, src->height, conv);
         return;
-    }else if(conv->order==2){
-        convolve_horiz_fast_5(dest,src,conv);
-        return;    
     }
     float *in = src->c1;
     float * out = dest->c1;
@@ -553,12 +592,9 @@ void convolve_horiz(image_t *dest, const image_t *src, const convolution_t *conv
 
 /* perform a vertical convolution of an image */
 void convolve_vert(image_t *dest, const image_t *src, const convolution_t *conv){
-    if(conv->order==1){
-        convolve_vert_fast_3(dest,src,conv);
+    if(conv->order==1 || conv->order==2){
+        convolve_vert_fast(dest->c1, src->c1, src->stride, src->height, 1, conv);
         return;
-    }else if(conv->order==2){
-        convolve_vert_fast_5(dest,src,conv);
-        return;    
     }
     float *in = src->c1;
     float *out = dest->c1;
@@ -630,6 +666,26 @@ void convolution_delete(convolution_t *conv){
 /* perform horizontal and/or vertical convolution to a color image */
 void color_image_convolve_hv(color_image_t *dst, const color_image_t *src, const convolution_t *horiz_conv, const convolution_t *vert_conv){
     const int width = src->width, height = src->height, stride = src->stride;
+    const int plane = stride*height;
+    // fast filters on consecutive planes: all three channels at once, rows of all planes are processed in parallel
+    if( (horiz_conv == NULL || horiz_conv->order==1 || horiz_conv->order==2) && (vert_conv == NULL || vert_conv->order==1 || vert_conv->order==2) &&
+        src->c2 == src->c1+plane && src->c3 == src->c2+plane && dst->c2 == dst->c1+plane && dst->c3 == dst->c2+plane){
+        if(horiz_conv != NULL && vert_conv != NULL){
+            float *tmp_data = memalign(16, sizeof(float)*3*plane);
+            if(tmp_data == NULL){
+                fprintf(stderr,"error color_image_convolve_hv(): not enough memory\n");
+                exit(1);
+            }
+            convolve_horiz_fast(tmp_data, src->c1, width, stride, 3*height, horiz_conv);
+            convolve_vert_fast(dst->c1, tmp_data, stride, height, 3, vert_conv);
+            free(tmp_data);
+        }else if(horiz_conv != NULL){ // only horizontal
+            convolve_horiz_fast(dst->c1, src->c1, width, stride, 3*height, horiz_conv);
+        }else if(vert_conv != NULL){ // only vertical
+            convolve_vert_fast(dst->c1, src->c1, stride, height, 3, vert_conv);
+        }
+        return;
+    }
     // separate channels of images
     image_t src_red = {width,height,stride,src->c1}, src_green = {width,height,stride,src->c2}, src_blue = {width,height,stride,src->c3}, 
             dst_red = {width,height,stride,dst->c1}, dst_green = {width,height,stride,dst->c2}, dst_blue = {width,height,stride,dst->c3};
@@ -5,6 +5,10 @@
 #include "opticalflow_aux.h"
 
 #include <xmmintrin.h>
+#include <smmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 typedef __v4sf v4sf;
 
 #define datanorm 0.1f*0.1f//0.01f // square of the normalization factor
@@ -13,52 +17,94 @@ typedef __v4sf v4sf;
 #define epsilon_desc (0.001f*0.001f)//0.000001f
 #define epsilon_smooth (0.001f*0.001f)//0.000001f
 
-/* warp a color image according to a flow. src is the input image, wx and wy, the input flow. dst is the warped image and mask contains 0 or 1 if the pixels goes outside/inside image boundaries */
-#if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // use single band image_delete
-void image_warp(image_t *dst, image_t *mask, const image_t *src, const image_t *wx, const image_t *wy)
+/* load src[idx[k]] for the 4 lanes, hardware gather if available */
+static inline v4sf gather_ps(const float *src, const __m128i idx)
+{
+#ifdef __AVX2__
+    return _mm_i32gather_ps(src, idx, 4);
 #else
-void image_warp(color_image_t *dst, image_t *mask, const color_image_t *src, const image_t *wx, const image_t *wy)
+    return (v4sf) {src[_mm_extract_epi32(idx,0)], src[_mm_extract_epi32(idx,1)], src[_mm_extract_epi32(idx,2)], src[_mm_extract_epi32(idx,3)]};
 #endif
+}
+
+/* warp nch planes according to a flow, see header. Four pixels per step: positions, clamping, weights and indices in SSE, only the 4 bilinear taps are gathered */
+void image_warp_planes(float * const *dst, image_t *mask, const float * const *src, const int nch, const int src_stride, const image_t *wx, const image_t *wy)
 {
-    int i, j, offset, incr_line = mask->stride-mask->width, x, y, x1, x2, y1, y2;
-    float xx, yy, dx, dy;
-    for(j=0,offset=0 ; j<src->height ; j++)
+    const int width = wx->width, height = wx->height, stride = wx->stride, width4 = width & ~3;
+    int j;
+    #pragma omp parallel for schedule(static)
+    for(j=0 ; j<height ; j++)
     {
-        for(i=0 ; i<src->width ; i++,offset++)
+        const v4sf zero = {0.0f,0.0f,0.0f,0.0f}, one = {1.0f,1.0f,1.0f,1.0f};
+        const v4sf wm1 = _mm_set1_ps((float) (width-1)), hm1 = _mm_set1_ps((float) (height-1));
+        const __m128i sstride = _mm_set1_epi32(src_stride);
+        const v4sf yj = _mm_set1_ps((float) j);
+        v4sf xi = {0.0f,1.0f,2.0f,3.0f};
+        int i, c, offset = j*stride;
+        for(i=0 ; i<width4 ; i+=4, offset+=4)
         {
-	        xx = i+wx->c1[offset];
-	        yy = j+wy->c1[offset];
-	        x = floor(xx);
-	        y = floor(yy);
-	        dx = xx-x;
-	        dy = yy-y;
-	        mask->c1[offset] = (xx>=0 && xx<=src->width-1 && yy>=0 && yy<=src->height-1);
-	        x1 = MINMAX_TA(x,src->width);
-	        x2 = MINMAX_TA(x+1,src->width);
-	        y1 = MINMAX_TA(y,src->height);
-	        y2 = MINMAX_TA(y+1,src->height);
-	        dst->c1[offset] = 
-	            src->c1[y1*src->stride+x1]*(1.0f-dx)*(1.0f-dy) +
-	            src->c1[y1*src->stride+x2]*dx*(1.0f-dy) +
-	            src->c1[y2*src->stride+x1]*(1.0f-dx)*dy +
-	            src->c1[y2*src->stride+x2]*dx*dy;
-          #if (SELECTCHANNEL==3)
-	        dst->c2[offset] = 
-	            src->c2[y1*src->stride+x1]*(1.0f-dx)*(1.0f-dy) +
-	            src->c2[y1*src->stride+x2]*dx*(1.0f-dy) +
-	            src->c2[y2*src->stride+x1]*(1.0f-dx)*dy +
-	            src->c2[y2*src->stride+x2]*dx*dy;
-	        dst->c3[offset] = 
-	            src->c3[y1*src->stride+x1]*(1.0f-dx)*(1.0f-dy) +
-	            src->c3[y1*src->stride+x2]*dx*(1.0f-dy) +
-	            src->c3[y2*src->stride+x1]*(1.0f-dx)*dy +
-	            src->c3[y2*src->stride+x2]*dx*dy;
-          #endif
-	    }
-        offset += incr_line;
+            const v4sf xx = xi + _mm_loadu_ps(wx->c1+offset);
+            const v4sf yy = yj + _mm_loadu_ps(wy->c1+offset);
+            const v4sf xf = _mm_floor_ps(xx), yf = _mm_floor_ps(yy);
+            const v4sf dx = xx-xf, dy = yy-yf;
+            if(mask)
+                _mm_storeu_ps(mask->c1+offset, _mm_and_ps(_mm_and_ps(_mm_and_ps(_mm_cmpge_ps(xx,zero), _mm_cmple_ps(xx,wm1)), 
+                                                                     _mm_and_ps(_mm_cmpge_ps(yy,zero), _mm_cmple_ps(yy,hm1))), one));
+            // clamp in float (NaN -> 0 like the integer cast), then all values are exact integers
+            const __m128i x1 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(xf,     zero), wm1));
+            const __m128i x2 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(xf+one, zero), wm1));
+            const __m128i y1 = _mm_mullo_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(yf,     zero), hm1)), sstride);
+            const __m128i y2 = _mm_mullo_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(yf+one, zero), hm1)), sstride);
+            const __m128i i11 = _mm_add_epi32(y1,x1), i12 = _mm_add_epi32(y1,x2), i21 = _mm_add_epi32(y2,x1), i22 = _mm_add_epi32(y2,x2);
+            for(c=0 ; c<nch ; c++)
+                _mm_storeu_ps(dst[c]+offset, 
+                    gather_ps(src[c],i11)*(one-dx)*(one-dy) +
+                    gather_ps(src[c],i12)*dx*(one-dy) +
+                    gather_ps(src[c],i21)*(one-dx)*dy +
+                    gather_ps(src[c],i22)*dx*dy);
+            xi += (v4sf) {4.0f,4.0f,4.0f,4.0f};
+        }
+        for( ; i<width ; i++, offset++)
+        {
+            const float xx = i+wx->c1[offset];
+            const float yy = j+wy->c1[offset];
+            const int x = floor(xx);
+            const int y = floor(yy);
+            const float dx = xx-x;
+            const float dy = yy-y;
+            if(mask)
+                mask->c1[offset] = (xx>=0 && xx<=width-1 && yy>=0 && yy<=height-1);
+            const int x1 = MINMAX_TA(x,width);
+            const int x2 = MINMAX_TA(x+1,width);
+            const int y1 = MINMAX_TA(y,height);
+            const int y2 = MINMAX_TA(y+1,height);
+            for(c=0 ; c<nch ; c++)
+                dst[c][offset] = 
+                    src[c][y1*src_stride+x1]*(1.0f-dx)*(1.0f-dy) +
+                    src[c][y1*src_stride+x2]*dx*(1.0f-dy) +
+                    src[c][y2*src_stride+x1]*(1.0f-dx)*dy +
+                    src[c][y2*src_stride+x2]*dx*dy;
+        }
     }
 }
 
+/* warp a color image according to a flow. src is the input image, wx and wy, the input flow. dst is the warped image and mask contains 0 or 1 if the pixels goes outside/inside image boundaries */
+#if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // use single band image_delete
+void image_warp(image_t *dst, image_t *mask, const image_t *src, const image_t *wx, const image_t *wy)
+{
+    float * const d[1] = {dst->c1};
+    const float * const s[1] = {src->c1};
+    image_warp_planes(d, mask, s, 1, src->stride, wx, wy);
+}
+#else
+void image_warp(color_image_t *dst, image_t *mask, const color_image_t *src, const image_t *wx, const image_t *wy)
+{
+    float * const d[3] = {dst->c1, dst->c2, dst->c3};
+    const float * const s[3] = {src->c1, src->c2, src->c3};
+    image_warp_planes(d, mask, s, 3, src->stride, wx, wy);
+}
+#endif
+
 
 /* compute image first and second order spatio-temporal derivatives of a color image */
 #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // use single band image_delete
@@ -74,13 +120,17 @@ void get_derivatives(const color_image_t *im1, const color_image_t *im2, const c
     // derivatives are computed on the mean of the first image and the warped second image
 #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)
     image_t *tmp_im2 = image_new(im2->width,im2->height);    
-    v4sf *tmp_im2p = (v4sf*) tmp_im2->c1, *dtp = (v4sf*) dt->c1, *im1p = (v4sf*) im1->c1, *im2p = (v4sf*) im2->c1;
+    v4sf *tmp_im2p = (v4sf*) tmp_im2->c1, *dtp = (v4sf*) dt->c1, *im2p = (v4sf*) im2->c1;
     const v4sf half = {0.5f,0.5f,0.5f,0.5f};
-    int i=0;
-    for(i=0 ; i<im1->height*im1->stride/4 ; i++){
-        *tmp_im2p = half * ( (*im2p) + (*im1p) );
-        *dtp = (*im2p)-(*im1p);
-        dtp+=1; im1p+=1; im2p+=1; tmp_im2p+=1;
+    int i=0, j=0;
+    for(j=0 ; j<im1->height ; j++){ // im1 may be a strided view, e.g. on a padded image, read it row by row with unaligned loads
+        const float *im1r = im1->c1 + j*im1->stride;
+        for(i=0 ; i<im2->stride ; i+=4){
+            const v4sf im1v = _mm_loadu_ps(im1r+i);
+            *tmp_im2p = half * ( (*im2p) + im1v );
+            *dtp = (*im2p)-im1v;
+            dtp+=1; im2p+=1; tmp_im2p+=1;
+        }
     }   
     // compute all other derivatives
     image_convolve_hv(dx, tmp_im2, deriv, NULL);
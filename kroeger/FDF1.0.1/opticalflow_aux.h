@@ -9,11 +9,17 @@ extern "C" {
 
 #include "image.h"
 
+/* warp nch image planes according to a flow, bilinear interpolation with replicated border.
+   src[c] and dst[c] are planes of the size of wx/wy, dst planes share the stride of wx/wy (e.g. image_new() planes), src planes have stride src_stride (e.g. a view on a padded image).
+   mask (can be NULL) receives 1 where the warped position lies inside the image and 0 otherwise. Rows are processed in parallel with OpenMP.
+   Channel-agnostic building block of image_warp(), usable on any planar float data, e.g. to warp frames for evaluation */
+void image_warp_planes(float * const *dst, image_t *mask, const float * const *src, const int nch, const int src_stride, const image_t *wx, const image_t *wy);
+
 #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // use single band image
-/* warp a color image according to a flow. src is the input image, wx and wy, the input flow. dst is the warped image and mask contains 0 or 1 if the pixels goes outside/inside image boundaries */
+/* warp a color image according to a flow. src is the input image, wx and wy, the input flow. dst is the warped image and mask contains 0 or 1 if the pixels goes outside/inside image boundaries. src can have any stride. */
 void image_warp(image_t *dst, image_t *mask, const image_t *src, const image_t *wx, const image_t *wy);
 
-/* compute image first and second order spatio-temporal derivatives of a color image */
+/* compute image first and second order spatio-temporal derivatives of a color image. im1 can have any stride (e.g. a view on a padded image), all other images share the stride of im2 */
 void get_derivatives(const image_t *im1, const image_t *im2, const convolution_t *deriv, image_t *dx, image_t *dy, image_t *dt, image_t *dxx, image_t *dxy, image_t *dyy, image_t *dxt, image_t *dyt);
 
 #else                                     // use RGB image_new
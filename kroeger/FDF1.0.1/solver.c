@@ -10,21 +10,24 @@
 #include "solver.h"
 
 #include <xmmintrin.h>
+#include <emmintrin.h>
 typedef __v4sf v4sf;
 
 //THIS IS A SLOW VERSION BUT READABLE
 //Perform n iterations of the sor_coupled algorithm
 //du and dv are used as initial guesses
 //The system form is the same as in opticalflow.c
-void sor_coupled_slow_but_readable(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, const image_t *b1, const image_t *b2, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega)
+void sor_coupled_slow_but_readable(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, const image_t *b1, const image_t *b2, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega, sor_monitor_t *mon)
 {  
     int i,j,iter;
+    float res = 0.0f, res_first = 0.0f;
     for(iter = 0 ; iter<iterations ; iter++)
     {
-    #pragma omp parallel for
+    res = 0.0f;
+    #pragma omp parallel for reduction(+:res)
     for(j=0 ; j<du->height ; j++)
     {
-      float sigma_u,sigma_v,sum_dpsis,A11,A22,A12,B1,B2;//,det;
+      float sigma_u,sigma_v,sum_dpsis,A11,A22,A12,B1,B2,u_old,v_old;//,det;
       for(i=0 ; i<du->width ; i++)
       {
           sigma_u = 0.0f;
@@ -62,29 +65,35 @@ void sor_coupled_slow_but_readable(image_t *du, image_t *dv, image_t *a11, image
           B2 = b2->c1[j*du->stride+i]-sigma_v;
 //           du->c1[j*du->stride+i] = (1.0f-omega)*du->c1[j*du->stride+i] +omega*( A22*B1-A12*B2)/det;
 //           dv->c1[j*du->stride+i] = (1.0f-omega)*dv->c1[j*du->stride+i] +omega*(-A12*B1+A11*B2)/det;
+          u_old = du->c1[j*du->stride+i];
+          v_old = dv->c1[j*du->stride+i];
           du->c1[j*du->stride+i] = (1.0f-omega)*du->c1[j*du->stride+i] + omega/A11 *(B1 - A12* dv->c1[j*du->stride+i] );
           dv->c1[j*du->stride+i] = (1.0f-omega)*dv->c1[j*du->stride+i] + omega/A22 *(B2 - A12* du->c1[j*du->stride+i] );
-          
-          
+          res += (du->c1[j*du->stride+i]-u_old)*(du->c1[j*du->stride+i]-u_old) + (dv->c1[j*du->stride+i]-v_old)*(dv->c1[j*du->stride+i]-v_old);
       }
     }
+    if(iter==0) res_first = res;
+    if(mon && res <= mon->restol*mon->restol*res_first) { iter++; break; }
   }  
+  if(mon) { mon->res_first = res_first; mon->res_last = res; mon->iterations = iter; }
 }
 
  // THIS IS A FASTER VERSION BUT UNREADABLE, ONLY OPTICAL FLOW WITHOUT OPENMP PARALLELIZATION
  // the first iteration is separated from the other to compute the inverse of the 2x2 block diagonal
  // each iteration is split in two first line / middle lines / last line, and the left block is computed separately on each line
-void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, const image_t *b1, const image_t *b2, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega){
+// track: accumulate the squared update norm for the monitor, a compile-time constant in both calls so that sweeps without monitor skip it
+static inline __attribute__((always_inline)) void sor_coupled_sweeps(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, const image_t *b1, const image_t *b2, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega, sor_monitor_t *mon, const int track){
     //sor_coupled_slow(du,dv,a11,a12,a22,b1,b2,dpsis_horiz,dpsis_vert,iterations,omega); return; printf("test\n");
   
     if(du->width<2 || du->height<2 || iterations < 1){
-        sor_coupled_slow_but_readable(du,dv,a11,a12,a22,b1,b2,dpsis_horiz,dpsis_vert,iterations,omega);
+        sor_coupled_slow_but_readable(du,dv,a11,a12,a22,b1,b2,dpsis_horiz,dpsis_vert,iterations,omega,mon);
         return;
     }
     
     const int stride = du->stride, width = du->width;
     const int iterheight = du->height-1, iterline = (stride)/4, width_minus_1_sizeoffloat = sizeof(float)*(width-1);
     int j,iter,i,k;
+    float ddu, ddv, res = 0.0f, res_first; // res: squared norm of the sor update of the current sweep
     float *floatarray = (float*) memalign(16, stride*sizeof(float)*3); 
     if(floatarray==NULL){
         fprintf(stderr, "error in sor_coupled(): not enough memory\n");
@@ -121,13 +130,13 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vp)*(*dub) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vp)*(*dvb) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-	            dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                ddu = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ); du_ptr[0] += ddu;
+	            ddv = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] ); dv_ptr[0] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 for(k=1;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+	                ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 }
                 // increment pointer
                 hpl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -148,8 +157,8 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 for(k=0;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+	                ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 }
                 // increment pointer
                 hpl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -179,13 +188,13 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vpt)*(*dut) + (*vp)*(*dub) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vpt)*(*dvt) + (*vp)*(*dvb) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-	            dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                ddu = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ); du_ptr[0] += ddu;
+	            ddv = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] ); dv_ptr[0] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 for(k=1;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+	                ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 }
                 // increment pointer
                 hpl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -206,8 +215,8 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 for(k=0;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+	                ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 }
                 // increment pointer
                 hpl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -234,13 +243,13 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vpt)*(*dut) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vpt)*(*dvt) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-	            dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                ddu = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ); du_ptr[0] += ddu;
+	            ddv = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] ); dv_ptr[0] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 for(k=1;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+	                ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 }
                 // increment pointer
                 hpl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -261,8 +270,8 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 for(k=0;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+	                ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 }
                 // increment pointer
                 hpl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -275,8 +284,12 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
 
     
 
+   res_first = res;
    for(iter=iterations;--iter;)   // other iterations
    {
+        if(mon && res <= mon->restol*mon->restol*res_first)
+            break;
+        res = 0.0f;
         v4sf *a11p = (v4sf*) a11->c1, *a12p = (v4sf*) a12->c1, *a22p = (v4sf*) a22->c1, *b1p = (v4sf*) b1->c1, *b2p = (v4sf*) b2->c1, *hp = (v4sf*) dpsis_horiz->c1, *vp = (v4sf*) dpsis_vert->c1;
         float *du_ptr = du->c1, *dv_ptr = dv->c1;
         v4sf *dub = (v4sf*) (du_ptr+stride), *dvb = (v4sf*) (dv_ptr+stride);
@@ -292,13 +305,13 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vp)*(*dub) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vp)*(*dvb) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-	            dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                ddu = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ); du_ptr[0] += ddu;
+	            ddv = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] ); dv_ptr[0] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 for(k=1;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+	                ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 }
                 // increment pointer
                 hpl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -312,8 +325,8 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 for(k=0;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+	                ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 }
                 // increment pointer
                 hpl+=1; hp+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -337,14 +350,14 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vpt)*(*dut) + (*vp)*(*dub) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vpt)*(*dvt) + (*vp)*(*dvb) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-		dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                ddu = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ); du_ptr[0] += ddu;
+		ddv = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] ); dv_ptr[0] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 for(k=1;k<4;k++)
 		{
 		  const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
 		  const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-		  du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-		  dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+		  ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+		  ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 }
                 // increment pointer
                 hpl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -361,8 +374,8 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
 	      {
 		  const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
 		  const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-		  du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-		      dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+		  ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+		      ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
 	      }
 	      // increment pointer
 	      hpl+=1; hp+=1; vpt+=1; vp+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -382,13 +395,13 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 // do one iteration
                 const v4sf s1 = (*hp)*(*dur) + (*vpt)*(*dut) + (*b1p);
                 const v4sf s2 = (*hp)*(*dvr) + (*vpt)*(*dvt) + (*b2p);
-                du_ptr[0] += omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] );
-	            dv_ptr[0] += omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] );             
+                ddu = omega*( a11p[0][0]*s1[0] + a12p[0][0]*s2[0] - du_ptr[0] ); du_ptr[0] += ddu;
+	            ddv = omega*( a12p[0][0]*s1[0] + a22p[0][0]*s2[0] - dv_ptr[0] ); dv_ptr[0] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 for(k=1;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+	                ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 }
                 // increment pointer
                 hpl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -402,8 +415,8 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
                 for(k=0;k<4;k++){
                     const float B1 = hpl[0][k]*du_ptr[k-1] + s1[k];
                     const float B2 = hpl[0][k]*dv_ptr[k-1] + s2[k];
-                    du_ptr[k] += omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] );
-	                dv_ptr[k] += omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] );
+                    ddu = omega*( a11p[0][k]*B1 + a12p[0][k]*B2 - du_ptr[k] ); du_ptr[k] += ddu;
+	                ddv = omega*( a12p[0][k]*B1 + a22p[0][k]*B2 - dv_ptr[k] ); dv_ptr[k] += ddv; if(track) res += ddu*ddu + ddv*ddv;
                 }
                 // increment pointer
                 hpl+=1; hp+=1; vpt+=1; a11p+=1; a12p+=1; a22p+=1;
@@ -418,6 +431,104 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
 
     free(floatarray);
 
+    if(mon) { mon->res_first = res_first; mon->res_last = res; mon->iterations = (iter ? iterations-iter : iterations); }
+}
+
+void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, const image_t *b1, const image_t *b2, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega, sor_monitor_t *mon){
+    if(mon)
+        sor_coupled_sweeps(du,dv,a11,a12,a22,b1,b2,dpsis_horiz,dpsis_vert,iterations,omega,mon,1);
+    else
+        sor_coupled_sweeps(du,dv,a11,a12,a22,b1,b2,dpsis_horiz,dpsis_vert,iterations,omega,NULL,0);
+}
+
+
+// FAST VERSION FOR DEPTH (ONE UNKNOWN PER PIXEL): RED-BLACK ORDERING, SSE, ROWS IN PARALLEL WITH OPENMP
+// all pixels of one colour only depend on pixels of the other colour, so each half sweep is computed four pixels at a time on all rows in parallel; 
+// the other colour and the columns beyond the width are masked out. Boundary handling is hoisted out of the inner loop: the inverse diagonal 
+// is computed once, and neighbours outside the image have zero weight because dpsis_horiz is 0 in the last column and dpsis_vert in the last row 
+// (as computed by compute_smoothness()), only the loads across the first/last pixel of the image are special-cased
+// track: as in sor_coupled_sweeps()
+static inline __attribute__((always_inline)) void sor_coupled_DE_sweeps(image_t *du, const image_t *a11, const image_t *b1, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega, sor_monitor_t *mon, const int track)
+{
+    if(du->width<2 || du->height<2 || iterations < 1){
+        sor_coupled_slow_but_readable_DE(du,a11,b1,dpsis_horiz,dpsis_vert,iterations,omega,mon);
+        return;
+    }
+
+    const int width = du->width, height = du->height, stride = du->stride, iterline = stride/4;
+    int j, iter, c;
+    float res = 0.0f, res_first = 0.0f;
+    float *inv = (float*) memalign(16, stride*height*sizeof(float));
+    if(inv==NULL){
+        fprintf(stderr, "error in sor_coupled_DE(): not enough memory\n");
+        exit(1);
+    }
+
+    // inverse diagonal 1/(a11 + sum of neighbour weights)
+    #pragma omp parallel for
+    for(j=0 ; j<height ; j++)
+    {
+        const float *hp = dpsis_horiz->c1 + j*stride, *vp = dpsis_vert->c1 + j*stride, *vpu = vp - stride, *ap = a11->c1 + j*stride;
+        float *ip = inv + j*stride;
+        int i;
+        for(i=0 ; i<width ; i++)
+            ip[i] = 1.0f / (ap[i] + hp[i] + (i>0 ? hp[i-1] : 0.0f) + vp[i] + (j>0 ? vpu[i] : 0.0f));
+    }
+
+    const v4sf zero = {0.0f,0.0f,0.0f,0.0f}, om = {omega,omega,omega,omega};
+    const v4sf colmask[2] = {(v4sf) _mm_castsi128_ps(_mm_set_epi32(0,-1,0,-1)), (v4sf) _mm_castsi128_ps(_mm_set_epi32(-1,0,-1,0))}; // lanes 0,2 / 1,3
+    const v4sf endmask = (v4sf) _mm_castsi128_ps(_mm_set_epi32( (stride-4+3<width)?-1:0, (stride-4+2<width)?-1:0, (stride-4+1<width)?-1:0, -1)); // columns < width in last block
+
+    for(iter=0 ; iter<iterations ; iter++)
+    {
+        res = 0.0f;
+        for(c=0 ; c<2 ; c++) // red, black
+        {
+            #pragma omp parallel for reduction(+:res)
+            for(j=0 ; j<height ; j++)
+            {
+                float *up = du->c1 + j*stride;
+                const v4sf *upu = (v4sf*) ((j>0) ? up-stride : up), *upd = (v4sf*) ((j<height-1) ? up+stride : up); // outside rows have zero weight
+                const v4sf *vpu = (v4sf*) (dpsis_vert->c1 + (j-1)*stride), *vp = (v4sf*) (dpsis_vert->c1 + j*stride);
+                const v4sf *hp = (v4sf*) (dpsis_horiz->c1 + j*stride), *bp = (v4sf*) (b1->c1 + j*stride), *ip = (v4sf*) (inv + j*stride);
+                const v4sf rowmask = colmask[(j+c)&1];
+                v4sf *u = (v4sf*) up;
+                // left/right neighbours by shuffling the current, previous (already updated) and next block, instead of unaligned reloads of just written values
+                v4sf uprev = zero, hprev = zero, resv = zero;
+                int i;
+                for(i=0 ; i<iterline ; i++)
+                {
+                    const v4sf uc = u[i];
+                    const v4sf unext = (i<iterline-1) ? u[i+1] : zero;
+                    const v4sf tl = _mm_shuffle_ps(uprev, uc, _MM_SHUFFLE(0,0,3,3)), tr = _mm_shuffle_ps(unext, uc, _MM_SHUFFLE(3,3,0,0));
+                    const v4sf ul = _mm_shuffle_ps(tl, uc, _MM_SHUFFLE(2,1,2,0)), ur = _mm_shuffle_ps(uc, tr, _MM_SHUFFLE(0,2,2,1));
+                    const v4sf th = _mm_shuffle_ps(hprev, hp[i], _MM_SHUFFLE(0,0,3,3));
+                    const v4sf hl = _mm_shuffle_ps(th, hp[i], _MM_SHUFFLE(2,1,2,0));
+                    const v4sf vu = (j>0) ? vpu[i] : zero;
+                    const v4sf B = bp[i] + hl*ul + hp[i]*ur + vu*upu[i] + vp[i]*upd[i];
+                    v4sf d = om*( ip[i]*B - uc );
+                    d = _mm_and_ps(d, (i<iterline-1) ? rowmask : (v4sf) _mm_and_ps(rowmask, endmask));
+                    u[i] = uprev = uc + d;
+                    hprev = hp[i];
+                    if(track) resv += d*d;
+                }
+                if(track) res += resv[0] + resv[1] + resv[2] + resv[3];
+            }
+        }
+        if(iter==0) res_first = res;
+        if(mon && res <= mon->restol*mon->restol*res_first) { iter++; break; }
+    }
+    if(mon) { mon->res_first = res_first; mon->res_last = res; mon->iterations = iter; }
+
+    free(inv);
+}
+
+void sor_coupled_DE(image_t *du, const image_t *a11, const image_t *b1, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega, sor_monitor_t *mon)
+{
+    if(mon)
+        sor_coupled_DE_sweeps(du,a11,b1,dpsis_horiz,dpsis_vert,iterations,omega,mon,1);
+    else
+        sor_coupled_DE_sweeps(du,a11,b1,dpsis_horiz,dpsis_vert,iterations,omega,NULL,0);
 }
 
 
@@ -425,15 +536,17 @@ void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *
 //Perform n iterations of the sor_coupled algorithm
 //du is used as initial guesses
 //The system form is the same as in opticalflow.c
-void sor_coupled_slow_but_readable_DE(image_t *du, const image_t *a11, const image_t *b1, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega)
+void sor_coupled_slow_but_readable_DE(image_t *du, const image_t *a11, const image_t *b1, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega, sor_monitor_t *mon)
 {
     int i,j,iter;
+    float res = 0.0f, res_first = 0.0f;
     for(iter = 0 ; iter<iterations ; iter++)
     {
-	#pragma omp parallel for
+        res = 0.0f;
+	#pragma omp parallel for reduction(+:res)
         for(j=0 ; j<du->height ; j++)
 	{
-	  float sigma_u,sum_dpsis,A11,B1;
+	  float sigma_u,sum_dpsis,A11,B1,u_old;
 	        for(i=0 ; i<du->width ; i++){
 	            sigma_u = 0.0f;
 	            sum_dpsis = 0.0f;
@@ -459,10 +572,15 @@ void sor_coupled_slow_but_readable_DE(image_t *du, const image_t *a11, const ima
 		    }
                 A11 = a11->c1[j*du->stride+i]+sum_dpsis;
                 B1 = b1->c1[j*du->stride+i]-sigma_u;
+                u_old = du->c1[j*du->stride+i];
                 du->c1[j*du->stride+i] = (1.0f-omega)*du->c1[j*du->stride+i] +omega*( B1/A11 );
+                res += (du->c1[j*du->stride+i]-u_old)*(du->c1[j*du->stride+i]-u_old);
 	        }
 	    }
+        if(iter==0) res_first = res;
+        if(mon && res <= mon->restol*mon->restol*res_first) { iter++; break; }
     }
+    if(mon) { mon->res_first = res_first; mon->res_last = res; mon->iterations = iter; }
 }
 
 
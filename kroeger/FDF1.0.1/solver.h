@@ -7,12 +7,26 @@
 extern "C" {
 #endif
 
+// Optional convergence monitor for the sor solvers: pass NULL to always perform all iterations.
+// Otherwise the solver stops once the squared update norm of a sweep falls below restol^2 times the one of the first sweep,
+// and reports the norm of the first and last sweep and the number of sweeps performed
+typedef struct sor_monitor_s {
+    float restol;     // relative tolerance, 0 disables early stopping but still reports
+    float res_first;  // squared update norm of the first sweep
+    float res_last;   // squared update norm of the last sweep
+    int iterations;   // number of sweeps performed
+} sor_monitor_t;
+
 // Perform n iterations of the sor_coupled algorithm for a system of the form as described in opticalflow.c
-void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, const image_t *b1, const image_t *b2, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega);
+void sor_coupled(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, const image_t *b1, const image_t *b2, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega, sor_monitor_t *mon);
+
+void sor_coupled_slow_but_readable(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, const image_t *b1, const image_t *b2, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega, sor_monitor_t *mon);
 
-void sor_coupled_slow_but_readable(image_t *du, image_t *dv, image_t *a11, image_t *a12, image_t *a22, const image_t *b1, const image_t *b2, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega);
+// Perform n iterations of red-black sor for the depth system (one unknown per pixel), vectorized and parallel over rows. 
+// Expects dpsis_horiz to be 0 in the last column and dpsis_vert in the last row, as computed by compute_smoothness()
+void sor_coupled_DE(image_t *du, const image_t *a11, const image_t *b1, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega, sor_monitor_t *mon);
 
-void sor_coupled_slow_but_readable_DE(image_t *du, const image_t *a11, const image_t *b1, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega);
+void sor_coupled_slow_but_readable_DE(image_t *du, const image_t *a11, const image_t *b1, const image_t *dpsis_horiz, const image_t *dpsis_vert, const int iterations, const float omega, sor_monitor_t *mon);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,255 @@
+// Benchmark of the 3/5-tap convolutions in FDF1.0.1/image.c against the previous 4-wide SSE, single-threaded implementation (copied below as reference).
+// Reports time per call and the number of differing pixels, which is 0 unless FMA contraction (e.g. -mavx512f, -mfma) rounds both versions differently.
+//
+// Build (example, add -mavx2 / -mavx512f for 8/16-wide kernels and -fopenmp for row threading):
+//   gcc -O3 -msse4 -I../FDF1.0.1 bench_convolve.c ../FDF1.0.1/image.c -lm -o bench_convolve
+// Usage: ./bench_convolve [width height repetitions]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "image.h"
+
+#include <xmmintrin.h>
+typedef __v4sf v4sf;
+
+
+// *** Reference: previous SSE implementation
+
+static void sse_convolve_vert_fast_3(image_t *dst, const image_t *src, const convolution_t *conv){
+    const int iterline = (src->stride>>2)+1;
+    const float *coeff = conv->coeffs;
+    //const float *coeff_accu = conv->coeffs_accu;
+    v4sf *srcp = (v4sf*) src->c1, *dstp = (v4sf*) dst->c1;
+    v4sf *srcp_p1 = (v4sf*) (src->c1+src->stride);
+    int i;
+    for(i=iterline ; --i ; ){ // first line
+        *dstp = (coeff[0]+coeff[1])*(*srcp) + coeff[2]*(*srcp_p1);
+        dstp+=1; srcp+=1; srcp_p1+=1;
+    }
+    v4sf* srcp_m1 = (v4sf*) src->c1; 
+    for(i=src->height-1 ; --i ; ){ // others line
+        int j;
+        for(j=iterline ; --j ; ){
+            *dstp = coeff[0]*(*srcp_m1) + coeff[1]*(*srcp) + coeff[2]*(*srcp_p1);
+            dstp+=1; srcp_m1+=1; srcp+=1; srcp_p1+=1;
+        }
+    }       
+    for(i=iterline ; --i ; ){ // last line
+        *dstp = coeff[0]*(*srcp_m1) + (coeff[1]+coeff[2])*(*srcp);
+        dstp+=1; srcp_m1+=1; srcp+=1; 
+    }  
+}
+
+static void sse_convolve_vert_fast_5(image_t *dst, const image_t *src, const convolution_t *conv){
+    const int iterline = (src->stride>>2)+1;
+    const float *coeff = conv->coeffs;
+    //const float *coeff_accu = conv->coeffs_accu;
+    v4sf *srcp = (v4sf*) src->c1, *dstp = (v4sf*) dst->c1;
+    v4sf *srcp_p1 = (v4sf*) (src->c1+src->stride);
+    v4sf *srcp_p2 = (v4sf*) (src->c1+2*src->stride);
+    int i;
+    for(i=iterline ; --i ; ){ // first line
+        *dstp = (coeff[0]+coeff[1]+coeff[2])*(*srcp) + coeff[3]*(*srcp_p1) + coeff[4]*(*srcp_p2);
+        dstp+=1; srcp+=1; srcp_p1+=1; srcp_p2+=1;
+    }
+    v4sf* srcp_m1 = (v4sf*) src->c1;
+    for(i=iterline ; --i ; ){ // second line
+        *dstp = (coeff[0]+coeff[1])*(*srcp_m1) + coeff[2]*(*srcp) + coeff[3]*(*srcp_p1) + coeff[4]*(*srcp_p2);
+        dstp+=1; srcp_m1+=1; srcp+=1; srcp_p1+=1; srcp_p2+=1;
+    }   
+    v4sf* srcp_m2 = (v4sf*) src->c1;
+    for(i=src->height-3 ; --i ; ){ // others line
+        int j;
+        for(j=iterline ; --j ; ){
+            *dstp = coeff[0]*(*srcp_m2) + coeff[1]*(*srcp_m1) + coeff[2]*(*srcp) + coeff[3]*(*srcp_p1) + coeff[4]*(*srcp_p2);
+            dstp+=1; srcp_m2+=1;srcp_m1+=1; srcp+=1; srcp_p1+=1; srcp_p2+=1;
+        }
+    }    
+    for(i=iterline ; --i ; ){ // second to last line
+        *dstp = coeff[0]*(*srcp_m2) + coeff[1]*(*srcp_m1) + coeff[2]*(*srcp) + (coeff[3]+coeff[4])*(*srcp_p1);
+        dstp+=1; srcp_m2+=1;srcp_m1+=1; srcp+=1; srcp_p1+=1;
+    }          
+    for(i=iterline ; --i ; ){ // last line
+        *dstp = coeff[0]*(*srcp_m2) + coeff[1]*(*srcp_m1) + (coeff[2]+coeff[3]+coeff[4])*(*srcp);
+        dstp+=1; srcp_m2+=1;srcp_m1+=1; srcp+=1; 
+    }  
+}
+
+static void sse_convolve_horiz_fast_3(image_t *dst, const image_t *src, const convolution_t *conv){
+    const int stride_minus_1 = src->stride-1;
+    const int iterline = (src->stride>>2);
+    const float *coeff = conv->coeffs;
+    v4sf *srcp = (v4sf*) src->c1, *dstp = (v4sf*) dst->c1;
+    // create shifted version of src
+    float *src_p1 = (float*) malloc(sizeof(float)*src->stride),
+        *src_m1 = (float*) malloc(sizeof(float)*src->stride);
+    int j;
+    for(j=0;j<src->height;j++){
+        int i;
+        float *srcptr = (float*) srcp;
+        const float right_coef = srcptr[src->width-1];
+        for(i=src->width;i<src->stride;i++)
+            srcptr[i] = right_coef;
+        src_m1[0] = srcptr[0];
+        memcpy(src_m1+1, srcptr , sizeof(float)*stride_minus_1);
+        src_p1[stride_minus_1] = right_coef;
+        memcpy(src_p1, srcptr+1, sizeof(float)*stride_minus_1);
+        v4sf *srcp_p1 = (v4sf*) src_p1, *srcp_m1 = (v4sf*) src_m1;
+        
+        for(i=0;i<iterline;i++){
+            *dstp = coeff[0]*(*srcp_m1) + coeff[1]*(*srcp) + coeff[2]*(*srcp_p1);
+            dstp+=1; srcp_m1+=1; srcp+=1; srcp_p1+=1;
+        }
+    }
+    free(src_p1);
+    free(src_m1);
+}
+
+static void sse_convolve_horiz_fast_5(image_t *dst, const image_t *src, const convolution_t *conv){
+    const int stride_minus_1 = src->stride-1;
+    const int stride_minus_2 = src->stride-2;
+    const int iterline = (src->stride>>2);
+    const float *coeff = conv->coeffs;
+    v4sf *srcp = (v4sf*) src->c1, *dstp = (v4sf*) dst->c1;
+    float *src_p1 = (float*) malloc(sizeof(float)*src->stride*4);
+    float *src_p2 = src_p1+src->stride;
+    float *src_m1 = src_p2+src->stride;
+    float *src_m2 = src_m1+src->stride;
+    int j;
+    for(j=0;j<src->height;j++){
+        int i;
+        float *srcptr = (float*) srcp;
+        const float right_coef = srcptr[src->width-1];
+        for(i=src->width;i<src->stride;i++)
+            srcptr[i] = right_coef;
+        src_m1[0] = srcptr[0];
+        memcpy(src_m1+1, srcptr , sizeof(float)*stride_minus_1);
+        src_m2[0] = srcptr[0];
+        src_m2[1] = srcptr[0];
+        memcpy(src_m2+2, srcptr , sizeof(float)*stride_minus_2);
+        src_p1[stride_minus_1] = right_coef;
+        memcpy(src_p1, srcptr+1, sizeof(float)*stride_minus_1);
+        src_p2[stride_minus_1] = right_coef;
+        src_p2[stride_minus_2] = right_coef;
+        memcpy(src_p2, srcptr+2, sizeof(float)*stride_minus_2);
+                
+        v4sf *srcp_p1 = (v4sf*) src_p1, *srcp_p2 = (v4sf*) src_p2, *srcp_m1 = (v4sf*) src_m1, *srcp_m2 = (v4sf*) src_m2;
+        
+        for(i=0;i<iterline;i++){
+            *dstp = coeff[0]*(*srcp_m2) + coeff[1]*(*srcp_m1) + coeff[2]*(*srcp) + coeff[3]*(*srcp_p1) + coeff[4]*(*srcp_p2);
+            dstp+=1; srcp_m2 +=1; srcp_m1+=1; srcp+=1; srcp_p1+=1; srcp_p2+=1;
+        }
+    }
+    free(src_p1);
+}
+
+
+static void sse_convolve_horiz(image_t *dst, const image_t *src, const convolution_t *conv){
+    if(conv->order==1) sse_convolve_horiz_fast_3(dst,src,conv); else sse_convolve_horiz_fast_5(dst,src,conv);
+}
+
+static void sse_convolve_vert(image_t *dst, const image_t *src, const convolution_t *conv){
+    if(conv->order==1) sse_convolve_vert_fast_3(dst,src,conv); else sse_convolve_vert_fast_5(dst,src,conv);
+}
+
+static void sse_color_image_convolve_hv(color_image_t *dst, const color_image_t *src, const convolution_t *horiz_conv, const convolution_t *vert_conv){
+    image_t src_c[3] = {{src->width,src->height,src->stride,src->c1}, {src->width,src->height,src->stride,src->c2}, {src->width,src->height,src->stride,src->c3}};
+    image_t dst_c[3] = {{dst->width,dst->height,dst->stride,dst->c1}, {dst->width,dst->height,dst->stride,dst->c2}, {dst->width,dst->height,dst->stride,dst->c3}};
+    int c;
+    for(c=0 ; c<3 ; c++){
+        if(horiz_conv) sse_convolve_horiz(&dst_c[c],&src_c[c],horiz_conv);
+        else           sse_convolve_vert(&dst_c[c],&src_c[c],vert_conv);
+    }
+}
+
+
+// *** Benchmark
+
+static double now_ms(){
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000.0 + tv.tv_usec/1000.0;
+}
+
+static int compare(const float *a, const float *b, const int width, const int height, const int stride){
+    int i, j, diff = 0;
+    for(j=0 ; j<height ; j++)
+        for(i=0 ; i<width ; i++)
+            diff += (a[j*stride+i] != b[j*stride+i]);
+    return diff;
+}
+
+int main(int argc, char **argv){
+    const int width  = (argc > 3) ? atoi(argv[1]) : 1024;
+    const int height = (argc > 3) ? atoi(argv[2]) : 436;
+    const int reps   = (argc > 3) ? atoi(argv[3]) : 200;
+
+    // filters used by the variational refinement: derivatives (5 taps) and flow derivatives (3 taps)
+    float deriv_filter[3] = {0.0f, -8.0f/12.0f, 1.0f/12.0f};
+    float deriv_filter_flow[2] = {0.0f, -0.5f};
+    convolution_t *conv[2] = {convolution_new(2, deriv_filter, 0), convolution_new(1, deriv_filter_flow, 0)};
+
+    color_image_t *src = color_image_new(width, height), *dst_ref = color_image_new(width, height), *dst = color_image_new(width, height);
+    int i, j, c, r;
+    for(j=0 ; j<3*height ; j++)
+        for(i=0 ; i<src->stride ; i++)
+            src->c1[j*src->stride+i] = 128.0f + 100.0f*sinf(0.05f*i + 0.3f*(j%height)) * cosf(0.07f*j);
+    image_t src_gray = {width, height, src->stride, src->c1}, dst_gray_ref = {width, height, src->stride, dst_ref->c1}, dst_gray = {width, height, src->stride, dst->c1};
+
+    printf("image %ix%i, %i repetitions", width, height, reps);
+    #if defined(__AVX512F__)
+    printf(" (new: 16-wide)");
+    #elif defined(__AVX__)
+    printf(" (new: 8-wide)");
+    #else
+    printf(" (new: 4-wide)");
+    #endif
+    #ifdef _OPENMP
+    printf(", OpenMP\n");
+    #else
+    printf("\n");
+    #endif
+    printf("%-28s %10s %10s %8s %s\n", "", "SSE (ms)", "new (ms)", "speedup", "diff. pixels");
+
+    for(c=0 ; c<2 ; c++){
+        const char *names[2] = {"5-tap", "3-tap"};
+        double t0, t1, t2;
+        char label[64];
+
+        // gray, horizontal
+        t0 = now_ms(); for(r=0 ; r<reps ; r++) sse_convolve_horiz(&dst_gray_ref, &src_gray, conv[c]);
+        t1 = now_ms(); for(r=0 ; r<reps ; r++) convolve_horiz(&dst_gray, &src_gray, conv[c]);
+        t2 = now_ms();
+        sprintf(label, "%s horizontal, gray", names[c]);
+        printf("%-28s %10.3f %10.3f %7.2fx %i\n", label, (t1-t0)/reps, (t2-t1)/reps, (t1-t0)/(t2-t1), compare(dst_gray_ref.c1, dst_gray.c1, width, height, src->stride));
+
+        // gray, vertical
+        t0 = now_ms(); for(r=0 ; r<reps ; r++) sse_convolve_vert(&dst_gray_ref, &src_gray, conv[c]);
+        t1 = now_ms(); for(r=0 ; r<reps ; r++) convolve_vert(&dst_gray, &src_gray, conv[c]);
+        t2 = now_ms();
+        sprintf(label, "%s vertical, gray", names[c]);
+        printf("%-28s %10.3f %10.3f %7.2fx %i\n", label, (t1-t0)/reps, (t2-t1)/reps, (t1-t0)/(t2-t1), compare(dst_gray_ref.c1, dst_gray.c1, width, height, src->stride));
+
+        // color, horizontal
+        t0 = now_ms(); for(r=0 ; r<reps ; r++) sse_color_image_convolve_hv(dst_ref, src, conv[c], NULL);
+        t1 = now_ms(); for(r=0 ; r<reps ; r++) color_image_convolve_hv(dst, src, conv[c], NULL);
+        t2 = now_ms();
+        sprintf(label, "%s horizontal, RGB", names[c]);
+        printf("%-28s %10.3f %10.3f %7.2fx %i\n", label, (t1-t0)/reps, (t2-t1)/reps, (t1-t0)/(t2-t1), compare(dst_ref->c1, dst->c1, width, 3*height, src->stride));
+
+        // color, vertical
+        t0 = now_ms(); for(r=0 ; r<reps ; r++) sse_color_image_convolve_hv(dst_ref, src, NULL, conv[c]);
+        t1 = now_ms(); for(r=0 ; r<reps ; r++) color_image_convolve_hv(dst, src, NULL, conv[c]);
+        t2 = now_ms();
+        sprintf(label, "%s vertical, RGB", names[c]);
+        printf("%-28s %10.3f %10.3f %7.2fx %i\n", label, (t1-t0)/reps, (t2-t1)/reps, (t1-t0)/(t2-t1), compare(dst_ref->c1, dst->c1, width, 3*height, src->stride));
+    }
+
+    color_image_delete(src); color_image_delete(dst_ref); color_image_delete(dst);
+    convolution_delete(conv[0]); convolution_delete(conv[1]);
+    return 0;
+}
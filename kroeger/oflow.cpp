@@ -3,6 +3,8 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <limits>
+#include <algorithm>
 
 #include <thread>
 
@@ -16,6 +18,7 @@
 
 #include <sys/time.h>    // timeof day
 #include <stdio.h>
+#include <malloc.h>
 
 #include "oflow.h"
 #include "patchgrid.h"
@@ -56,11 +59,31 @@ namespace OFC
                   const int tv_innerit_in,
                   const int tv_solverit_in,
                   const float tv_sor_in,
+                  const float tv_restol_in,
+                  const float tv_tilethresh_in,
+                  const bool usebatchopt_in,
+                  const float lowtex_thresh_in,
+                  const int p_rowstep_in,
+                  const densemodes * modes_in,
                   const int verbosity_in)
   : im_ao(im_ao_in), im_ao_dx(im_ao_dx_in), im_ao_dy(im_ao_dy_in),
     im_bo(im_bo_in), im_bo_dx(im_bo_dx_in), im_bo_dy(im_bo_dy_in)
 {
-
+  const char * modeerr = CheckModes(modes_in);
+  if (modeerr != nullptr)
+  {
+    cout << "OFClass: " << modeerr << ", nothing computed" << endl;
+    return;
+  }
+  const densemodes md = (modes_in != nullptr) ? *modes_in : densemodes();
+  const unsigned char * roi_in = md.roi;
+  incstate * inc_in = md.inc;
+  deadlinestate * dl_in = md.dl;
+  scalepolicy * sp_in = md.sp;
+  const scaleschedule * sched_in = md.sched;
+  const tileinfo * tile_in = md.tile;
+  patchflow * pf_in = md.pf;
+  globalmotion * gm_in = md.gm;
 
   #ifdef WITH_OPENMP
     if (verbosity_in>1)
@@ -73,13 +96,7 @@ namespace OFC
   #endif //DWITH_OPENMP
 
   // Parse optimization parameters
-  #if (SELECTMODE==1)
-  op.nop = 2;
-  #else
-  op.nop = 1;
-  #endif
   op.p_samp_s = p_samp_s_in;  // patch has even border length, center pixel is at (p_samp_s/2, p_samp_s/2) (ZERO INDEXED!)
-  op.outlierthresh = (float)op.p_samp_s/2;
   op.patove = patove_in;
   op.sc_f = sc_f_in;
   op.sc_l = sc_l_in;
@@ -88,14 +105,11 @@ namespace OFC
   op.dp_thresh = dp_thresh_in*dp_thresh_in; // saves the square to compare with squared L2-norm (saves sqrt operation)
   op.dr_thresh = dr_thresh_in;
   op.res_thresh = res_thresh_in;
-  op.steps = std::max(1,  (int)floor(op.p_samp_s*(1-op.patove)));
-  op.novals = noc_in * (p_samp_s_in)*(p_samp_s_in);
   op.usefbcon = usefbcon_in;
   op.costfct = costfct_in;
   op.noc = noc_in;
   op.patnorm = patnorm_in;
   op.verbosity = verbosity_in;
-  op.noscales = op.sc_f-op.sc_l+1;
   op.usetvref = usetvref_in;
   op.tv_alpha = tv_alpha_in;
   op.tv_gamma = tv_gamma_in;
@@ -103,14 +117,34 @@ namespace OFC
   op.tv_innerit = tv_innerit_in;
   op.tv_solverit = tv_solverit_in;
   op.tv_sor = tv_sor_in;
-  op.normoutlier_tmpbsq = (v4sf) {op.normoutlier*op.normoutlier, op.normoutlier*op.normoutlier, op.normoutlier*op.normoutlier, op.normoutlier*op.normoutlier};
-  op.normoutlier_tmp2bsq = __builtin_ia32_mulps(op.normoutlier_tmpbsq, op.twos);
-  op.normoutlier_tmp4bsq = __builtin_ia32_mulps(op.normoutlier_tmpbsq, op.fours);
+  op.tv_restol = tv_restol_in;
+  op.tv_tilethresh = tv_tilethresh_in;
+  op.usebatchopt = usebatchopt_in;
+  op.lowtex_thresh = lowtex_thresh_in;
+  op.p_rowstep = p_rowstep_in;
+  SetDerivedParams(op);
+
+  // Per-scale parameters, with the schedule's overrides
+  ops.assign(op.noscales, op);
+  if (sched_in != nullptr)
+  {
+    for (int sl=op.sc_f; sl>=op.sc_l; --sl)
+    {
+      optparam & o = ops[sl-op.sc_l];
+      const scaleschedule & sc = sched_in[sl];
+      if (sc.p_samp_s > 0)  o.p_samp_s = std::min(sc.p_samp_s, imgpadding_in);
+      if (sc.patove >= 0)   o.patove = sc.patove;
+      if (sc.max_iter > 0)  o.max_iter = sc.max_iter;
+      if (sc.min_iter > 0)  o.min_iter = sc.min_iter;
+      o.min_iter = std::min(o.min_iter, o.max_iter);
+      SetDerivedParams(o);
+    }
+  }
 
 
   // Variables for algorithm timings
   struct timeval tv_start_all, tv_end_all, tv_start_all_global, tv_end_all_global;
-  if (op.verbosity>0)
+  if (op.verbosity>0 || dl_in != nullptr)
     gettimeofday(&tv_start_all_global, nullptr);
 
   // ... per each scale
@@ -128,47 +162,113 @@ namespace OFC
   if (op.verbosity>1) gettimeofday(&tv_start_all, nullptr);
 
 
+  SetCamParams(width_in, height_in, imgpadding_in, tile_in);
+
+  // Incremental mode: both images are compared with the previous frame's on a coarse scale. Only changed tiles (plus the usual margin 
+  // on coarser scales) are computed, as a region of interest. Within it, patches of unchanged tiles keep their previous parameters and 
+  // are not optimized, and the refinement skips unchanged tiles, which finally get the previous output flow.
+  // Any mismatch with the previous frame (first frame, other size, scales, patch size or overlap on any scale, forward-backward 
+  // merging) recomputes everything, e.g. a frame after a scalepolicy changed sc_f.
+  const int sc_t = std::min(op.sc_l + 2, op.sc_f);
+  const int noval_t = cpl[sc_t-op.sc_l].width * cpl[sc_t-op.sc_l].height * op.noc;
+  bool useinc = (inc_in != nullptr) && inc_in->im_ao_t.size() == (size_t)noval_t && 
+                inc_in->flow.size() == (size_t)(cpl[0].width * cpl[0].height * op.nop) &&
+                inc_in->sc_f == op.sc_f && inc_in->sc_l == op.sc_l && inc_in->usefbcon == op.usefbcon &&
+                inc_in->p_fw.size() == (size_t)op.noscales && inc_in->p_bw.size() == (size_t)op.noscales &&
+                inc_in->p_samp_s.size() == (size_t)op.noscales && inc_in->patove.size() == (size_t)op.noscales;
+  for (int i = 0; useinc && i < op.noscales; ++i)
+    useinc = inc_in->p_samp_s[i] == ops[i].p_samp_s && inc_in->patove[i] == ops[i].patove &&
+             inc_in->p_fw[i].size() == (size_t)(cpl[i].width * cpl[i].height * op.nop) &&
+             inc_in->p_bw[i].size() == (size_t)(op.usefbcon ? cpl[i].width * cpl[i].height * op.nop : 0);
+  tilechg.clear();
+  if (useinc)
+    ChangedTiles(inc_in, sc_t);
+  if (inc_in != nullptr && !useinc) // parameters of the patch with midpoint (x,y) on each scale at (y*width+x)*nop, NaN if never computed
+  {
+    inc_in->sc_f = op.sc_f;
+    inc_in->sc_l = op.sc_l;
+    inc_in->usefbcon = op.usefbcon;
+    inc_in->p_samp_s.resize(op.noscales);
+    inc_in->patove.resize(op.noscales);
+    inc_in->p_fw.resize(op.noscales);
+    inc_in->p_bw.resize(op.noscales);
+    for (int i = 0; i < op.noscales; ++i)
+    {
+      inc_in->p_samp_s[i] = ops[i].p_samp_s;
+      inc_in->patove[i] = ops[i].patove;
+      inc_in->p_fw[i].assign(cpl[i].width * cpl[i].height * op.nop, std::numeric_limits<float>::quiet_NaN());
+      inc_in->p_bw[i].assign(op.usefbcon ? cpl[i].width * cpl[i].height * op.nop : 0, std::numeric_limits<float>::quiet_NaN());
+    }
+  }
+
+  // Region of interest on each scale, a pixel is in it if any of the pixels it covers on the finest scale is
+  roi.resize(op.noscales);
+  if (roi_in != nullptr)
+  {
+    vector<unsigned char> roi_sc(roi_in, roi_in + width_in*height_in), roi_tmp;
+    for (int sl=0; sl<=op.sc_f; ++sl)
+    {
+      if (sl > 0)
+      {
+        roi_tmp.resize((width_in >> sl) * (height_in >> sl));
+        DownscaleROI(roi_sc.data(), roi_tmp.data(), width_in >> sl, height_in >> sl);
+        roi_sc.swap(roi_tmp);
+      }
+      if (sl >= op.sc_l)
+        roi[sl-op.sc_l] = roi_sc;
+    }
+  }
+  if (useinc) // changed tiles within the region of interest on the last scale, and the same pooled on coarser scales
+  {
+    const int ts = op.tv_tilesz;
+    roi[0].resize(cpl[0].width * cpl[0].height, 1);
+    for (int y = 0; y < cpl[0].height; ++y)
+      for (int x = 0; x < cpl[0].width; ++x)
+        roi[0][y*cpl[0].width + x] = roi[0][y*cpl[0].width + x] && tilechg[(y/ts)*inc_ntw + x/ts];
+    for (int i = 1; i < op.noscales; ++i)
+    {
+      roi[i].resize(cpl[i].width * cpl[i].height);
+      DownscaleROI(roi[i-1].data(), roi[i].data(), cpl[i].width, cpl[i].height);
+    }
+  }
+
+  // Global motion: fitted on scale sl_gm, optionally the last one computed, finer grids are then not created. Optical flow only
+  const bool usegm = (gm_in != nullptr);
+  const int sl_gm = usegm ? ((gm_in->sc < 0) ? op.sc_l : std::min(std::max(gm_in->sc, op.sc_l), op.sc_f)) : op.sc_l;
+  const bool onlymotion = usegm && gm_in->onlymotion;
+
   // Create grids on each scale
   vector<OFC::PatGridClass*> grid_fw(op.noscales);
   vector<OFC::PatGridClass*> grid_bw(op.noscales); // grid for backward OF computation, only needed if 'usefbcon' is set to 1.
-  vector<float*> flow_fw(op.noscales);
-  vector<float*> flow_bw(op.noscales);
-  cpl.resize(op.noscales);
-  cpr.resize(op.noscales);
-  for (int sl=op.sc_f; sl>=op.sc_l; --sl)
+  vector<flowfield> flow_fw(op.noscales); // planar, stride-aligned flow of each scale, handed to the variational refinement without copy
+  vector<flowfield> flow_bw(op.noscales);
+  // In anytime mode each scale's grids are only created once it is reached, scales skipped by the deadline cost nothing
+  const bool usedl = (dl_in != nullptr) && dl_in->budget_ms > 0;
+  auto creategrids = [&](const int i)
   {
-    int i = sl-op.sc_l;
-
-    float sc_fct = pow(2,-sl); // scaling factor at current scale
-    cpl[i].sc_fct = sc_fct;
-    cpl[i].height = height_in * sc_fct;
-    cpl[i].width = width_in * sc_fct;
-    cpl[i].imgpadding = imgpadding_in;
-    cpl[i].tmp_lb = -(float)op.p_samp_s/2;
-    cpl[i].tmp_ubw = (float) (cpl[i].width +op.p_samp_s/2-2);
-    cpl[i].tmp_ubh = (float) (cpl[i].height+op.p_samp_s/2-2);
-    cpl[i].tmp_w = cpl[i].width + 2*imgpadding_in;
-    cpl[i].tmp_h = cpl[i].height+ 2*imgpadding_in;
-    cpl[i].curr_lv = sl;
-    cpl[i].camlr = 0;
+    const int sl = i+op.sc_l;
 
+    cpl[i].roi = roi[i].empty() ? nullptr : roi[i].data();   // same region for the backward grid, motion is covered by the margin
+    cpl[i].roimargin = (sl > op.sc_l) ? ops[i].p_samp_s/2 : 0; // context for coarse-to-fine initialization and the refinement on the next scale
+    cpr[i].roi = cpl[i].roi;
+    cpr[i].roimargin = cpl[i].roimargin;
 
-    cpr[i] = cpl[i];
-    cpr[i].camlr = 1;
-
-    flow_fw[i]   = new float[op.nop * cpl[i].width * cpl[i].height];
-    grid_fw[i]   = new OFC::PatGridClass(&(cpl[i]), &(cpr[i]), &op);
+    AllocFlowPlanes(&(flow_fw[i]), cpl[i].width, cpl[i].height);
+    grid_fw[i]   = new OFC::PatGridClass(&(cpl[i]), &(cpr[i]), &(ops[i]));
 
     if (op.usefbcon) // for merging forward and backward flow
     {
-      flow_bw[i] = new float[op.nop * cpr[i].width * cpr[i].height];
-      grid_bw[i] = new OFC::PatGridClass(&(cpr[i]), &(cpl[i]), &op);
+      AllocFlowPlanes(&(flow_bw[i]), cpr[i].width, cpr[i].height);
+      grid_bw[i] = new OFC::PatGridClass(&(cpr[i]), &(cpl[i]), &(ops[i]));
 
       // Make grids known to each other, necessary for AggregateFlowDense();
       grid_fw[i]->SetComplGrid( grid_bw[i] );
       grid_bw[i]->SetComplGrid( grid_fw[i] );
     }
-  }
+  };
+  if (!usedl)
+    for (int sl=op.sc_f; sl>=(onlymotion ? sl_gm : op.sc_l); --sl)
+      creategrids(sl-op.sc_l);
 
 
   // Timing, Grid memory allocation
@@ -180,17 +280,79 @@ namespace OFC
   }
 
 
+  // Forward and backward (left and right camera) grids only interact in the densification, which merges both. 
+  // Without OpenMP the backward grid is processed on a second thread, concurrently with the forward grid: 
+  // initialization to optimization, then densification and variational refinement. With OpenMP each grid already uses all threads.
+  #ifdef WITH_OPENMP
+  const bool usefbthread = false;
+  #else
+  const bool usefbthread = op.usefbcon;
+  #endif
+
+  auto reuseunchanged = [&](PatGridClass * grid, const vector<float> & p_prev, const int sl)
+  {
+    vector<unsigned char> keep(grid->GetNoPatches());
+    for (int i = 0; i < grid->GetNoPatches(); ++i)
+    {
+      const Eigen::Vector2f pt = grid->GetRefPatchPos(i);
+      const int ph = ops[sl-op.sc_l].p_samp_s/2;
+      keep[i] = !RegionChanged(sl, pt[0] - ph, pt[1] - ph, pt[0] + ph-1, pt[1] + ph-1);
+    }
+    grid->ReuseParams(keep.data(), p_prev.data());
+  };
+
+  // Anytime mode: time per patch of each scale, from the last call where available
+  if (dl_in != nullptr && dl_in->ms_per_patch.size() != (size_t)op.noscales)
+    dl_in->ms_per_patch.assign(op.noscales, 0.0f);
+  struct timeval tv_start_sc, tv_now;
+  int sl_done = op.sc_l;
+
+  // Lazy densification: the last scale's patches are handed out for sampling, its dense flow is optionally not computed
+  const bool skipdense = (pf_in != nullptr) && !pf_in->densify;
+
+  // Global motion, fitted on scale sl_gm (see above)
+  bool gmdone = false;
+  auto fitmotion = [&](const int sl)
+  {
+    if (op.verbosity>1) gettimeofday(&tv_now, nullptr);
+    FitGlobalMotion(grid_fw[sl-op.sc_l], sl, gm_in);
+    gmdone = true;
+    if (op.verbosity>1)
+    {
+      struct timeval tv_gm;
+      gettimeofday(&tv_gm, nullptr);
+      double tt = (tv_gm.tv_sec-tv_now.tv_sec)*1000.0f + (tv_gm.tv_usec-tv_now.tv_usec)/1000.0f;
+      printf("TIME (Global motion: sc %i, %i patches, %5.1f%% inliers) (ms): %3g\n", sl, gm_in->nopatches, 100.0f * gm_in->inlierfrac, tt);
+    }
+  };
+
   // *** Main loop; Operate over scales, coarse-to-fine
   for (int sl=op.sc_f; sl>=op.sc_l; --sl)
   {
     int ii = sl-op.sc_l;
 
     if (op.verbosity>1) gettimeofday(&tv_start_all, nullptr);
+    if (dl_in != nullptr) gettimeofday(&tv_start_sc, nullptr);
+    if (usedl)
+      creategrids(ii);
+
+    std::thread thread_bw;
+    if (usefbthread)
+      thread_bw = std::thread([&]()
+      {
+        grid_bw[ii]->InitializeGrid(im_bo[sl], im_bo_dx[sl], im_bo_dy[sl]);
+        grid_bw[ii]->SetTargetImage(im_ao[sl], im_ao_dx[sl], im_ao_dy[sl]);
+        if (sl < op.sc_f)
+          grid_bw[ii]->InitializeFromCoarserOF(&(flow_bw[ii+1]));
+        if (useinc)
+          reuseunchanged(grid_bw[ii], inc_in->p_bw[ii], sl);
+        grid_bw[ii]->Optimize();
+      });
 
     // Initialize grid (Step 1 in Algorithm 1 of paper)
     grid_fw[ii]->  InitializeGrid(im_ao[sl], im_ao_dx[sl], im_ao_dy[sl]);
     grid_fw[ii]->  SetTargetImage(im_bo[sl], im_bo_dx[sl], im_bo_dy[sl]);
-    if (op.usefbcon)
+    if (op.usefbcon && !usefbthread)
     {
       grid_bw[ii]->InitializeGrid(im_bo[sl], im_bo_dx[sl], im_bo_dy[sl]);
       grid_bw[ii]->SetTargetImage(im_ao[sl], im_ao_dx[sl], im_ao_dy[sl]);
@@ -208,15 +370,22 @@ namespace OFC
     // Initialization from previous scale, or to zero at first iteration. (Step 2 in Algorithm 1 of paper)
     if (sl < op.sc_f)
     {
-      grid_fw[ii]->InitializeFromCoarserOF(flow_fw[ii+1]); // initialize from flow at previous coarser scale
+      grid_fw[ii]->InitializeFromCoarserOF(&(flow_fw[ii+1])); // initialize from flow at previous coarser scale
 
       // Initialize backward flow
-      if (op.usefbcon)
-        grid_bw[ii]->InitializeFromCoarserOF(flow_bw[ii+1]);
+      if (op.usefbcon && !usefbthread)
+        grid_bw[ii]->InitializeFromCoarserOF(&(flow_bw[ii+1]));
     }
     else if (sl == op.sc_f && initflow != nullptr) // initialization given input flow
     {
-      grid_fw[ii]->InitializeFromCoarserOF(initflow); // initialize from flow at coarser scale
+      flowfield flow_init = InterleavedFlow((float*) initflow, cpl[ii].width/2);
+      grid_fw[ii]->InitializeFromCoarserOF(&flow_init); // initialize from flow at coarser scale
+    }
+    if (useinc)
+    {
+      reuseunchanged(grid_fw[ii], inc_in->p_fw[ii], sl);
+      if (op.usefbcon && !usefbthread)
+        reuseunchanged(grid_bw[ii], inc_in->p_bw[ii], sl);
     }
 
     // Timing, Grid initialization
@@ -231,8 +400,20 @@ namespace OFC
 
     // Dense Inverse Search. (Step 3 in Algorithm 1 of paper)
     grid_fw[ii]->Optimize();
-    if (op.usefbcon)
+    if (op.usefbcon && !usefbthread)
       grid_bw[ii]->Optimize();
+    if (thread_bw.joinable())
+      thread_bw.join();
+
+    if (usegm && sl == sl_gm)
+    {
+      fitmotion(sl);
+      if (onlymotion)
+      {
+        sl_done = sl;
+        break;
+      }
+    }
 
 //     if (op.verbosity==4) // needed for verbosity >= 3, DISVISUAL
 //     {
@@ -260,15 +441,66 @@ namespace OFC
 
 
     // Densification. (Step 4 in Algorithm 1 of paper)
-    float *tmp_ptr = flow_fw[ii];
-    if (sl == op.sc_l)
-      tmp_ptr = outflow;
-
-    grid_fw[ii]->AggregateFlowDense(tmp_ptr);
-
-    if (op.usefbcon && sl > op.sc_l )  // skip at last scale, backward flow no longer needed
-      grid_bw[ii]->AggregateFlowDense(flow_bw[ii]);
-
+    // Planar into the scale's flow buffer, refinement then works in-place. Without refinement the last scale goes straight into outflow.
+    const bool densify = !(skipdense && sl == op.sc_l);
+    flowfield flow_out = InterleavedFlow(outflow, cpl[ii].width);
+    const flowfield * tmp_ptr = &(flow_fw[ii]);
+    if (sl == op.sc_l && !op.usetvref)
+      tmp_ptr = &flow_out;
+
+    // Backward flow: densification, tile residuals and variational refinement, skipped at last scale, backward flow no longer needed
+    const int tilesz = ops[ii].tv_tilesz;
+    const int notiles = ((cpl[ii].width + tilesz - 1) / tilesz) * ((cpl[ii].height + tilesz - 1) / tilesz);
+    vector<float> tileerr_fw, tileerr_bw;
+    // Tiles outside the region of interest, or unchanged in incremental mode, have residual -inf, without residual threshold all others are refined
+    const bool usetiles = densify && op.usetvref && (op.tv_tilethresh > 0 || cpl[ii].roi != nullptr || useinc);
+    auto selecttiles = [&](vector<float> * tileerr)
+    {
+      if (op.tv_tilethresh <= 0)
+        for (float & e : *tileerr)
+          if (e > -std::numeric_limits<float>::infinity())
+            e = std::numeric_limits<float>::infinity();
+      if (useinc)
+      {
+        const int ts = tilesz, ntw = (cpl[ii].width + ts - 1) / ts;
+        for (int t = 0; t < notiles; ++t)
+          if (!RegionChanged(sl, (t%ntw)*ts, (t/ntw)*ts, (t%ntw+1)*ts-1, (t/ntw+1)*ts-1))
+            (*tileerr)[t] = -std::numeric_limits<float>::infinity();
+      }
+    };
+    auto densify_bw = [&]()
+    {
+      grid_bw[ii]->AggregateFlowDense(&(flow_bw[ii]));
+      if (usetiles)
+      {
+        tileerr_bw.resize(notiles);
+        grid_bw[ii]->AggregateErrorTiles(tileerr_bw.data(), tilesz);
+        selecttiles(&tileerr_bw);
+      }
+    };
+    auto refine_bw = [&]()
+    {
+      if (op.usetvref)
+        OFC::VarRefClass varref_bw(im_bo[sl], im_bo_dx[sl], im_bo_dy[sl],
+                                  im_ao[sl], im_ao_dx[sl], im_ao_dy[sl]
+                                  ,&(cpr[ii]), &(cpl[ii]), &(ops[ii]), &(flow_bw[ii]), (tileerr_bw.empty() ? nullptr : tileerr_bw.data()));
+    };
+    if (usefbthread && sl > op.sc_l)
+      thread_bw = std::thread([&]() { densify_bw(); refine_bw(); });
+
+    if (densify)
+      grid_fw[ii]->AggregateFlowDense(tmp_ptr);
+
+    if (op.usefbcon && !usefbthread && sl > op.sc_l)
+      densify_bw();
+
+    // Image residual of densified flow on tiles, selects where the variational refinement is run
+    if (usetiles)
+    {
+      tileerr_fw.resize(notiles);
+      grid_fw[ii]->AggregateErrorTiles(tileerr_fw.data(), tilesz);
+      selecttiles(&tileerr_fw);
+    }
 
     // Timing, Densification
     if (op.verbosity>1)
@@ -282,28 +514,76 @@ namespace OFC
 
 
     // Variational refinement, (Step 5 in Algorithm 1 of paper)
-    if (op.usetvref)
+    int tv_it_inner = 0, tv_it_solver = 0, tv_px = 0; // iterations and pixels actually used by forward refinement, reported if early stopping / tiling is enabled
+    if (op.usetvref && densify)
     {
       OFC::VarRefClass varref_fw(im_ao[sl], im_ao_dx[sl], im_ao_dy[sl],
                                 im_bo[sl], im_bo_dx[sl], im_bo_dy[sl]
-                                ,&(cpl[ii]), &(cpr[ii]), &op, tmp_ptr);
+                                ,&(cpl[ii]), &(cpr[ii]), &(ops[ii]), tmp_ptr, (tileerr_fw.empty() ? nullptr : tileerr_fw.data()));
+      tv_it_inner = varref_fw.GetInnerIterations();
+      tv_it_solver = varref_fw.GetSolverIterations();
+      tv_px = varref_fw.GetRefinedPixels();
 
-      if (op.usefbcon  && sl > op.sc_l )    // skip at last scale, backward flow no longer needed
-          OFC::VarRefClass varref_bw(im_bo[sl], im_bo_dx[sl], im_bo_dy[sl],
-                                    im_ao[sl], im_ao_dx[sl], im_ao_dy[sl]
-                                    ,&(cpr[ii]), &(cpl[ii]), &op, flow_bw[ii]);
+      if (op.usefbcon && !usefbthread && sl > op.sc_l)
+        refine_bw();
+
+      if (sl == op.sc_l) // only copy of the flow on the last scale: planar to interleaved output
+        CopyFlow(&(flow_fw[ii]), &flow_out, cpl[ii].width, cpl[ii].height);
     }
 
+    if (thread_bw.joinable())
+      thread_bw.join();
+
     // Timing, Variational Refinement
     if (op.verbosity>1)
     {
       gettimeofday(&tv_end_all, nullptr);
       tt_tvopt[ii] = (tv_end_all.tv_sec-tv_start_all.tv_sec)*1000.0f + (tv_end_all.tv_usec-tv_start_all.tv_usec)/1000.0f;
       tt_all[ii] += tt_tvopt[ii];
-      printf("TIME (Sc: %i, #p:%6i, pconst, pinit, poptim, cflow, tvopt, total): %8.2f %8.2f %8.2f %8.2f %8.2f -> %8.2f ms.\n", sl, grid_fw[ii]->GetNoPatches(), tt_patconstr[ii], tt_patinit[ii], tt_patoptim[ii], tt_compflow[ii], tt_tvopt[ii], tt_all[ii]);
+      printf("TIME (Sc: %i, #p:%6i, ps %2i, ov %.2f, it %2i/%2i, pconst, pinit, poptim, cflow, tvopt, total): %8.2f %8.2f %8.2f %8.2f %8.2f -> %8.2f ms.\n", sl, grid_fw[ii]->GetNoPatches(), 
+             ops[ii].p_samp_s, ops[ii].patove, ops[ii].min_iter, ops[ii].max_iter, tt_patconstr[ii], tt_patinit[ii], tt_patoptim[ii], tt_compflow[ii], tt_tvopt[ii], tt_all[ii]);
+      if (op.usetvref && op.tv_restol > 0)
+      {
+        int tv_maxinner = op.tv_innerit * (cpl[ii].curr_lv+1);
+        printf("TIME (Sc: %i, TV inner it. %i/%i, solver it. %i/%i)\n", sl, tv_it_inner, tv_maxinner, tv_it_solver, tv_maxinner*op.tv_solverit);
+      }
+      if (op.usetvref && (op.tv_tilethresh > 0 || cpl[ii].roi != nullptr))
+        printf("TIME (Sc: %i, TV refined area %5.1f%%)\n", sl, 100.0f * tv_px / (cpl[ii].width * cpl[ii].height));
+      if (op.lowtex_thresh > 0)
+        printf("TIME (Sc: %i, textureless patches skipped %5.1f%%)\n", sl, 100.0f * grid_fw[ii]->GetNoLowTexPatches() / grid_fw[ii]->GetNoPatches());
+      if (cpl[ii].roi != nullptr)
+        printf("TIME (Sc: %i, region of interest: patches %5.1f%%)\n", sl, 100.0f * grid_fw[ii]->GetNoPatches() / (grid_fw[ii]->GetNopw() * grid_fw[ii]->GetNoph()));
     }
 
 
+    // Anytime mode: progressive result, then stop if the next scale is predicted to exceed the budget. 
+    // Its cost is its patch count, four times this scale's (for equal patch spacing), times the time per patch of the last call's next scale if known, else of this scale.
+    if (dl_in != nullptr)
+    {
+      if (dl_in->onscale != nullptr && densify)
+        dl_in->onscale(dl_in->userdata, sl, tmp_ptr, cpl[ii].width, cpl[ii].height);
+
+      gettimeofday(&tv_now, nullptr);
+      const float tt_sc = (tv_now.tv_sec-tv_start_sc.tv_sec)*1000.0f + (tv_now.tv_usec-tv_start_sc.tv_usec)/1000.0f;
+      const float tt_el = (tv_now.tv_sec-tv_start_all_global.tv_sec)*1000.0f + (tv_now.tv_usec-tv_start_all_global.tv_usec)/1000.0f;
+      dl_in->ms_per_patch[ii] = tt_sc / std::max(grid_fw[ii]->GetNoPatches(), 1);
+
+      if (usedl && sl > op.sc_l)
+      {
+        const float mspp = (dl_in->ms_per_patch[ii-1] > 0) ? dl_in->ms_per_patch[ii-1] : dl_in->ms_per_patch[ii];
+        const float stepr = (float)ops[ii].steps / ops[ii-1].steps;
+        const float tt_next = mspp * 4 * stepr*stepr * grid_fw[ii]->GetNoPatches();
+        if (tt_el + tt_next > dl_in->budget_ms)
+        {
+          sl_done = sl;
+          if (op.verbosity>1)
+            printf("TIME (Deadline: stop after scale %i, %.2f ms elapsed, scale %i predicted %.2f ms, budget %.2f ms)\n", sl, tt_el, sl-1, tt_next, dl_in->budget_ms);
+          UpsampleFlow(&(flow_fw[ii]), cpl[ii].width, cpl[ii].height, outflow, 1 << ii);
+          break;
+        }
+      }
+    }
+
 //     if (op.verbosity==3) // Display displacement result of this scale // needed for verbosity >= 3, DISVISUAL
 //     {
 //       // Display Grid on current scale
@@ -336,16 +616,81 @@ namespace OFC
 
   }
 
+  if (dl_in != nullptr)
+    dl_in->sc_done = sl_done;
+
+  if (usegm && !gmdone) // deadline stopped before sl_gm
+    fitmotion(sl_done);
+
+  if (pf_in != nullptr)
+  {
+    grid_fw[sl_done-op.sc_l]->GetPatchFlow(pf_in);
+    pf_in->sc = sl_done;
+  }
+
+  // Incremental mode: previous output in unchanged tiles, keep images, patch parameters and output for the next frame
+  if (inc_in != nullptr)
+  {
+    const int w = cpl[0].width, h = cpl[0].height, ts = op.tv_tilesz;
+    int nochg = 0;
+    if (useinc)
+    {
+      for (int t = 0; t < inc_ntw*inc_nth; ++t)
+      {
+        nochg += tilechg[t];
+        if (tilechg[t])
+          continue;
+        for (int y = (t/inc_ntw)*ts; y < std::min((t/inc_ntw+1)*ts, h); ++y)
+          for (int x = (t%inc_ntw)*ts; x < std::min((t%inc_ntw+1)*ts, w); ++x)
+            for (int c = 0; c < op.nop; ++c)
+              outflow[(y*w + x)*op.nop + c] = inc_in->flow[(y*w + x)*op.nop + c];
+      }
+    }
+    inc_in->changedfrac = useinc ? (float)nochg / (inc_ntw*inc_nth) : 1.0f;
+    inc_in->flow.assign(outflow, outflow + w*h*op.nop);
+
+    const camparam & cpt = cpl[sc_t-op.sc_l];
+    inc_in->im_ao_t.resize(noval_t);
+    inc_in->im_bo_t.resize(noval_t);
+    for (int y = 0; y < cpt.height; ++y)
+    {
+      const int io = ((y + cpt.imgpadding) * cpt.tmp_w + cpt.imgpadding) * op.noc;
+      std::copy(im_ao[sc_t] + io, im_ao[sc_t] + io + cpt.width*op.noc, inc_in->im_ao_t.begin() + y*cpt.width*op.noc);
+      std::copy(im_bo[sc_t] + io, im_bo[sc_t] + io + cpt.width*op.noc, inc_in->im_bo_t.begin() + y*cpt.width*op.noc);
+    }
+    for (int i = sl_done-op.sc_l; i < op.noscales; ++i) // scales skipped by the deadline keep their previous parameters
+    {
+      grid_fw[i]->GetParams(inc_in->p_fw[i].data());
+      if (op.usefbcon)
+        grid_bw[i]->GetParams(inc_in->p_bw[i].data());
+    }
+
+    if (op.verbosity>1)
+      printf("TIME (Incremental: tiles recomputed %5.1f%%)\n", 100.0f * inc_in->changedfrac);
+  }
+
+  // Adaptive pyramid depth: outlier resets of all computed scales and the output flow give the coarsest scale of the next frame
+  if (sp_in != nullptr)
+  {
+    int nooutl = 0, nopat = 0;
+    for (int i = sl_done-op.sc_l; i < op.noscales; ++i)
+    {
+      nooutl += grid_fw[i]->GetNoOutlierPatches();
+      nopat += grid_fw[i]->GetNoPatches();
+    }
+    UpdateScalePolicy(sp_in, outflow, roi_in, (float)nooutl / std::max(nopat, 1));
+  }
+
   // Clean up
   for (int sl=op.sc_f; sl>=op.sc_l; --sl)
   {
 
-    delete[] flow_fw[sl-op.sc_l];
+    FreeFlowPlanes(&(flow_fw[sl-op.sc_l]));
     delete grid_fw[sl-op.sc_l];
 
     if (op.usefbcon)
     {
-      delete[] flow_bw[sl-op.sc_l];
+      FreeFlowPlanes(&(flow_bw[sl-op.sc_l]));
       delete grid_bw[sl-op.sc_l];
     }
   }
@@ -360,6 +705,573 @@ namespace OFC
   }
 
 
+}
+
+  OFClass::OFClass(const float ** im_ao_in, const float ** im_ao_dx_in, const float ** im_ao_dy_in,
+                  const float ** im_bo_in, const float ** im_bo_dx_in, const float ** im_bo_dy_in,
+                  const int imgpadding_in,
+                  const int nopoints_in,
+                  const float * points_in,
+                  float * outflow,
+                  float * outres,
+                  const int width_in, const int height_in,
+                  const int sc_f_in, const int sc_l_in,
+                  const int max_iter_in, const int min_iter_in,
+                  const float  dp_thresh_in,
+                  const float  dr_thresh_in,
+                  const float res_thresh_in,
+                  const int p_samp_s_in,
+                  const int costfct_in,
+                  const int noc_in,
+                  const int patnorm_in,
+                  const bool usebatchopt_in,
+                  const int verbosity_in)
+  : im_ao(im_ao_in), im_ao_dx(im_ao_dx_in), im_ao_dy(im_ao_dy_in),
+    im_bo(im_bo_in), im_bo_dx(im_bo_dx_in), im_bo_dy(im_bo_dy_in)
+{
+  // Parse optimization parameters, no densification, forward-backward merging or variational refinement
+  op.p_samp_s = p_samp_s_in;
+  op.patove = 0.0f;
+  op.sc_f = sc_f_in;
+  op.sc_l = sc_l_in;
+  op.max_iter = max_iter_in;
+  op.min_iter = min_iter_in;
+  op.dp_thresh = dp_thresh_in*dp_thresh_in;
+  op.dr_thresh = dr_thresh_in;
+  op.res_thresh = res_thresh_in;
+  op.usefbcon = false;
+  op.costfct = costfct_in;
+  op.noc = noc_in;
+  op.patnorm = patnorm_in;
+  op.verbosity = verbosity_in;
+  op.usetvref = false;
+  op.tv_alpha = op.tv_gamma = op.tv_delta = op.tv_sor = op.tv_restol = op.tv_tilethresh = 0.0f;
+  op.tv_innerit = op.tv_solverit = 0;
+  op.usebatchopt = usebatchopt_in;
+  op.lowtex_thresh = 0.0f;
+  op.p_rowstep = 1;
+  SetDerivedParams(op);
+  ops.assign(op.noscales, op);
+
+  struct timeval tv_start_all, tv_end_all, tv_start_all_global, tv_end_all_global;
+  if (op.verbosity>0)
+    gettimeofday(&tv_start_all_global, nullptr);
+
+  // One reference patch per query point on each scale. Pixel x lies at (x+.5)*sc_fct-.5 on a coarser scale, a patch with 
+  // integer midpoint pt covers [pt-p_samp_s/2, pt+p_samp_s/2-1], i.e. is centered at pt-.5. Target patches are sampled at the 
+  // exact midpoint (and, for depth, on the integer rows), so midpoints are rounded
+  if (op.verbosity>1) gettimeofday(&tv_start_all, nullptr);
+  SetCamParams(width_in, height_in, imgpadding_in, nullptr);
+  vector<OFC::PatGridClass*> grid(op.noscales);
+  for (int sl=op.sc_f; sl>=op.sc_l; --sl)
+  {
+    int i = sl-op.sc_l;
+    vector<Eigen::Vector2f> pts(nopoints_in);
+    for (int ip = 0; ip < nopoints_in; ++ip)
+      pts[ip] = Eigen::Vector2f(round((points_in[2*ip] + 0.5f) * cpl[i].sc_fct), round((points_in[2*ip+1] + 0.5f) * cpl[i].sc_fct));
+    grid[i] = new OFC::PatGridClass(&(cpl[i]), &(cpr[i]), &op, pts);
+  }
+
+  if (op.verbosity>1)
+  {
+    gettimeofday(&tv_end_all, nullptr);
+    double tt_gridconst = (tv_end_all.tv_sec-tv_start_all.tv_sec)*1000.0f + (tv_end_all.tv_usec-tv_start_all.tv_usec)/1000.0f;
+    printf("TIME (Grid Memo. Alloc. ) (ms): %3g\n", tt_gridconst);
+  }
+
+  // *** Main loop; Operate over scales, coarse-to-fine, each patch initialized with its own doubled displacement on the coarser scale
+  for (int sl=op.sc_f; sl>=op.sc_l; --sl)
+  {
+    int ii = sl-op.sc_l;
+
+    if (op.verbosity>1) gettimeofday(&tv_start_all, nullptr);
+
+    grid[ii]->InitializeGrid(im_ao[sl], im_ao_dx[sl], im_ao_dy[sl]);
+    grid[ii]->SetTargetImage(im_bo[sl], im_bo_dx[sl], im_bo_dy[sl]);
+    if (sl < op.sc_f)
+      grid[ii]->InitializeFromCoarserGrid(grid[ii+1]);
+
+    grid[ii]->Optimize();
+
+    if (op.verbosity>1)
+    {
+      gettimeofday(&tv_end_all, nullptr);
+      double tt = (tv_end_all.tv_sec-tv_start_all.tv_sec)*1000.0f + (tv_end_all.tv_usec-tv_start_all.tv_usec)/1000.0f;
+      printf("TIME (Sc: %i, #p:%6i, sparse) -> %8.2f ms.\n", sl, grid[ii]->GetNoPatches(), tt);
+    }
+  }
+
+  // Displacement on the finest scale, residual of the last computed one
+  const float sc_out = pow(2, op.sc_l);
+  for (int ip = 0; ip < nopoints_in; ++ip)
+  {
+    const Eigen::Vector2f fl = grid[0]->GetQuePatchPos(ip) - grid[0]->GetRefPatchPos(ip);
+    outflow[ip*op.nop] = fl[0] * sc_out;
+    if (op.nop > 1)
+      outflow[ip*op.nop+1] = fl[1] * sc_out;
+    if (outres != nullptr)
+      outres[ip] = grid[0]->GetQuePatchRes(ip);
+  }
+
+  for (int sl=op.sc_f; sl>=op.sc_l; --sl)
+    delete grid[sl-op.sc_l];
+
+  if (op.verbosity>0)
+  {
+    gettimeofday(&tv_end_all_global, nullptr);
+    double tt = (tv_end_all_global.tv_sec-tv_start_all_global.tv_sec)*1000.0f + (tv_end_all_global.tv_usec-tv_start_all_global.tv_usec)/1000.0f;
+    printf("TIME (Sparse Run-Time   ) (ms): %3g\n", tt);
+  }
+}
+
+void OFClass::SetDerivedParams(optparam & o) const
+{
+  #if (SELECTMODE==1)
+  o.nop = 2;
+  #else
+  o.nop = 1;
+  #endif
+  o.outlierthresh = (float)o.p_samp_s/2;
+  o.steps = std::max(1,  (int)floor(o.p_samp_s*(1-o.patove)));
+  o.novals = o.noc * (o.p_samp_s)*(o.p_samp_s);
+  if (o.costfct==10) // NCC matches mean-normalized patches
+    o.patnorm = 1;
+  o.noscales = o.sc_f-o.sc_l+1;
+  o.tv_tilesz = o.p_samp_s;
+  // sparse sampling only in the batched optimizer with whole v4sf patch rows and cost functions 0-2
+  if (o.p_rowstep > 1 && (o.p_samp_s * o.noc) % 4 == 0 && o.costfct <= 2)
+    o.usebatchopt = true;
+  else
+    o.p_rowstep = 1;
+  o.novals_opt = o.noc * o.p_samp_s * ((o.p_samp_s + o.p_rowstep - 1) / o.p_rowstep);
+  o.normoutlier_tmpbsq = (v4sf) {o.normoutlier*o.normoutlier, o.normoutlier*o.normoutlier, o.normoutlier*o.normoutlier, o.normoutlier*o.normoutlier};
+  o.normoutlier_tmp2bsq = __builtin_ia32_mulps(o.normoutlier_tmpbsq, o.twos);
+  o.normoutlier_tmp4bsq = __builtin_ia32_mulps(o.normoutlier_tmpbsq, o.fours);
+}
+
+void OFClass::SetCamParams(const int width, const int height, const int imgpadding, const tileinfo * tile)
+{
+  cpl.resize(op.noscales);
+  cpr.resize(op.noscales);
+  for (int sl=op.sc_f; sl>=op.sc_l; --sl)
+  {
+    int i = sl-op.sc_l;
+
+    float sc_fct = pow(2,-sl); // scaling factor at current scale
+    cpl[i].sc_fct = sc_fct;
+    cpl[i].height = height * sc_fct;
+    cpl[i].width = width * sc_fct;
+    cpl[i].imgpadding = imgpadding;
+    cpl[i].tmp_lb = -(float)ops[i].p_samp_s/2;
+    cpl[i].tmp_ubw = (float) (cpl[i].width +ops[i].p_samp_s/2-2);
+    cpl[i].tmp_ubh = (float) (cpl[i].height+ops[i].p_samp_s/2-2);
+    cpl[i].tmp_w = cpl[i].width + 2*imgpadding;
+    cpl[i].tmp_h = cpl[i].height+ 2*imgpadding;
+    cpl[i].curr_lv = sl;
+    cpl[i].camlr = 0;
+    if (tile != nullptr)
+    {
+      cpl[i].tile_x = tile->x * sc_fct;
+      cpl[i].tile_y = tile->y * sc_fct;
+      cpl[i].frame_w = tile->frame_width * sc_fct;
+      cpl[i].frame_h = tile->frame_height * sc_fct;
+    }
+
+    cpr[i] = cpl[i];
+    cpr[i].camlr = 1;
+  }
+}
+
+void OFClass::AllocFlowPlanes(flowfield * fl, const int width, const int height) const
+{
+  // same layout as FDF image_new(): rows padded to a multiple of 4, 16-byte aligned planes
+  fl->pxstep = 1;
+  fl->stride = ( (width+3) / 4 ) * 4;
+  fl->u = (float*) memalign(16, op.nop * fl->stride * height * sizeof(float));
+  fl->v = (op.nop > 1) ? (fl->u + fl->stride * height) : nullptr;
+}
+
+void OFClass::FreeFlowPlanes(flowfield * fl) const
+{
+  free(fl->u);
+  fl->u = nullptr;
+  fl->v = nullptr;
+}
+
+flowfield OFClass::InterleavedFlow(float * fl, const int width) const
+{
+  flowfield fli;
+  fli.u = fl;
+  fli.v = (op.nop > 1) ? (fl + 1) : nullptr;
+  fli.pxstep = op.nop;
+  fli.stride = op.nop * width;
+  return fli;
+}
+
+void OFClass::CopyFlow(const flowfield * src, const flowfield * dst, const int width, const int height) const
+{
+  for (int y = 0; y < height; ++y)
+  {
+    const float * su = src->u + y*src->stride;
+    float * du = dst->u + y*dst->stride;
+    for (int x = 0; x < width; ++x, su+=src->pxstep, du+=dst->pxstep)
+      (*du) = (*su);
+
+    if (op.nop > 1)
+    {
+      const float * sv = src->v + y*src->stride;
+      float * dv = dst->v + y*dst->stride;
+      for (int x = 0; x < width; ++x, sv+=src->pxstep, dv+=dst->pxstep)
+        (*dv) = (*sv);
+    }
+  }
+}
+
+void OFClass::UpsampleFlow(const flowfield * src, const int width_src, const int height_src, float * dst, const int fct) const
+{
+  // pixel x of dst lies at (x+1/2)/fct-1/2 of src, samples clamped to src
+  const int w = width_src*fct, h = height_src*fct;
+  for (int y = 0; y < h; ++y)
+  {
+    const float ys = std::min(std::max((y + 0.5f) / fct - 0.5f, 0.0f), (float)(height_src-1));
+    const int y0 = (int)ys, y1 = std::min(y0+1, height_src-1);
+    const float wy = ys - y0;
+    for (int x = 0; x < w; ++x)
+    {
+      const float xs = std::min(std::max((x + 0.5f) / fct - 0.5f, 0.0f), (float)(width_src-1));
+      const int x0 = (int)xs, x1 = std::min(x0+1, width_src-1);
+      const float wx = xs - x0;
+      const int i00 = y0*src->stride + x0*src->pxstep, i01 = y0*src->stride + x1*src->pxstep;
+      const int i10 = y1*src->stride + x0*src->pxstep, i11 = y1*src->stride + x1*src->pxstep;
+
+      float * d = dst + (y*w + x)*op.nop;
+      d[0] = fct * ((1-wy) * ((1-wx)*src->u[i00] + wx*src->u[i01]) + wy * ((1-wx)*src->u[i10] + wx*src->u[i11]));
+      if (op.nop > 1)
+        d[1] = fct * ((1-wy) * ((1-wx)*src->v[i00] + wx*src->v[i01]) + wy * ((1-wx)*src->v[i10] + wx*src->v[i11]));
+    }
+  }
+}
+
+void OFClass::UpdateScalePolicy(scalepolicy * sp, const float * flow, const unsigned char * roi_in, const float outlierfrac) const
+{
+  // quantile of the flow magnitude on every 2nd pixel of every 2nd row, within the region of interest
+  const int w = cpl[0].width, h = cpl[0].height, wi = w << op.sc_l;
+  vector<float> mag;
+  mag.reserve(((w+1)/2) * ((h+1)/2));
+  for (int y = 0; y < h; y += 2)
+    for (int x = 0; x < w; x += 2)
+      if (roi_in == nullptr || roi_in[(y << op.sc_l) * wi + (x << op.sc_l)])
+      {
+        const float * f = flow + (y*w + x)*op.nop;
+        mag.push_back(op.nop > 1 ? sqrt(f[0]*f[0] + f[1]*f[1]) : std::abs(f[0]));
+      }
+  float m = 0.0f;
+  if (!mag.empty())
+  {
+    vector<float>::iterator q = mag.begin() + std::min((size_t)(sp->quantile * mag.size()), mag.size()-1);
+    std::nth_element(mag.begin(), q, mag.end());
+    m = (*q) * (1 << op.sc_l);
+  }
+
+  // fast attack, slow decay. Coarsest scale as in run_dense's choice from the image width (motion of width/5 there): 
+  // the largest one where the motion is still at least half a patch. Outlier spikes indicate motion beyond the capture range
+  const bool spike = outlierfrac > std::max(sp->outlier_spike, 4.0f * sp->outlierbase);
+  sp->motion = (sp->motion < 0) ? m : std::max(m, sp->decay * sp->motion);
+  sp->outlierfrac = outlierfrac;
+  sp->outlierbase = sp->decay * sp->outlierbase + (1.0f - sp->decay) * outlierfrac;
+  if (spike)
+    sp->sc_f = sp->sc_max;
+  else
+    sp->sc_f = std::min(std::max((int)floor(log2(2.0f * std::max(sp->motion, 1.0f) / op.p_samp_s)), sp->sc_min), sp->sc_max);
+
+  if (op.verbosity>1)
+    printf("TIME (Scale policy: motion %.2f px, outliers %5.1f%%, next first scale %i)\n", sp->motion, 100.0f * outlierfrac, sp->sc_f);
+}
+
+void OFClass::ChangedTiles(const incstate * inc, const int sc_t)
+{
+  const camparam & cpt = cpl[sc_t-op.sc_l];
+  const int ts = op.tv_tilesz;
+  const float f = pow(2, op.sc_l - sc_t); // scale sc_l -> test scale
+  inc_ntw = (cpl[0].width  + ts - 1) / ts;
+  inc_nth = (cpl[0].height + ts - 1) / ts;
+
+  // mean absolute difference of each image to the previous frame's, on the part of the test scale covered by the tile
+  vector<unsigned char> chg(inc_ntw*inc_nth, 0);
+  for (int ty = 0; ty < inc_nth; ++ty)
+  {
+    const int y0 = std::min((int)floor(ty*ts*f), cpt.height-1), y1 = std::max(std::min((int)ceil((ty+1)*ts*f), cpt.height), y0+1);
+    for (int tx = 0; tx < inc_ntw; ++tx)
+    {
+      const int x0 = std::min((int)floor(tx*ts*f), cpt.width-1), x1 = std::max(std::min((int)ceil((tx+1)*ts*f), cpt.width), x0+1);
+      float da = 0.0f, db = 0.0f;
+      for (int y = y0; y < y1; ++y)
+      {
+        const int io = ((y + cpt.imgpadding) * cpt.tmp_w + cpt.imgpadding) * op.noc;
+        const int it = y * cpt.width * op.noc;
+        for (int x = x0*op.noc; x < x1*op.noc; ++x)
+        {
+          da += std::abs(im_ao[sc_t][io + x] - inc->im_ao_t[it + x]);
+          db += std::abs(im_bo[sc_t][io + x] - inc->im_bo_t[it + x]);
+        }
+      }
+      const float thr = inc->thresh * (x1-x0) * (y1-y0) * op.noc;
+      chg[ty*inc_ntw + tx] = (da > thr || db > thr);
+    }
+  }
+
+  // dilate by one tile, motion into or out of a changed tile
+  tilechg.assign(inc_ntw*inc_nth, 0);
+  for (int ty = 0; ty < inc_nth; ++ty)
+    for (int tx = 0; tx < inc_ntw; ++tx)
+      if (chg[ty*inc_ntw + tx])
+        for (int dy = std::max(ty-1, 0); dy <= std::min(ty+1, inc_nth-1); ++dy)
+          for (int dx = std::max(tx-1, 0); dx <= std::min(tx+1, inc_ntw-1); ++dx)
+            tilechg[dy*inc_ntw + dx] = 1;
+}
+
+bool OFClass::RegionChanged(const int sl, const float x0, const float y0, const float x1, const float y1) const
+{
+  if (tilechg.empty())
+    return true;
+
+  // pixels [x0,x1] on scale sl cover [x0*f, (x1+1)*f-1] on scale sc_l
+  const float f = pow(2, sl - op.sc_l), ts = op.tv_tilesz;
+  const int tx0 = std::max((int)floor(x0*f / ts), 0), tx1 = std::min((int)floor(((x1+1)*f-1) / ts), inc_ntw-1);
+  const int ty0 = std::max((int)floor(y0*f / ts), 0), ty1 = std::min((int)floor(((y1+1)*f-1) / ts), inc_nth-1);
+  for (int ty = ty0; ty <= ty1; ++ty)
+    for (int tx = tx0; tx <= tx1; ++tx)
+      if (tilechg[ty*inc_ntw + tx])
+        return true;
+  return false;
+}
+
+void OFClass::DownscaleROI(const unsigned char * src, unsigned char * dst, const int width, const int height) const
+{
+  for (int y = 0; y < height; ++y)
+  {
+    const unsigned char * s0 = src + (2*y) * (2*width);
+    const unsigned char * s1 = s0 + 2*width;
+    for (int x = 0; x < width; ++x)
+      dst[y*width + x] = (s0[2*x] | s0[2*x+1] | s1[2*x] | s1[2*x+1]) ? 1 : 0;
+  }
+}
+
+void OFClass::FitGlobalMotion(const PatGridClass * grid, const int sl, globalmotion * gm) const
+{
+  // Correspondences in pixels of the finest image: a patch with midpoint pt on scale sl is centered at pt-.5, i.e. at pt*2^sl-.5.
+  // Patches reset as outliers or kept as textureless carry no motion. Weights as in the densification, 1/max(minerrval, residual)
+  const double fct = (double)(1 << sl);
+  vector<Eigen::Vector2d> src, dst;
+  vector<double> wgt;
+  for (int i = 0; i < grid->GetNoPatches(); ++i)
+  {
+    if (!grid->IsOptimizedPatch(i))
+      continue;
+    const Eigen::Vector2f pt = grid->GetRefPatchPos(i), fl = grid->GetQuePatchPos(i) - pt;
+    src.push_back(Eigen::Vector2d(pt[0]*fct - .5, pt[1]*fct - .5));
+    dst.push_back(src.back() + Eigen::Vector2d(fl[0]*fct, fl[1]*fct));
+    wgt.push_back(1.0 / std::max(op.minerrval, grid->GetQuePatchRes(i)));
+  }
+  const int n = src.size(), nmin = (gm->model == 0) ? 2 : 4;
+  const double thresh = gm->inlier_thresh * fct;
+  gm->sc_fit = sl;
+  gm->nopatches = n;
+  gm->inlierfrac = 0.0f;
+  Eigen::Matrix3d H = Eigen::Matrix3d::Identity();
+
+  // Weighted least squares on the correspondences idx[0..m-1]. Similarity in closed form about the weighted centroids, 
+  // homography by the normalized DLT: for a minimal sample the exact solution of the 8x8 system with h[8]=1, otherwise the right singular 
+  // vector of the smallest singular value of the 9x9 normal matrix. False if degenerate
+  auto fit = [&](const int * idx, const int m, const double * w, Eigen::Matrix3d * Hf) -> bool
+  {
+    double sw = 0;
+    Eigen::Vector2d cs(0, 0), cd(0, 0);
+    for (int k = 0; k < m; ++k)
+    {
+      sw += w[k];
+      cs += w[k] * src[idx[k]];
+      cd += w[k] * dst[idx[k]];
+    }
+    if (sw <= 0)
+      return false;
+    cs /= sw;
+    cd /= sw;
+    if (gm->model == 0)
+    {
+      double ss = 0, sa = 0, sb = 0;
+      for (int k = 0; k < m; ++k)
+      {
+        const Eigen::Vector2d a = src[idx[k]] - cs, b = dst[idx[k]] - cd;
+        ss += w[k] * a.squaredNorm();
+        sa += w[k] * (a[0]*b[0] + a[1]*b[1]);
+        sb += w[k] * (a[0]*b[1] - a[1]*b[0]);
+      }
+      if (ss < 1e-6 * sw)
+        return false;
+      Eigen::Matrix2d R;
+      R << sa/ss, -sb/ss, sb/ss, sa/ss;
+      Hf->setIdentity();
+      Hf->topLeftCorner<2,2>() = R;
+      Hf->topRightCorner<2,1>() = cd - R*cs;
+      return true;
+    }
+
+    double ds = 0, dd = 0;
+    for (int k = 0; k < m; ++k)
+    {
+      ds += w[k] * (src[idx[k]] - cs).norm();
+      dd += w[k] * (dst[idx[k]] - cd).norm();
+    }
+    if (ds < 1e-6 * sw || dd < 1e-6 * sw)
+      return false;
+    const double ns = sqrt(2.0) * sw / ds, nd = sqrt(2.0) * sw / dd; // mean distance sqrt(2) from the centroid
+    Eigen::Matrix<double, 9, 9> M = Eigen::Matrix<double, 9, 9>::Zero();
+    Eigen::Matrix<double, 8, 9> A8;
+    for (int k = 0; k < m; ++k)
+    {
+      const Eigen::Vector2d a = ns * (src[idx[k]] - cs), b = nd * (dst[idx[k]] - cd);
+      Eigen::Matrix<double, 9, 1> r0, r1;
+      r0 << a[0], a[1], 1, 0, 0, 0, -b[0]*a[0], -b[0]*a[1], -b[0];
+      r1 << 0, 0, 0, a[0], a[1], 1, -b[1]*a[0], -b[1]*a[1], -b[1];
+      if (m == 4)
+      {
+        A8.row(2*k) = r0.transpose();
+        A8.row(2*k+1) = r1.transpose();
+      }
+      else
+        M += w[k] * (r0 * r0.transpose() + r1 * r1.transpose());
+    }
+    Eigen::Matrix<double, 9, 1> h;
+    if (m == 4)
+    {
+      const Eigen::PartialPivLU<Eigen::Matrix<double, 8, 8>> lu(A8.leftCols<8>());
+      if (!(std::abs(lu.determinant()) > 1e-12))
+        return false;
+      h.head<8>() = lu.solve(-A8.col(8));
+      h[8] = 1;
+    }
+    else
+    {
+      Eigen::JacobiSVD<Eigen::Matrix<double, 9, 9>> svd(M, Eigen::ComputeFullV);
+      h = svd.matrixV().col(8);
+    }
+    Eigen::Matrix3d Hn, Ts, Td;
+    Hn << h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7], h[8];
+    Ts << ns, 0, -ns*cs[0], 0, ns, -ns*cs[1], 0, 0, 1;
+    Td << 1/nd, 0, cd[0], 0, 1/nd, cd[1], 0, 0, 1;
+    *Hf = Td * Hn * Ts;
+    if (std::abs((*Hf)(2,2)) < 1e-12)
+      return false;
+    *Hf /= (*Hf)(2,2);
+    return true;
+  };
+  auto transfererr = [&](const Eigen::Matrix3d & Hf, const int i) -> double
+  {
+    const Eigen::Vector3d p = Hf * Eigen::Vector3d(src[i][0], src[i][1], 1);
+    if (p[2] <= 1e-12)
+      return std::numeric_limits<double>::infinity();
+    return (p.head<2>() / p[2] - dst[i]).norm();
+  };
+
+  if (n >= nmin)
+  {
+    // RANSAC: hypothesis k from a minimal set drawn with seed k, scored by the summed weights of its inliers. 
+    // Hypotheses are split over threads, the best one (lowest k on ties) does not depend on their number
+    const int noit = std::max(gm->ransac_iter, 1);
+    const int nothreads = std::max(1, std::min((int)std::thread::hardware_concurrency(), noit / 32));
+    vector<double> bestscore(nothreads, -1.0);
+    vector<int> bestk(nothreads, -1);
+    vector<Eigen::Matrix3d> bestH(nothreads, Eigen::Matrix3d::Identity());
+    auto hypotheses = [&](const int t)
+    {
+      const double ones[4] = {1, 1, 1, 1};
+      for (int k = t; k < noit; k += nothreads)
+      {
+        unsigned int seed = 2654435761u * (k+1);
+        int idx[4];
+        for (int j = 0; j < nmin; ++j)
+        {
+          bool dup = true;
+          while (dup)
+          {
+            seed = seed * 1103515245u + 12345u;
+            idx[j] = (seed >> 8) % n;
+            dup = false;
+            for (int l = 0; l < j; ++l)
+              dup |= (idx[l] == idx[j]);
+          }
+        }
+        if (nmin == 4) // no three of the four points collinear
+        {
+          bool degen = false;
+          for (int a = 0; a < 4; ++a)
+          {
+            const Eigen::Vector2d p = src[idx[(a+1)%4]] - src[idx[a]], q = src[idx[(a+2)%4]] - src[idx[a]];
+            degen |= std::abs(p[0]*q[1] - p[1]*q[0]) < fct*fct;
+          }
+          if (degen)
+            continue;
+        }
+        Eigen::Matrix3d Hk;
+        if (!fit(idx, nmin, ones, &Hk))
+          continue;
+        double score = 0;
+        for (int i = 0; i < n; ++i)
+          if (transfererr(Hk, i) < thresh)
+            score += wgt[i];
+        if (score > bestscore[t])
+        {
+          bestscore[t] = score;
+          bestk[t] = k;
+          bestH[t] = Hk;
+        }
+      }
+    };
+    vector<std::thread> threads;
+    for (int t = 1; t < nothreads; ++t)
+      threads.emplace_back(hypotheses, t);
+    hypotheses(0);
+    for (std::thread & th : threads)
+      th.join();
+    int tb = -1;
+    for (int t = 0; t < nothreads; ++t)
+      if (bestk[t] >= 0 && (tb < 0 || bestscore[t] > bestscore[tb] || (bestscore[t] == bestscore[tb] && bestk[t] < bestk[tb])))
+        tb = t;
+
+    // IRLS on the inliers, Tukey biweight of the transfer error times the residual weight
+    if (tb >= 0)
+    {
+      H = bestH[tb];
+      vector<int> idx;
+      vector<double> w;
+      for (int it = 0; it < gm->irls_iter; ++it)
+      {
+        idx.clear();
+        w.clear();
+        for (int i = 0; i < n; ++i)
+        {
+          const double r = transfererr(H, i) / thresh;
+          if (r < 1)
+          {
+            idx.push_back(i);
+            w.push_back(wgt[i] * (1-r*r) * (1-r*r));
+          }
+        }
+        Eigen::Matrix3d Hr;
+        if ((int)idx.size() < nmin || !fit(idx.data(), idx.size(), w.data(), &Hr))
+          break;
+        H = Hr;
+      }
+      int noinl = 0;
+      for (int i = 0; i < n; ++i)
+        noinl += (transfererr(H, i) < thresh);
+      gm->inlierfrac = (float)noinl / n;
+    }
+  }
+
+  for (int i = 0; i < 9; ++i)
+    gm->H[i] = H(i/3, i%3);
 }
 
 // // needed for verbosity >= 3, DISVISUAL
@@ -376,6 +1288,213 @@ namespace OFC
 //   cv::line(img, cv::Point( ((pt[0]+lb)+.5)*sc, ((pt[1]+ub)+.5)*sc ), cv::Point( ((pt[0]+lb)+.5)*sc, ((pt[1]+lb)+.5)*sc ), cv::Scalar(0,0,255),  1);
 // }
 
+
+const char * CheckModes(const densemodes * modes)
+{
+  if (modes == nullptr)
+    return nullptr;
+  #if (SELECTMODE==2)
+  if (modes->gm != nullptr)
+    return "global motion is only fitted to optical flow";
+  #endif
+  if (modes->tile != nullptr)
+  {
+    if (modes->dl != nullptr)
+      return "a deadline is not supported for tiles, each tile could stop on another scale";
+    if (modes->sp != nullptr)
+      return "a scalepolicy is not supported for tiles, it needs the motion of the whole frame";
+    if (modes->pf != nullptr)
+      return "lazy sampling is not supported for tiles, it needs the patches of the whole frame";
+    if (modes->gm != nullptr)
+      return "global motion is not supported for tiles, it needs the patches of the whole frame";
+  }
+  if (modes->inc != nullptr || modes->sp != nullptr)
+  {
+    if (modes->pf != nullptr && !modes->pf->densify)
+      return "lazy sampling without densification is not supported in incremental mode or with a scalepolicy, they need the output flow";
+    if (modes->gm != nullptr && modes->gm->onlymotion)
+      return "global motion only is not supported in incremental mode or with a scalepolicy, they need the output flow";
+  }
+  return nullptr;
+}
+
+void UpsampleFlowGuided(const float * flow_in, const float * guide, const int width, const int height, const int sc, const int radius, const float eps,
+                        float * flow_out, const int x_out, const int y_out, const int width_out, const int height_out)
+{
+  #if (SELECTMODE==1)
+  const int nop = 2;
+  #else
+  const int nop = 1;
+  #endif
+  const int fct = 1 << sc;
+  const int w = width >> sc, h = height >> sc, n = w*h;
+
+  // mean over the window around each pixel of scale sc, clipped at the borders: prefix sums along rows, then along columns
+  vector<float> tmp(n);
+  vector<double> acc(std::max(w, h) + 1, 0.0);
+  auto boxmean = [&](const vector<float> & src, vector<float> & dst)
+  {
+    dst.resize(n);
+    for (int y = 0; y < h; ++y)
+    {
+      for (int x = 0; x < w; ++x)
+        acc[x+1] = acc[x] + src[y*w + x];
+      for (int x = 0; x < w; ++x)
+      {
+        const int x0 = std::max(x-radius, 0), x1 = std::min(x+radius+1, w);
+        tmp[y*w + x] = (acc[x1] - acc[x0]) / (x1 - x0);
+      }
+    }
+    for (int x = 0; x < w; ++x)
+    {
+      for (int y = 0; y < h; ++y)
+        acc[y+1] = acc[y] + tmp[y*w + x];
+      for (int y = 0; y < h; ++y)
+      {
+        const int y0 = std::max(y-radius, 0), y1 = std::min(y+radius+1, h);
+        dst[y*w + x] = (acc[y1] - acc[y0]) / (y1 - y0);
+      }
+    }
+  };
+
+  // guide on scale sc: mean of the fct x fct pixels, as the image pyramids
+  vector<float> gl(n, 0.0f), gg(n);
+  for (int y = 0; y < h*fct; ++y)
+    for (int x = 0; x < w*fct; ++x)
+      gl[(y/fct)*w + x/fct] += guide[y*width + x];
+  for (int i = 0; i < n; ++i)
+  {
+    gl[i] /= fct*fct;
+    gg[i] = gl[i]*gl[i];
+  }
+  vector<float> mean_g, mean_gg;
+  boxmean(gl, mean_g);
+  boxmean(gg, mean_gg);
+
+  // per channel: a = cov(g,p) / (var(g)+eps), b = mean(p) - a*mean(g), both averaged over the windows containing each pixel
+  vector<float> p(n), pg(n), mean_p, mean_pg, a(n), b(n);
+  vector<vector<float>> mean_a(nop), mean_b(nop);
+  for (int c = 0; c < nop; ++c)
+  {
+    for (int i = 0; i < n; ++i)
+    {
+      p[i] = flow_in[i*nop + c];
+      pg[i] = p[i] * gl[i];
+    }
+    boxmean(p, mean_p);
+    boxmean(pg, mean_pg);
+    for (int i = 0; i < n; ++i)
+    {
+      a[i] = (mean_pg[i] - mean_g[i]*mean_p[i]) / (mean_gg[i] - mean_g[i]*mean_g[i] + eps);
+      b[i] = mean_p[i] - a[i]*mean_g[i];
+    }
+    boxmean(a, mean_a[c]);
+    boxmean(b, mean_b[c]);
+  }
+
+  // finest scale: coefficients sampled bilinearly as in UpsampleFlow, applied to the guide, scaled by fct
+  for (int yo = 0; yo < height_out; ++yo)
+  {
+    const int y = yo + y_out;
+    const float ys = std::min(std::max((y + 0.5f) / fct - 0.5f, 0.0f), (float)(h-1));
+    const int y0 = (int)ys, y1 = std::min(y0+1, h-1);
+    const float wy = ys - y0;
+    for (int xo = 0; xo < width_out; ++xo)
+    {
+      const int x = xo + x_out;
+      const float xs = std::min(std::max((x + 0.5f) / fct - 0.5f, 0.0f), (float)(w-1));
+      const int x0 = (int)xs, x1 = std::min(x0+1, w-1);
+      const float wx = xs - x0;
+      const int i00 = y0*w + x0, i01 = y0*w + x1, i10 = y1*w + x0, i11 = y1*w + x1;
+      const float g = guide[y*width + x];
+      for (int c = 0; c < nop; ++c)
+      {
+        const vector<float> & ma = mean_a[c], & mb = mean_b[c];
+        const float ca = (1-wy) * ((1-wx)*ma[i00] + wx*ma[i01]) + wy * ((1-wx)*ma[i10] + wx*ma[i11]);
+        const float cb = (1-wy) * ((1-wx)*mb[i00] + wx*mb[i01]) + wy * ((1-wx)*mb[i10] + wx*mb[i11]);
+        flow_out[(yo*width_out + xo)*nop + c] = fct * (ca*g + cb);
+      }
+    }
+  }
+}
+
+void SampleFlow(const patchflow * pf, const int nopoints, const float * points, float * outflow)
+{
+  const int w = pf->width, h = pf->height, ps = pf->p_samp_s, nop = pf->nop, fct = 1 << std::max(pf->sc, 0);
+  const int lb = -ps/2, ub = ps/2-1;
+  const bool useroi = !pf->spanx0.empty();
+  if (pf->sc < 0)
+  {
+    std::fill(outflow, outflow + nopoints*nop, 0.0f);
+    return;
+  }
+
+  // weighted average of the patches covering pixel (x,y), 0 if none, as in PatGridClass::AggregateFlowDense()
+  auto pixel = [&](const int x, const int y, float * fl)
+  {
+    float we = 0.0f, sum[2] = {0.0f, 0.0f};
+    const int cx0 = std::min(std::max(x-ub, 0), w-1) / ps, cx1 = std::min(std::max(x-lb, 0), w-1) / ps;
+    const int cy0 = std::min(std::max(y-ub, 0), h-1) / ps, cy1 = std::min(std::max(y-lb, 0), h-1) / ps;
+    for (int cy = cy0; cy <= cy1; ++cy)
+      for (int cx = cx0; cx <= cx1; ++cx)
+        for (int k = pf->cell[cy*pf->ncw + cx]; k < pf->cell[cy*pf->ncw + cx + 1]; ++k)
+        {
+          const int i = pf->idx[k];
+          const int dx = x - pf->pos[2*i] - lb, dy = y - pf->pos[2*i+1] - lb;
+          if (dx < 0 || dy < 0 || dx >= ps || dy >= ps)
+            continue;
+          const float absw = pf->wgt[i*ps*ps + dy*ps + dx];
+          we += absw;
+          for (int c = 0; c < nop; ++c)
+            sum[c] += pf->par[i*nop + c] * absw;
+        }
+
+    // backward patches contribute to (x,y) from the corners (x,y), (x+1,y), (x,y+1), (x+1,y+1) of their footprint
+    if (!pf->pos_bw.empty())
+    {
+      const int bx0 = std::min(std::max(x-ub, 0), w-1) / ps, bx1 = std::min(std::max(x+1-lb, 0), w-1) / ps;
+      const int by0 = std::min(std::max(y-ub, 0), h-1) / ps, by1 = std::min(std::max(y+1-lb, 0), h-1) / ps;
+      for (int cy = by0; cy <= by1; ++cy)
+        for (int cx = bx0; cx <= bx1; ++cx)
+          for (int k = pf->cell_bw[cy*pf->ncw + cx]; k < pf->cell_bw[cy*pf->ncw + cx + 1]; ++k)
+          {
+            const int i = pf->idx_bw[k];
+            for (int j = 0; j < 4; ++j)
+            {
+              const int xt = x + j%2, yt = y + j/2;
+              const int dx = xt - pf->pos_bw[2*i] - lb, dy = yt - pf->pos_bw[2*i+1] - lb;
+              if (dx < 0 || dy < 0 || dx >= ps || dy >= ps || xt < 1 || yt < 1 || xt >= w-1 || yt >= h-1 ||
+                  (useroi && !(xt-1 >= std::max(pf->spanx0[yt-1], pf->spanx0[yt]) && xt <= std::min(pf->spanx1[yt-1], pf->spanx1[yt]))))
+                continue;
+              const float absw = pf->wgt_bw[i*ps*ps + dy*ps + dx], wb = pf->bil_bw[4*i + j];
+              we += wb * absw;
+              for (int c = 0; c < nop; ++c)
+                sum[c] -= wb * (pf->par_bw[i*nop + c] * absw); // reversed flow
+            }
+          }
+    }
+
+    for (int c = 0; c < nop; ++c)
+      fl[c] = (we > 0) ? sum[c] / we : 0.0f;
+  };
+
+  // bilinear between the 4 nearest pixels of the scale, pixel x of the finest image lies at (x+1/2)/fct-1/2, as in OFClass::UpsampleFlow()
+  for (int ip = 0; ip < nopoints; ++ip)
+  {
+    const float xs = std::min(std::max((points[2*ip]   + 0.5f) / fct - 0.5f, 0.0f), (float)(w-1));
+    const float ys = std::min(std::max((points[2*ip+1] + 0.5f) / fct - 0.5f, 0.0f), (float)(h-1));
+    const int x0 = (int)xs, x1 = std::min(x0+1, w-1), y0 = (int)ys, y1 = std::min(y0+1, h-1);
+    const float wx = xs - x0, wy = ys - y0;
+    float f00[2], f01[2], f10[2], f11[2];
+    pixel(x0, y0, f00);
+    pixel(x1, y0, f01);
+    pixel(x0, y1, f10);
+    pixel(x1, y1, f11);
+    for (int c = 0; c < nop; ++c)
+      outflow[ip*nop + c] = fct * ((1-wy) * ((1-wx)*f00[c] + wx*f01[c]) + wy * ((1-wx)*f10[c] + wx*f11[c]));
+  }
+}
+
 }
 
 
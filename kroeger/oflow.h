@@ -26,8 +26,133 @@ typedef struct
   float sc_fct;             // scaling factor at current scale  
   int curr_lv;              // current level
   int camlr;                // 0: left camera, 1: right camera, used only for depth, to restrict sideways patch motion
+  const unsigned char * roi = nullptr; // region of interest at this scale, width*height, nonzero: flow needed, nullptr: whole image
+  int roimargin = 0;        // patches whose footprint comes this close (px) to the region of interest are computed as well
+  int tile_x = 0;           // the image is a tile at (tile_x,tile_y) of a frame of frame_w x frame_h at this scale, 
+  int tile_y = 0;           // the patch grid continues the frame's. frame_w = 0: the image is the frame
+  int frame_w = 0;
+  int frame_h = 0;
 } camparam ;
 
+typedef struct
+{
+  float * u;                // horizontal displacement (OF) or disparity (depth) of pixel (0,0)
+  float * v;                // vertical displacement of pixel (0,0), nullptr for depth
+  int pxstep;               // distance (in floats) between horizontally neighbouring pixels, 1: planar, nop: interleaved
+  int stride;               // distance (in floats) between vertically neighbouring pixels
+} flowfield ;              // flow field, either interleaved or as separate (planar) u/v planes. Planar with stride%4==0 is refined in-place
+
+typedef struct
+{
+  float thresh = 2.0f;      // a tile has changed if the mean absolute difference of either image to the previous frame's exceeds this (intensity levels)
+  float changedfrac = 1.0f; // fraction of tiles recomputed in the last frame (output)
+
+  // carried over from the previous frame, leave empty before the first one
+  std::vector<float> im_ao_t, im_bo_t;           // images on the change test scale, unpadded
+  std::vector<std::vector<float>> p_fw, p_bw;    // converged parameters of forward/backward patches on each scale, by midpoint, NaN if never computed
+  std::vector<float> flow;                       // output flow
+  int sc_f = -1, sc_l = -1;                      // pyramid, forward-backward merging and per-scale patch size / overlap of the previous frame,
+  bool usefbcon = false;                         // state is only reused if all of them match
+  std::vector<int> p_samp_s;
+  std::vector<float> patove;
+} incstate;                // incremental mode for static cameras: state passed from one frame (pair) to the next
+
+typedef struct
+{
+  float budget_ms = 0.0f;   // latency budget (ms) of one constructor call, 0: no limit. Finer scales are skipped once their predicted cost would exceed it
+  void (*onscale)(void * userdata, const int sl, const flowfield * flow, const int width, const int height) = nullptr; // called with the flow of each scale 
+                                                                                                                     // once it is computed (px of that scale), nullptr: none
+  void * userdata = nullptr;                // passed to onscale
+
+  std::vector<float> ms_per_patch;          // time per patch of each scale in the last call, predicts the cost of the next scale, leave empty before the first one
+  int sc_done = -1;                         // output: last computed scale, > sc_l if the budget stopped early and the output is upsampled from it
+} deadlinestate;           // anytime mode: deadline and progressive per-scale results, state passed from one call to the next
+
+typedef struct
+{
+  int sc_min = 0;               // admissible range of the coarsest scale, e.g. [finest scale, choice from the image width as in run_dense]
+  int sc_max = 5;
+  float quantile = 0.99f;       // robust motion magnitude: this quantile of the output flow magnitude
+  float decay = 0.9f;           // per frame decay of the tracked magnitude, a larger one is taken over at once
+  float outlier_spike = 0.01f;  // a fraction of patches reset as outliers (moved more than half a patch) above this and 4x the tracked one is a spike,
+                                // the next frame then uses sc_max
+
+  // carried over from the previous frame, outputs
+  float motion = -1.0f;         // tracked motion magnitude in px of the finest image, <0: none yet
+  float outlierfrac = 0.0f;     // fraction of patches reset as outliers, over all scales
+  float outlierbase = 0.0f;     // tracked fraction, moving average with weight 1-decay
+  int sc_f = -1;                // coarsest scale for the next frame: motion of at least half a patch on it, -1 before the first frame (use sc_max)
+} scalepolicy;             // adaptive pyramid depth for streams: coarsest scale of each frame from the motion of the previous ones
+
+typedef struct
+{
+  int p_samp_s = 0;         // patch size, 0: the global one. At most the image padding
+  float patove = -1.0f;     // patch overlap, <0: the global one
+  int max_iter = 0;         // max./min. iterations, 0: the global ones
+  int min_iter = 0;
+} scaleschedule;           // per-scale overrides of the patch parameters, e.g. dense patches and many iterations on coarse scales only
+
+typedef struct
+{
+  int x = 0;                // position of the images in the frame, pixels of the finest scale, multiple of 2^sc_f_in
+  int y = 0;
+  int frame_width = 0;      // frame size, same conditions as width_in/height_in
+  int frame_height = 0;
+} tileinfo;                // the images are a tile of a larger frame: patch grids are those of the frame, such that tiles agree with the whole frame
+
+typedef struct
+{
+  bool densify = true;      // densify (and refine) the last scale into outflow. false: outflow is not written, only SampleFlow() gives the flow.
+                            // Not with incremental mode or a scalepolicy, which need the output (see CheckModes)
+
+  // output: valid patches of the last computed scale, as densified (before variational refinement)
+  int sc = -1;              // their scale, -1: none
+  int width = 0;            // image size on that scale
+  int height = 0;
+  int p_samp_s = 0;         // patch size
+  int nop = 0;              // parameters per patch, 1 for depth, 2 for OF
+  std::vector<int> pos;                 // forward patches: midpoint x,y
+  std::vector<float> par, wgt;          // their displacement (nop) and the weight of each pixel, 1/max(minerrval, residual) (p_samp_s^2)
+  std::vector<int> pos_bw;              // backward patches (forward-backward merging): pixel corner above-left of their target position
+  std::vector<float> par_bw, wgt_bw, bil_bw; // as above, and bilinear weights of the 4 pixels at this corner
+  std::vector<int> spanx0, spanx1;      // with a region of interest: per row, the columns covered by forward patches
+  std::vector<int> cell, cell_bw;       // patches by their position on cells of p_samp_s px, row-major: indices of cell c in idx[cell[c]] to idx[cell[c+1]-1]
+  std::vector<int> idx, idx_bw;
+  int ncw = 0, nch = 0;                 // number of cells horizontally / vertically
+} patchflow;               // lazy densification: the last scale's patches, flow is evaluated only at query points (SampleFlow)
+
+typedef struct
+{
+  int model = 1;                // 0: similarity (rotation, uniform scale, translation), 1: homography
+  int sc = -1;                  // fit to the patches of this scale (clamped to sc_l..sc_f), -1: the last one
+  bool onlymotion = false;      // stop after that scale: it is not densified, finer scales are skipped and outflow is not written. 
+                                // Not with incremental mode or a scalepolicy, which need the output (see CheckModes)
+  int ransac_iter = 256;        // RANSAC hypotheses (minimal sets of patches), evaluated in parallel
+  float inlier_thresh = 1.0f;   // inliers: transfer error below this (px of the fitting scale)
+  int irls_iter = 5;            // iteratively reweighted least-squares refinements on the inliers
+
+  // output
+  double H[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1}; // row-major 3x3, maps (x,y,1) of the first image to the second, pixels of the finest image, H[8] = 1
+  int nopatches = 0;            // valid patches the model was fitted to
+  float inlierfrac = 0.0f;      // fraction of them within inlier_thresh of the model
+  int sc_fit = -1;              // scale actually used (a deadline can stop before sc), -1: none
+} globalmotion;            // global motion (e.g. for stabilization) from the patch displacements of one scale, weighted by their residuals. Optical flow only
+
+typedef struct
+{
+  const unsigned char * roi = nullptr;   // region of interest, width_in*height_in, nonzero: flow needed. Flow is computed only for patches overlapping it (plus a 
+                                         // margin on coarser scales), and is zero beyond those patches. nullptr: whole image
+  incstate * inc = nullptr;              // incremental mode: patches in tiles where neither image changed since the previous call keep their parameters, unchanged 
+                                         // tiles keep the previous output. Same state object on every call (one per tile in tiled mode), a call with other sizes 
+                                         // or parameters recomputes all. nullptr: disabled
+  deadlinestate * dl = nullptr;          // anytime mode: latency budget and per-scale callback, see deadlinestate. nullptr: all scales, no callback
+  scalepolicy * sp = nullptr;            // adaptive pyramid depth: updated with this frame's motion statistics, gives sc_f_in of the next frame. nullptr: disabled
+  const scaleschedule * sched = nullptr; // per-scale patch size, overlap and iterations, sc_f_in+1 entries indexed by scale as the pyramids. nullptr: same on all scales
+  const tileinfo * tile = nullptr;       // the images are a tile of a larger frame, see tileinfo. nullptr: the images are the frame
+  patchflow * pf = nullptr;              // lazy densification: receives the last scale's patches for SampleFlow(), optionally instead of outflow. nullptr: disabled
+  globalmotion * gm = nullptr;           // global motion model fitted to the patches of one scale, optionally without computing finer scales. nullptr: disabled
+} densemodes;              // optional modes of the dense constructor, all disabled by default. Not all combinations are supported, see CheckModes()
+
 typedef struct
 {
   // Explicitly set parameters:
@@ -42,7 +167,7 @@ typedef struct
   int patnorm;          // Use patch mean-normalization
   int verbosity;        // Verbosity, 0: plot nothing, 1: final internal timing 2: complete iteration timing, (UNCOMMENTED -> 3: Display flow scales, 4: Display flow scale iterations)
   bool usefbcon;        // use forward-backward flow merging 
-  int costfct;          // Cost function: 0: L2-Norm, 1: L1-Norm, 2: PseudoHuber-Norm 
+  int costfct;          // Cost function: 0: L2-Norm, 1: L1-Norm, 2: PseudoHuber-Norm, 10: normalized cross-correlation (implies patnorm)
   bool usetvref;        // TV parameters
   float tv_alpha;
   float tv_gamma;
@@ -50,6 +175,11 @@ typedef struct
   int tv_innerit;
   int tv_solverit;
   float tv_sor;         // Successive-over-relaxation weight
+  float tv_restol;      // relative residual tolerance for early stopping of TV fixed point and SOR iterations, 0: disabled (always run all iterations)
+  float tv_tilethresh;  // refine only tiles whose mean image residual after densification exceeds this (plus one tile halo), 0: refine whole image
+  bool usebatchopt;     // optimize patches in SIMD batches (one patch per lane) instead of one by one
+  int p_rowstep;        // sparse sampling: evaluate the patch objective (and Hessian) only on every p_rowstep-th patch row, 1: all rows. Needs the batched optimizer
+  float lowtex_thresh;  // patches whose smaller Hessian eigenvalue per pixel (mean squared gradient) is below this are not optimized and keep their initialization, 0: disabled
   
   // Automatically set parameters / fixed parameters
   int nop;                      // number of parameters per pixel, 1 for depth, 2 for optical flow, 4 for scene flow
@@ -57,8 +187,10 @@ typedef struct
   float outlierthresh;          // displacement threshold (in px) before a patch is flagged as outlier
   int steps;                    // horizontal and vertical distance (in px) between patch centers
   int novals;                   // number of points in patch (=p_samp_s*p_samp_s) 
+  int novals_opt;               // number of points of the patch objective (=novals with p_rowstep 1)
   int noc;                      // number of channels in image and gradients 
   int noscales;                 // total number of scales
+  int tv_tilesz;                // edge length (px) of tiles for selective variational refinement, =p_samp_s
   float minerrval = 2.0f;       // 1/max(this, error) for pixel averaging weight
   float normoutlier = 5.0f;     // norm error threshold for huber norm
   
@@ -77,6 +209,8 @@ typedef struct
 
 
 
+class PatGridClass;
+
 class OFClass
 {
 
@@ -108,10 +242,53 @@ public:
           const int tv_innerit_in,
           const int tv_solverit_in,
           const float tv_sor_in,
+          const float tv_restol_in,
+          const float tv_tilethresh_in,
+          const bool usebatchopt_in,
+          const float lowtex_thresh_in,
+          const int p_rowstep_in,
+          const densemodes * modes_in,   // optional modes (region of interest, incremental, deadline, ...), see densemodes. nullptr: none. 
+                                         // An unsupported combination (CheckModes) is reported and nothing is computed
+          const int verbosity_in);
+
+  // Sparse flow: one reference patch per query point, optimized coarse-to-fine with the same inverse search, 
+  // each patch initialized from its own displacement on the coarser scale. No densification or refinement, cost is proportional to #points
+  OFClass(const float ** im_ao_in, const float ** im_ao_dx_in, const float ** im_ao_dy_in, // image pyramids as above
+          const float ** im_bo_in, const float ** im_bo_dx_in, const float ** im_bo_dy_in,
+          const int imgpadding_in,
+          const int nopoints_in,    // number of query points
+          const float * points_in,  // query points (x,y) in pixels of the finest (width_in*height_in) image, 2*nopoints_in floats
+          float * outflow,          // Output-flow: displacement of each point in pixels of the finest image, 2 floats for OF / 1 for depth per point
+          float * outres,           // Output-residual: mean absolute patch residual of each point on scale sc_l_in, pass as nullptr to disable
+          const int width_in, const int height_in, 
+          const int sc_f_in, const int sc_l_in,
+          const int max_iter_in, const int min_iter_in,
+          const float  dp_thresh_in,
+          const float  dr_thresh_in,
+          const float res_thresh_in,            
+          const int p_samp_s_in,
+          const int costfct_in, 
+          const int noc_in,
+          const int patnorm_in,
+          const bool usebatchopt_in,
           const int verbosity_in);
   
 private:
 
+  void SetDerivedParams(optparam & o) const;                                   // automatically set parameters in 'o', from the explicitly set ones
+  void SetCamParams(const int width, const int height, const int imgpadding, const tileinfo * tile);  // cpl, cpr of all scales, from ops
+
+  void AllocFlowPlanes(flowfield * fl, const int width, const int height) const; // planar u/v, stride-aligned like FDF image_t
+  void FreeFlowPlanes(flowfield * fl) const;
+  flowfield InterleavedFlow(float * fl, const int width) const;                   // wrap interleaved array of 'nop' channels
+  void CopyFlow(const flowfield * src, const flowfield * dst, const int width, const int height) const;
+  void UpsampleFlow(const flowfield * src, const int width_src, const int height_src, float * dst, const int fct) const; // bilinear, to interleaved dst of fct times the size, scaled by fct
+  void UpdateScalePolicy(scalepolicy * sp, const float * flow, const unsigned char * roi_in, const float outlierfrac) const; // motion statistics -> sp->sc_f
+  void ChangedTiles(const incstate * inc, const int sc_t); // sets tilechg: tiles with changed images on test scale sc_t, dilated by one tile
+  bool RegionChanged(const int sl, const float x0, const float y0, const float x1, const float y1) const; // any changed tile in [x0,x1]x[y0,y1] (px on scale sl)
+  void DownscaleROI(const unsigned char * src, unsigned char * dst, const int width, const int height) const; // 2x2 blocks, nonzero if any is, width/height of dst
+  void FitGlobalMotion(const PatGridClass * grid, const int sl, globalmotion * gm) const; // robust fit (RANSAC, then IRLS) to the valid patches of scale sl
+
   // needed for verbosity >= 3, DISVISUAL
   //void DisplayDrawPatchBoundary(cv::Mat img, const Eigen::Vector2f pt, const float sc);
 
@@ -119,9 +296,38 @@ private:
   const float ** im_bo, ** im_bo_dx, ** im_bo_dy;
   
   optparam op;                    // Struct for pptimization parameters
+  std::vector<optparam> ops;      // the same for each scale, with per-scale overrides (scaleschedule)
   std::vector<camparam> cpl, cpr; // Struct (for each scale) for camera/image parameter
+  std::vector<std::vector<unsigned char>> roi; // region of interest on each scale, empty without
+  std::vector<unsigned char> tilechg;           // incremental mode: tiles to recompute, row-major tiles of tv_tilesz px on scale sc_l, empty: all
+  int inc_ntw = 0, inc_nth = 0;                 // number of these tiles horizontally / vertically
 };
 
+// Edge-aware upsampling of a flow from scale sc to the finest scale (fast guided filter): linear models flow = a*I + b of a grayscale 
+// guide I are fitted in windows of (2*radius+1)^2 pixels on scale sc, averaged, bilinearly upsampled and applied to the guide on 
+// the finest scale, such that motion boundaries follow its edges. Constant cost per pixel. The flow is scaled by 2^sc and only the 
+// width_out x height_out region at (x_out,y_out) is written, e.g. without the padding for divisibility
+void UpsampleFlowGuided(const float * flow_in,  // interleaved, width/2^sc x height/2^sc, 1 channel depth / 2 for OF
+                        const float * guide,    // grayscale image on the finest scale, width x height, no image padding
+                        const int width, const int height, const int sc,
+                        const int radius,       // window radius on scale sc
+                        const float eps,        // regularization in squared intensity levels, large values approach bilinear upsampling
+                        float * flow_out,       // interleaved, width_out x height_out
+                        const int x_out, const int y_out, const int width_out, const int height_out);
+
+
+// Combinations of optional modes the dense constructor does not support, nullptr if there are none: tiles with a deadline, a scalepolicy, 
+// lazy sampling or global motion, which all need the whole frame; output-free lazy sampling or global motion with incremental mode or a 
+// scalepolicy, which need the output flow; global motion for depth
+const char * CheckModes(const densemodes * modes);
+
+
+// Lazy densification: flow at query points from the patches in pf, the same weighted patch average as the dense flow of that scale 
+// (before refinement), bilinearly interpolated as UpsampleFlow() and scaled to the finest image. Cost per point: the patches covering 4 pixels
+void SampleFlow(const patchflow * pf,
+                const int nopoints,       // number of query points
+                const float * points,     // query points (x,y) in pixels of the finest image, 2*nopoints floats
+                float * outflow);         // displacement of each point in pixels of the finest image, 2 floats for OF / 1 for depth per point
 
 }
 
@@ -11,6 +11,7 @@
 #include <Eigen/Dense>
 
 #include <stdio.h>  
+#include <smmintrin.h>
 
 #include "patch.h"
 
@@ -39,7 +40,9 @@ namespace OFC
 
   tmp.resize(op->novals,1);
   dxx_tmp.resize(op->novals,1);
+  #if (SELECTMODE==1)
   dyy_tmp.resize(op->novals,1);
+  #endif
 }
 
 void PatClass::CreateStatusStruct(patchstate * psin)
@@ -54,44 +57,80 @@ PatClass::~PatClass()
   delete pc;
 }
 
-void PatClass::InitializePatch(Eigen::Map<const Eigen::MatrixXf> * im_ao_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dx_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dy_in, const Eigen::Vector2f pt_ref_in)
+#if (SELECTMODE==1)
+void PatClass::InitializePatch(Eigen::Map<const Eigen::MatrixXf> * im_ao_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dx_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dy_in, const Eigen::Vector2f pt_ref_in, const Eigen::Matrix<float, 2, 2> * hes_in, const double * im_ao_sat_in)
+#else
+void PatClass::InitializePatch(Eigen::Map<const Eigen::MatrixXf> * im_ao_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dx_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dy_in, const Eigen::Vector2f pt_ref_in, const Eigen::Matrix<float, 1, 1> * hes_in, const double * im_ao_sat_in)
+#endif
 {
   im_ao = im_ao_in;
   im_ao_dx = im_ao_dx_in;
   im_ao_dy = im_ao_dy_in;
+  im_ao_sat = im_ao_sat_in;
 
   pt_ref = pt_ref_in;
   ResetPatch();
 
   getPatchStaticNNGrad(im_ao->data(), im_ao_dx->data(), im_ao_dy->data(), &pt_ref, &tmp, &dxx_tmp, &dyy_tmp);
 
-  ComputeHessian();
+  if (op->costfct==10) // NCC
+    pc->tnorm = tmp.norm();
+
+  if (hes_in != nullptr)
+    pc->Hes = *hes_in;
+  ComputeHessian(hes_in != nullptr);
 }
 
-void PatClass::ComputeHessian()
+void PatClass::ComputeHessian(const bool hasHes)
 {
   #if (SELECTMODE==1)
-  pc->Hes(0,0) = (dxx_tmp.array() * dxx_tmp.array()).sum();
-  pc->Hes(0,1) = (dxx_tmp.array() * dyy_tmp.array()).sum();
-  pc->Hes(1,1) = (dyy_tmp.array() * dyy_tmp.array()).sum();
-  pc->Hes(1,0) = pc->Hes(0,1);
+  if (!hasHes && op->p_rowstep == 1)
+  {
+    pc->Hes(0,0) = (dxx_tmp.array() * dxx_tmp.array()).sum();
+    pc->Hes(0,1) = (dxx_tmp.array() * dyy_tmp.array()).sum();
+    pc->Hes(1,1) = (dyy_tmp.array() * dyy_tmp.array()).sum();
+    pc->Hes(1,0) = pc->Hes(0,1);
+  }
+  else if (!hasHes) // sparse sampling: sampled patch rows only
+  {
+    const int rowlen = op->novals / op->p_samp_s;
+    pc->Hes.setZero();
+    for (int j = 0; j < op->p_samp_s; j += op->p_rowstep)
+    {
+      pc->Hes(0,0) += (dxx_tmp.segment(j*rowlen, rowlen).array() * dxx_tmp.segment(j*rowlen, rowlen).array()).sum();
+      pc->Hes(0,1) += (dxx_tmp.segment(j*rowlen, rowlen).array() * dyy_tmp.segment(j*rowlen, rowlen).array()).sum();
+      pc->Hes(1,1) += (dyy_tmp.segment(j*rowlen, rowlen).array() * dyy_tmp.segment(j*rowlen, rowlen).array()).sum();
+    }
+    pc->Hes(1,0) = pc->Hes(0,1);
+  }
   if (pc->Hes.determinant()==0)
   {
     pc->Hes(0,0)+=1e-10;
     pc->Hes(1,1)+=1e-10;
   }
+  // smaller eigenvalue of the (symmetric) Hessian, per pixel
+  const float hmean = .5f * (pc->Hes(0,0) + pc->Hes(1,1)), hdiff = .5f * (pc->Hes(0,0) - pc->Hes(1,1));
+  pc->lowtex = (op->lowtex_thresh > 0) && ((hmean - sqrt(hdiff*hdiff + pc->Hes(0,1)*pc->Hes(0,1))) / op->novals_opt < op->lowtex_thresh);
   #else
-  pc->Hes(0,0) = (dxx_tmp.array() * dxx_tmp.array()).sum();
+  if (!hasHes)
+  {
+    const int rowlen = op->novals / op->p_samp_s;
+    pc->Hes(0,0) = 0;
+    for (int j = 0; j < op->p_samp_s; j += op->p_rowstep) // sampled patch rows only
+      pc->Hes(0,0) += (dxx_tmp.segment(j*rowlen, rowlen).array() * dxx_tmp.segment(j*rowlen, rowlen).array()).sum();
+  }
   if (pc->Hes.sum()==0)
     pc->Hes(0,0)+=1e-10;
+  pc->lowtex = (op->lowtex_thresh > 0) && (pc->Hes(0,0) / op->novals_opt < op->lowtex_thresh);
   #endif
 }
 
-void PatClass::SetTargetImage(Eigen::Map<const Eigen::MatrixXf> * im_bo_in, Eigen::Map<const Eigen::MatrixXf> * im_bo_dx_in, Eigen::Map<const Eigen::MatrixXf> * im_bo_dy_in)
+void PatClass::SetTargetImage(Eigen::Map<const Eigen::MatrixXf> * im_bo_in, Eigen::Map<const Eigen::MatrixXf> * im_bo_dx_in, Eigen::Map<const Eigen::MatrixXf> * im_bo_dy_in, const double * im_bo_sat_in)
 {
   im_bo = im_bo_in;
   im_bo_dx = im_bo_dx_in;
   im_bo_dy = im_bo_dy_in;
+  im_bo_sat = im_bo_sat_in;
 
   ResetPatch();
 }
@@ -114,6 +153,7 @@ void PatClass::ResetPatch()
   pc->mares_old = 1e20;
   pc->cnt=0;
   pc->invalid = false;
+  pc->outlier = false;
 }
 
 #if (SELECTMODE==1)
@@ -132,8 +172,7 @@ void PatClass::OptimizeStart(const Eigen::Matrix<float, 1, 1> p_in_arg)
   pc->pt_st = pc->pt_iter;
 
   //Check if initial position is already invalid
-  if (pc->pt_iter[0] < cpt->tmp_lb  || pc->pt_iter[1] < cpt->tmp_lb ||    // check if patch left valid image region
-      pc->pt_iter[0] > cpt->tmp_ubw || pc->pt_iter[1] > cpt->tmp_ubh)  
+  if (!InsideImage())
   {
     pc->hasconverged=1;
     pc->pdiff = tmp;
@@ -165,6 +204,8 @@ void PatClass::OptimizeIter(const Eigen::Matrix<float, 1, 1> p_in_arg, const boo
   {
     ResetPatch(); 
     OptimizeStart(p_in_arg);  
+    if (pc->lowtex || pc->unchanged) // keep initialization, only the error image for densification weights is computed
+      pc->hasconverged=1;
   }
   int oldcnt=pc->cnt;
 
@@ -181,7 +222,11 @@ void PatClass::OptimizeIter(const Eigen::Matrix<float, 1, 1> p_in_arg, const boo
       pc->delta_p[0] = (dxx_tmp.array() * pc->pdiff.array()).sum();
     #endif
 
+    #if (SELECTMODE==1)
     pc->delta_p = pc->Hes.llt().solve(pc->delta_p); // solve linear system
+    #else
+    pc->delta_p[0] /= pc->Hes(0,0);
+    #endif
     
     pc->p_iter -= pc->delta_p; // update flow vector
     
@@ -196,21 +241,385 @@ void PatClass::OptimizeIter(const Eigen::Matrix<float, 1, 1> p_in_arg, const boo
     paramtopt(); 
       
     // check if patch(es) moved too far from starting location, if yes, stop iteration and reset to starting location
+    #if (SELECTMODE==1)
     if ((pc->pt_st - pc->pt_iter).norm() > op->outlierthresh  // check if query patch moved more than >padval from starting location -> most likely outlier
-        ||                  
-        pc->pt_iter[0] < cpt->tmp_lb  || pc->pt_iter[1] < cpt->tmp_lb ||    // check patch left valid image region
-        pc->pt_iter[0] > cpt->tmp_ubw || pc->pt_iter[1] > cpt->tmp_ubh)  
+    #else
+    if (std::abs(pc->pt_st[0] - pc->pt_iter[0]) > op->outlierthresh
+    #endif
+        || !InsideImage())    // check patch left valid image region
     {
       pc->p_iter = pc->p_in; // reset
       paramtopt(); 
       pc->hasconverged=1;
       pc->hasoptstarted=1;
+      pc->outlier=true;
     }
         
     OptimizeComputeErrImg();
   }
 }
 
+#if (SELECTMODE==1)
+void PatClass::OptimizeBatch(PatClass ** pat, const Eigen::Vector2f * p_init, const int n)
+#else
+void PatClass::OptimizeBatch(PatClass ** pat, const Eigen::Matrix<float, 1, 1> * p_init, const int n)
+#endif
+{
+  if (n <= 0)
+    return;
+  
+  const optparam * op = pat[0]->op;
+  const camparam * cpt = pat[0]->cpt;
+  const v4sf allset = (v4sf) _mm_cmpeq_ps(op->zero, op->zero);
+
+  PatClass * lp[4] = {nullptr, nullptr, nullptr, nullptr}; // patch in each lane, nullptr: lane empty
+  int next = 0;
+  
+  // per-lane state, mirrors patchstate 
+  v4sf p0 = op->zero, pin0 = op->zero;                                  // p_iter, p_in
+  v4sf pt0 = op->zero, pt1 = op->zero, st0 = op->zero;                  // pt_iter, pt_st
+  v4sf ref0 = op->zero;                                                 // pt_ref
+  v4sf d0 = op->zero, d1 = op->zero;                                    // delta_p
+  v4sf hi00 = op->zero, pr0 = op->zero;                                 // inverse Hessian, projection of the error image onto the steepest descent images
+  #if (SELECTMODE==1)
+  v4sf p1 = op->zero, pin1 = op->zero, st1 = op->zero, ref1 = op->zero;
+  v4sf hi01 = op->zero, hi11 = op->zero, pr1 = op->zero;
+  #endif
+  v4sf dpsq = op->zero, dpsqi = op->zero, mares = op->zero, mareso = op->zero, cnt = op->zero;
+  v4sf upd = op->zero;  // lane mask: lane has an error image and takes a step, unset for freshly loaded patches
+  
+  const v4sf maxit = _mm_set1_ps(op->max_iter), minit = _mm_set1_ps(op->min_iter);
+  const v4sf resth = _mm_set1_ps(op->res_thresh), dpth = _mm_set1_ps(op->dp_thresh), drth = _mm_set1_ps(op->dr_thresh);
+  const v4sf outlth = _mm_set1_ps(op->outlierthresh);
+  const v4sf lbv = _mm_set1_ps(cpt->tmp_lb), ubwv = _mm_set1_ps(cpt->tmp_ubw);
+  #if (SELECTMODE==1)
+  const v4sf ubhv = _mm_set1_ps(cpt->tmp_ubh);
+  #endif
+  const v4sf novalsv = _mm_set1_ps(op->novals_opt);
+  #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)
+  const int noc = 1;
+  #else
+  const int noc = 3;
+  #endif
+  const bool fused = ((op->p_samp_s * noc) % 4 == 0) && ((op->costfct >= 0 && op->costfct <= 2) || op->costfct == 10) && (op->patnorm == 0 || pat[0]->im_bo_sat != nullptr);
+  
+  while (true)
+  {
+    // refill empty lanes, as in OptimizeIter() / OptimizeStart()
+    int nolanes = 0;
+    for (int l = 0; l < 4; ++l)
+    {
+      while (lp[l] == nullptr && next < n)
+      {
+        PatClass * pa = pat[next];
+        patchstate * pc = pa->pc;
+        if (pc->hasoptstarted || pc->lowtex || pc->unchanged) 
+        {
+          pa->OptimizeIter(p_init[next++], true); // already (partially) optimized, e.g. by visualization, or textureless / unchanged
+          continue;
+        }
+        pa->ResetPatch();
+        pc->p_in   = p_init[next];
+        pc->p_iter = p_init[next];
+        pa->paramtopt();
+        pc->pt_st = pc->pt_iter;
+        ++next;
+        
+        if (!pa->InsideImage()) // initial position already invalid
+        {
+          pc->hasconverged=1;
+          pc->pdiff = pa->tmp;
+          pc->hasoptstarted=1;
+          continue;
+        }
+
+        lp[l] = pa;
+        #if (SELECTMODE==1)
+        const float det = pc->Hes(0,0)*pc->Hes(1,1) - pc->Hes(0,1)*pc->Hes(1,0);
+        hi00[l] =  pc->Hes(1,1) / det;
+        hi01[l] = -pc->Hes(0,1) / det;
+        hi11[l] =  pc->Hes(0,0) / det;
+        p0[l] = pin0[l] = pc->p_in[0];
+        p1[l] = pin1[l] = pc->p_in[1];
+        #else
+        hi00[l] = 1.0f / pc->Hes(0,0);
+        p0[l] = pin0[l] = pc->p_in[0];
+        #endif
+        ref0[l] = pa->pt_ref[0];
+        pt0[l] = st0[l] = pc->pt_iter[0]; 
+        pt1[l] = pc->pt_iter[1];
+        #if (SELECTMODE==1)
+        ref1[l] = pa->pt_ref[1];
+        st1[l] = pc->pt_iter[1];
+        #endif
+        cnt[l] = 0;
+        dpsqi[l] = 1e-10;
+        mares[l] = 1e5;
+        upd[l] = 0;
+      }
+      nolanes += (lp[l] != nullptr);
+    }
+    if (nolanes == 0)
+      break;
+    
+    // step on all lanes with an error image, fresh lanes keep p_in and delta_p = 0
+    cnt += _mm_and_ps(upd, op->ones);
+    #if (SELECTMODE==1)
+    d0 = _mm_and_ps(upd, hi00*pr0 + hi01*pr1);
+    d1 = _mm_and_ps(upd, hi01*pr0 + hi11*pr1);
+    p0 -= d0;
+    p1 -= d1;
+    #else
+    d0 = _mm_and_ps(upd, hi00*pr0);
+    p0 = _mm_blendv_ps(p0, (cpt->camlr==0) ? _mm_min_ps(p0 - d0, op->zero) : _mm_max_ps(p0 - d0, op->zero), upd); // disparity sign constraint
+    #endif
+    pt0 = ref0 + p0;
+    
+    // patches moving too far from their start or leaving the valid image region are reset and stop. 
+    // Negated ordered compares also catch NaN steps from (near) singular Hessians
+    #if (SELECTMODE==1)
+    pt1 = ref1 + p1;
+    v4sf keep = _mm_cmple_ps(_mm_sqrt_ps((st0-pt0)*(st0-pt0) + (st1-pt1)*(st1-pt1)), outlth);
+    keep = _mm_and_ps(keep, _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(pt0, lbv), _mm_cmpge_ps(pt1, lbv)), 
+                                       _mm_and_ps(_mm_cmple_ps(pt0, ubwv), _mm_cmple_ps(pt1, ubhv))));
+    #else // patches stay on their image row (pt1 = ref1): horizontal checks only
+    v4sf keep = _mm_cmple_ps(_mm_andnot_ps(op->negzero, st0-pt0), outlth);
+    keep = _mm_and_ps(keep, _mm_and_ps(_mm_cmpge_ps(pt0, lbv), _mm_cmple_ps(pt0, ubwv)));
+    #endif
+    v4sf conv = _mm_andnot_ps(keep, upd);
+    const v4sf reset = conv;
+    p0 = _mm_blendv_ps(p0, pin0, conv);
+    pt0 = ref0 + p0;
+    #if (SELECTMODE==1)
+    p1 = _mm_blendv_ps(p1, pin1, conv);
+    pt1 = ref1 + p1;
+    #endif
+    
+    // error images, per lane vectorized along the patch, reductions of all lanes at once below
+    v4sf accx[4], accy[4], acca[4];
+    for (int l = 0; l < 4; ++l)
+    {
+      accx[l] = accy[l] = acca[l] = op->zero;
+      if (lp[l] == nullptr)
+        continue;
+      PatClass * pa = lp[l];
+      patchstate * pc = pa->pc;
+      pc->pt_iter[0] = pt0[l];
+      pc->pt_iter[1] = pt1[l];
+      
+      if (fused)
+      {
+        switch (op->costfct)
+        {
+          case 0:  pa->BatchErrImgFused<0>(&accx[l], &accy[l], &acca[l]); break;
+          case 1:  pa->BatchErrImgFused<1>(&accx[l], &accy[l], &acca[l]); break;
+          case 10: pa->BatchErrImgFused<10>(&accx[l], &accy[l], &acca[l]); break;
+          default: pa->BatchErrImgFused<2>(&accx[l], &accy[l], &acca[l]); break;
+        }
+        continue;
+      }
+      
+      pa->getPatchStaticBil(pa->im_bo->data(), &(pc->pt_iter), &(pc->pdiff));
+      pa->LossComputeErrorImage(&pc->pdiff, &pc->pweight, &pc->pdiff, &(pa->tmp));
+      
+      const v4sf * pd = (v4sf*) pc->pdiff.data(), * pw = (v4sf*) pc->pweight.data(), * dx = (v4sf*) pa->dxx_tmp.data();
+      #if (SELECTMODE==1)
+      const v4sf * dy = (v4sf*) pa->dyy_tmp.data();
+      for (int i = op->novals/4; i--; ++pd, ++pw, ++dx, ++dy)
+      {
+        accx[l] += (*dx) * (*pd);
+        accy[l] += (*dy) * (*pd);
+        acca[l] += (*pw);
+      }
+      #else
+      for (int i = op->novals/4; i--; ++pd, ++pw, ++dx)
+      {
+        accx[l] += (*dx) * (*pd);
+        acca[l] += (*pw);
+      }
+      #endif
+    }
+    _MM_TRANSPOSE4_PS(accx[0], accx[1], accx[2], accx[3]);
+    _MM_TRANSPOSE4_PS(acca[0], acca[1], acca[2], acca[3]);
+    pr0 = (accx[0] + accx[1]) + (accx[2] + accx[3]);
+    #if (SELECTMODE==1)
+    _MM_TRANSPOSE4_PS(accy[0], accy[1], accy[2], accy[3]);
+    pr1 = (accy[0] + accy[1]) + (accy[2] + accy[3]);
+    #endif
+    
+    // early termination criteria, as in OptimizeComputeErrImg()
+    dpsq = d0*d0 + d1*d1;
+    dpsqi = _mm_blendv_ps(dpsqi, dpsq, _mm_cmpeq_ps(cnt, op->ones));
+    mareso = mares;
+    mares = ((acca[0] + acca[1]) + (acca[2] + acca[3])) / novalsv;
+    const v4sf belowmin = _mm_cmplt_ps(cnt, minit);
+    v4sf cont = _mm_and_ps(_mm_cmplt_ps(cnt, maxit), _mm_cmpgt_ps(mares, resth));
+    cont = _mm_and_ps(cont, _mm_or_ps(belowmin, _mm_cmpge_ps(dpsq / dpsqi, dpth)));
+    cont = _mm_and_ps(cont, _mm_or_ps(belowmin, _mm_cmple_ps(mares / mareso, drth)));
+    conv = _mm_or_ps(conv, _mm_andnot_ps(cont, allset));
+    
+    // retire converged lanes, write back patch state
+    for (int l = 0; l < 4; ++l)
+    {
+      if (lp[l] == nullptr || ((__v4si) conv)[l] == 0)
+        continue;
+      patchstate * pc = lp[l]->pc;
+      pc->p_iter[0] = p0[l];
+      pc->delta_p[0] = d0[l];
+      #if (SELECTMODE==1)
+      pc->p_iter[1] = p1[l];
+      pc->delta_p[1] = d1[l];
+      #endif
+      pc->delta_p_sqnorm = dpsq[l];
+      pc->delta_p_sqnorm_init = dpsqi[l];
+      pc->mares = mares[l];
+      pc->mares_old = mareso[l];
+      pc->cnt = (int) cnt[l];
+      pc->hasconverged = 1;
+      pc->hasoptstarted = 1;
+      pc->invalid = false;
+      pc->outlier = ((__v4si) reset)[l] != 0;
+      if (op->p_rowstep > 1) // error image of the whole patch for densification
+      {
+        lp[l]->getPatchStaticBil(lp[l]->im_bo->data(), &(pc->pt_iter), &(pc->pdiff));
+        lp[l]->LossComputeErrorImage(&pc->pdiff, &pc->pweight, &pc->pdiff, &(lp[l]->tmp));
+      }
+      lp[l] = nullptr;
+    }
+    upd = allset;
+  }
+}
+
+template<int costfct>
+void PatClass::BatchErrImgFused(v4sf * accx, v4sf * accy, v4sf * acca)
+{
+  #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)
+  const int noc = 1;
+  #else
+  const int noc = 3;
+  #endif
+  
+  // bilinear weights and corner positions as in getPatchStaticBil()
+  const Eigen::Vector2f & mid = pc->pt_iter;
+  const int posx = ceil(mid[0]+.00001f) + cpt->imgpadding;
+  const int posy = ceil(mid[1]+.00001f) + cpt->imgpadding;
+  const float rx = mid[0] - floor(mid[0]);
+  const float ry = mid[1] - floor(mid[1]);
+  const v4sf we2 = _mm_set1_ps(rx*(1-ry)), we3 = _mm_set1_ps((1-rx)*(1-ry));
+  #if (SELECTMODE==1)
+  const v4sf we0 = _mm_set1_ps(rx*ry), we1 = _mm_set1_ps((1-rx)*ry);
+  #endif
+
+  const int lb = -op->p_samp_s/2;
+  const int rs = cpt->tmp_w * noc;          // image row stride
+  const int rowlen = op->p_samp_s * noc;    // patch row length in floats
+  
+  v4sf pmean = op->zero;
+  if (op->patnorm>0)
+  #if (SELECTMODE==1)
+    pmean = _mm_set1_ps((we0[0] * BoxSum(im_bo_sat, posx+lb,   posy+lb  ) + we1[0] * BoxSum(im_bo_sat, posx+lb-1, posy+lb  ) + 
+                         we2[0] * BoxSum(im_bo_sat, posx+lb,   posy+lb-1) + we3[0] * BoxSum(im_bo_sat, posx+lb-1, posy+lb-1)) / op->novals);
+  #else
+    pmean = _mm_set1_ps((we2[0] * BoxSum(im_bo_sat, posx+lb,   posy+lb-1) + we3[0] * BoxSum(im_bo_sat, posx+lb-1, posy+lb-1)) / op->novals);
+  #endif
+
+  v4sf ax = op->zero, ay = op->zero, aa = op->zero;
+  
+  if (costfct==10) // NCC, see LossComputeErrorImage(). Always all rows
+  {
+    // pass 1: mean-normalized sample into pdiff, its squared norm, and the projections of sample and template
+    const v4sf * te = (v4sf*) tmp.data(), * dx = (v4sf*) dxx_tmp.data();
+    #if (SELECTMODE==1)
+    const v4sf * dy = (v4sf*) dyy_tmp.data();
+    #endif
+    v4sf * pa = (v4sf*) pc->pdiff.data();
+    v4sf ssq = op->zero, axt = op->zero, ayt = op->zero;
+    for (int j = 0; j < op->p_samp_s; ++j)
+    {
+      const float * img_c = im_bo->data() + (posy+lb+j-1) * rs + (posx+lb) * noc;
+      #if (SELECTMODE==1)
+      const float * img_a = img_c + rs;
+      for (int i = 0; i < rowlen; i += 4, ++te, ++dx, ++dy, ++pa)
+      {
+        (*pa) = we0 * _mm_loadu_ps(img_a+i) + we1 * _mm_loadu_ps(img_a+i-noc) + we2 * _mm_loadu_ps(img_c+i) + we3 * _mm_loadu_ps(img_c+i-noc) - pmean;
+        ssq += (*pa) * (*pa);
+        ax  += (*dx) * (*pa);
+        axt += (*dx) * (*te);
+        ay  += (*dy) * (*pa);
+        ayt += (*dy) * (*te);
+      }
+      #else
+      for (int i = 0; i < rowlen; i += 4, ++te, ++dx, ++pa)
+      {
+        (*pa) = we2 * _mm_loadu_ps(img_c+i) + we3 * _mm_loadu_ps(img_c+i-noc) - pmean;
+        ssq += (*pa) * (*pa);
+        ax  += (*dx) * (*pa);
+        axt += (*dx) * (*te);
+      }
+      #endif
+    }
+    // residual g*sample - template is linear in the sample: projections follow from the sums above
+    const float ssqs = (ssq[0] + ssq[1]) + (ssq[2] + ssq[3]);
+    const v4sf g = _mm_set1_ps((ssqs > 0) ? pc->tnorm / sqrt(ssqs) : 0.0f);
+    ax = g * ax - axt;
+    ay = g * ay - ayt;
+    
+    // pass 2: error image
+    te = (v4sf*) tmp.data();
+    pa = (v4sf*) pc->pdiff.data();
+    v4sf * pw = (v4sf*) pc->pweight.data();
+    for (int i = op->novals/4; i--; ++te, ++pa, ++pw)
+    {
+      (*pa) = g * (*pa) - (*te);
+      (*pw) = _mm_andnot_ps(op->negzero, (*pa));
+      aa += (*pw);
+    }
+    *accx = ax;
+    *accy = ay;
+    *acca = aa;
+    return;
+  }
+  
+  for (int j = 0; j < op->p_samp_s; j += op->p_rowstep) // sparse sampling: every p_rowstep-th row
+  {
+    const v4sf * te = (v4sf*) (tmp.data() + j*rowlen), * dx = (v4sf*) (dxx_tmp.data() + j*rowlen);
+    #if (SELECTMODE==1)
+    const v4sf * dy = (v4sf*) (dyy_tmp.data() + j*rowlen);
+    #endif
+    v4sf * pw = (v4sf*) (pc->pweight.data() + j*rowlen);
+    const float * img_c = im_bo->data() + (posy+lb+j-1) * rs + (posx+lb) * noc;
+    #if (SELECTMODE==1)
+    const float * img_a = img_c + rs;
+    for (int i = 0; i < rowlen; i += 4, ++te, ++dx, ++dy, ++pw)
+    {
+      v4sf pd = we0 * _mm_loadu_ps(img_a+i) + we1 * _mm_loadu_ps(img_a+i-noc) + we2 * _mm_loadu_ps(img_c+i) + we3 * _mm_loadu_ps(img_c+i-noc) - pmean;
+    #else // rectified stereo: the patch stays on its integer image rows, linear interpolation along the row only
+    for (int i = 0; i < rowlen; i += 4, ++te, ++dx, ++pw)
+    {
+      v4sf pd = we2 * _mm_loadu_ps(img_c+i) + we3 * _mm_loadu_ps(img_c+i-noc) - pmean;
+    #endif
+      pd -= (*te);
+      
+      // cost function as in LossComputeErrorImage()
+      if (costfct==1) // L1
+        pd = _mm_or_ps(_mm_and_ps(op->negzero, pd), _mm_sqrt_ps(_mm_andnot_ps(op->negzero, pd)));
+      else if (costfct==2) // Pseudo Huber
+        pd = _mm_or_ps(_mm_and_ps(op->negzero, pd), 
+                       _mm_sqrt_ps(_mm_mul_ps(_mm_sqrt_ps(op->ones + _mm_div_ps(_mm_mul_ps(pd, pd), op->normoutlier_tmpbsq)) - op->ones, op->normoutlier_tmp2bsq)));
+      
+      (*pw) = _mm_andnot_ps(op->negzero, pd);
+      ax += (*dx) * pd;
+      #if (SELECTMODE==1)
+      ay += (*dy) * pd;
+      #endif
+      aa += (*pw);
+    }
+  }
+  *accx = ax;
+  *accy = ay;
+  *acca = aa;
+}
+
 inline void PatClass::paramtopt()
 {
     #if (SELECTMODE==1)   
@@ -220,6 +629,16 @@ inline void PatClass::paramtopt()
     #endif
 }
 
+inline bool PatClass::InsideImage() const
+{
+    #if (SELECTMODE==1)
+    return !(pc->pt_iter[0] < cpt->tmp_lb  || pc->pt_iter[1] < cpt->tmp_lb ||
+             pc->pt_iter[0] > cpt->tmp_ubw || pc->pt_iter[1] > cpt->tmp_ubh);
+    #else
+    return !(pc->pt_iter[0] < cpt->tmp_lb  || pc->pt_iter[0] > cpt->tmp_ubw); // patches stay on their image row
+    #endif
+}
+
 void PatClass::LossComputeErrorImage(Eigen::Matrix<float, Eigen::Dynamic, 1>* patdest, Eigen::Matrix<float, Eigen::Dynamic, 1>* wdest, const Eigen::Matrix<float, Eigen::Dynamic, 1>* patin,  const Eigen::Matrix<float, Eigen::Dynamic, 1>*  tmpin)
 {
   v4sf * pd = (v4sf*) patdest->data(),
@@ -259,6 +678,23 @@ void PatClass::LossComputeErrorImage(Eigen::Matrix<float, Eigen::Dynamic, 1>* pa
       (*pw) = __builtin_ia32_andnps(op->negzero,  (*pd) );                                    
     }
   }
+  else if (op->costfct==10) // Normalized cross-correlation
+  {
+    // The mean-normalized sample is scaled to the norm of the (mean-normalized) template, so that ||g*sample - template||^2 = 2*||template||^2*(1-NCC).
+    // Its steepest descent images are those of the template, i.e. the same Hessian and projections as L2, with residuals in template units.
+    v4sf ssq = op->zero;
+    for (int i=op->novals/4; i--; ++pa)
+      ssq += (*pa) * (*pa);
+    const float ssqs = (ssq[0] + ssq[1]) + (ssq[2] + ssq[3]);
+    const v4sf g = _mm_set1_ps((ssqs > 0) ? pc->tnorm / sqrt(ssqs) : 0.0f);
+    
+    pa = (v4sf*) patin->data();
+    for (int i=op->novals/4; i--; ++pd, ++pa, ++te, ++pw)
+    {
+      (*pd) = g * (*pa) - (*te);
+      (*pw) = __builtin_ia32_andnps(op->negzero,  (*pd) );
+    }
+  }
 }
 
 void PatClass::OptimizeComputeErrImg()
@@ -292,7 +728,11 @@ void PatClass::getPatchStaticNNGrad(const float* img, const float* img_dx, const
 {
   float *tmp_in    = tmp_in_e->data();
   float *tmp_dx_in = tmp_dx_in_e->data();
+  #if (SELECTMODE==1)
   float *tmp_dy_in = tmp_dy_in_e->data();
+  #else  // rows only, no vertical gradient
+  (void)img_dy; (void)tmp_dy_in_e;
+  #endif
   
   Eigen::Vector2i pos;
   Eigen::Vector2i pos_it;
@@ -305,6 +745,10 @@ void PatClass::getPatchStaticNNGrad(const float* img, const float* img_dx, const
   int lb = -op->p_samp_s/2;
   int ub = op->p_samp_s/2-1;  
 
+  float pmean = 0.0f; // patch mean, subtracted while extracting if known from the integral image
+  if (op->patnorm>0 && im_ao_sat != nullptr)
+    pmean = BoxSum(im_ao_sat, pos[0]+lb, pos[1]+lb) / op->novals;
+
   for (int j=lb; j <= ub; ++j)    
   {
     for (int i=lb; i <= ub; ++i, ++posxx)
@@ -313,21 +757,31 @@ void PatClass::getPatchStaticNNGrad(const float* img, const float* img_dx, const
       pos_it[1] = pos[1]+j;
       int idx = pos_it[0] + pos_it[1] * cpt->tmp_w;
 
-      #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // Single channel
-      tmp_in[posxx] = img[idx];
+      #if (SELECTMODE==2) // Depth from stereo, horizontal gradient only
+        #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // Single channel
+        tmp_in[posxx] = img[idx] - pmean;
+        tmp_dx_in[posxx] = img_dx[idx];
+        #else  // 3 RGB channels
+        idx *= 3;
+        tmp_in[posxx] = img[idx] - pmean; tmp_dx_in[posxx] = img_dx[idx]; ++posxx; ++idx;
+        tmp_in[posxx] = img[idx] - pmean; tmp_dx_in[posxx] = img_dx[idx]; ++posxx; ++idx;
+        tmp_in[posxx] = img[idx] - pmean; tmp_dx_in[posxx] = img_dx[idx];
+        #endif
+      #elif (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // Single channel
+      tmp_in[posxx] = img[idx] - pmean;
       tmp_dx_in[posxx] = img_dx[idx];
       tmp_dy_in[posxx] = img_dy[idx];
       #else  // 3 RGB channels
       idx *= 3;
-      tmp_in[posxx] = img[idx]; tmp_dx_in[posxx] = img_dx[idx]; tmp_dy_in[posxx] = img_dy[idx]; ++posxx; ++idx;
-      tmp_in[posxx] = img[idx]; tmp_dx_in[posxx] = img_dx[idx]; tmp_dy_in[posxx] = img_dy[idx]; ++posxx; ++idx;
-      tmp_in[posxx] = img[idx]; tmp_dx_in[posxx] = img_dx[idx]; tmp_dy_in[posxx] = img_dy[idx];
+      tmp_in[posxx] = img[idx] - pmean; tmp_dx_in[posxx] = img_dx[idx]; tmp_dy_in[posxx] = img_dy[idx]; ++posxx; ++idx;
+      tmp_in[posxx] = img[idx] - pmean; tmp_dx_in[posxx] = img_dx[idx]; tmp_dy_in[posxx] = img_dy[idx]; ++posxx; ++idx;
+      tmp_in[posxx] = img[idx] - pmean; tmp_dx_in[posxx] = img_dx[idx]; tmp_dy_in[posxx] = img_dy[idx];
       #endif
     }
   }
 
   // PATCH NORMALIZATION
-  if (op->patnorm>0) // Subtract Mean
+  if (op->patnorm>0 && im_ao_sat == nullptr) // Subtract Mean
     tmp_in_e->array() -= (tmp_in_e->sum() / op->novals);    
 }
 
@@ -358,7 +812,7 @@ void PatClass::getPatchStaticBil(const float* img, const Eigen::Vector2f* mid_in
   pos[1] += cpt->imgpadding;
   
   float * tmp_it = tmp_in;
-  const float * img_a, * img_b, * img_c, * img_d, *img_e; 
+  const float *img_e; 
    
   #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // 1 channel image
     img_e = img    + pos[0]-op->p_samp_s/2;
@@ -369,6 +823,35 @@ void PatClass::getPatchStaticBil(const float* img, const Eigen::Vector2f* mid_in
   int lb = -op->p_samp_s/2;
   int ub = op->p_samp_s/2-1;     
 
+  // Bilinear weights are constant over the patch: its mean is the same combination of four shifted box sums
+  float pmean = 0.0f;
+  #if (SELECTMODE==1)
+  if (op->patnorm>0 && im_bo_sat != nullptr)
+    pmean = (we[0] * BoxSum(im_bo_sat, pos[0]+lb,   pos[1]+lb  ) + we[1] * BoxSum(im_bo_sat, pos[0]+lb-1, pos[1]+lb  ) + 
+             we[2] * BoxSum(im_bo_sat, pos[0]+lb,   pos[1]+lb-1) + we[3] * BoxSum(im_bo_sat, pos[0]+lb-1, pos[1]+lb-1)) / op->novals;
+  #else
+  if (op->patnorm>0 && im_bo_sat != nullptr)
+    pmean = (we[2] * BoxSum(im_bo_sat, pos[0]+lb,   pos[1]+lb-1) + we[3] * BoxSum(im_bo_sat, pos[0]+lb-1, pos[1]+lb-1)) / op->novals;
+  #endif
+
+  #if (SELECTMODE==2)
+  // Depth from stereo on rectified images: the patch stays on its integer image rows (we[0] = we[1] = 0), 
+  // linear interpolation along the row between pixels pos[0]-1 and pos[0]
+  #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)
+  const int noc = 1;
+  #else
+  const int noc = 3;
+  #endif
+  const int rowlen = op->p_samp_s * noc;
+  for (pos_it[1]=pos[1]+lb; pos_it[1] <= pos[1]+ub; ++pos_it[1])    
+  {
+    const float * img_c = img_e + (pos_it[1]-1) * cpt->tmp_w * noc;
+    const float * img_d = img_c - noc;
+    for (int i = 0; i < rowlen; ++i, ++tmp_it)
+      (*tmp_it) = we[2] * img_c[i] + we[3] * img_d[i] - pmean;
+  }
+  #else
+  const float * img_a, * img_b, * img_c, * img_d;
   for (pos_it[1]=pos[1]+lb; pos_it[1] <= pos[1]+ub; ++pos_it[1])    
   {
     #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // 1 channel image
@@ -388,18 +871,27 @@ void PatClass::getPatchStaticBil(const float* img, const Eigen::Vector2f* mid_in
             ++tmp_it,++img_a,++img_b,++img_c,++img_d)    
     {
       #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // Single channel
-        (*tmp_it)     = we[0] * (*img_a) + we[1] * (*img_b) + we[2] * (*img_c) + we[3] * (*img_d); 
+        (*tmp_it)     = we[0] * (*img_a) + we[1] * (*img_b) + we[2] * (*img_c) + we[3] * (*img_d) - pmean; 
       #else // 3-channel RGB image
-        (*tmp_it)     = we[0] * (*img_a) + we[1] * (*img_b) + we[2] * (*img_c) + we[3] * (*img_d); ++tmp_it; ++img_a; ++img_b; ++img_c; ++img_d;
-        (*tmp_it)     = we[0] * (*img_a) + we[1] * (*img_b) + we[2] * (*img_c) + we[3] * (*img_d); ++tmp_it; ++img_a; ++img_b; ++img_c; ++img_d;
-        (*tmp_it)     = we[0] * (*img_a) + we[1] * (*img_b) + we[2] * (*img_c) + we[3] * (*img_d);
+        (*tmp_it)     = we[0] * (*img_a) + we[1] * (*img_b) + we[2] * (*img_c) + we[3] * (*img_d) - pmean; ++tmp_it; ++img_a; ++img_b; ++img_c; ++img_d;
+        (*tmp_it)     = we[0] * (*img_a) + we[1] * (*img_b) + we[2] * (*img_c) + we[3] * (*img_d) - pmean; ++tmp_it; ++img_a; ++img_b; ++img_c; ++img_d;
+        (*tmp_it)     = we[0] * (*img_a) + we[1] * (*img_b) + we[2] * (*img_c) + we[3] * (*img_d) - pmean;
       #endif
     }
   }
+  #endif
   // PATCH NORMALIZATION
-  if (op->patnorm>0) // Subtract Mean
+  if (op->patnorm>0 && im_bo_sat == nullptr) // Subtract Mean
     tmp_in_e->array() -= (tmp_in_e->sum() / op->novals);    
 }  
+
+inline double PatClass::BoxSum(const double * sat, const int x0, const int y0) const
+{
+  const int sw = cpt->tmp_w + 1;
+  const int x1 = x0 + op->p_samp_s;
+  const int y1 = y0 + op->p_samp_s;
+  return sat[y1*sw + x1] - sat[y1*sw + x0] - sat[y0*sw + x1] + sat[y0*sw + x0];
+}
  
 
 }
@@ -27,9 +27,11 @@ typedef struct
 
   #if (SELECTMODE==1) // Optical Flow
   Eigen::Matrix<float, 2, 2> Hes; // Hessian for optimization
+  float tnorm = 1.0f; // NCC: L2 norm of the mean-normalized reference patch
   Eigen::Vector2f p_in, p_iter, delta_p; // point position, displacement to starting position, iteration update
   #else // Depth from Stereo
   Eigen::Matrix<float, 1, 1> Hes; // Hessian for optimization
+  float tnorm = 1.0f; // NCC: L2 norm of the mean-normalized reference patch
   Eigen::Matrix<float, 1, 1> p_in, p_iter, delta_p; // point position, displacement to starting position, iteration update
   #endif
 
@@ -44,6 +46,9 @@ typedef struct
   float mares_old = 1e20;
   int cnt=0;
   bool invalid=false;
+  bool lowtex=false; // textureless, Hessian eigenvalue below op->lowtex_thresh: not optimized, keeps the initial displacement
+  bool unchanged=false; // incremental mode, images unchanged since the previous frame: not optimized, keeps the initial (previous) displacement
+  bool outlier=false; // moved more than op->outlierthresh from its start (or left the image) and was reset to it
 } patchstate;
 
 
@@ -59,8 +64,17 @@ public:
 
   ~PatClass();
 
-  void InitializePatch(Eigen::Map<const Eigen::MatrixXf> * im_ao_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dx_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dy_in, const Eigen::Vector2f pt_ref_in);
-  void SetTargetImage(Eigen::Map<const Eigen::MatrixXf> * im_bo_in, Eigen::Map<const Eigen::MatrixXf> * im_bo_dx_in, Eigen::Map<const Eigen::MatrixXf> * im_bo_dy_in);
+  #if (SELECTMODE==1) // Optical Flow
+  void InitializePatch(Eigen::Map<const Eigen::MatrixXf> * im_ao_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dx_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dy_in, const Eigen::Vector2f pt_ref_in, 
+                       const Eigen::Matrix<float, 2, 2> * hes_in = nullptr,  // optional precomputed Hessian (sum of gradient products over the patch)
+                       const double * im_ao_sat_in = nullptr);               // optional integral image of im_ao, for O(1) patch means
+  #else  // Depth from Stereo
+  void InitializePatch(Eigen::Map<const Eigen::MatrixXf> * im_ao_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dx_in, Eigen::Map<const Eigen::MatrixXf> * im_ao_dy_in, const Eigen::Vector2f pt_ref_in, 
+                       const Eigen::Matrix<float, 1, 1> * hes_in = nullptr, 
+                       const double * im_ao_sat_in = nullptr);
+  #endif
+  void SetTargetImage(Eigen::Map<const Eigen::MatrixXf> * im_bo_in, Eigen::Map<const Eigen::MatrixXf> * im_bo_dx_in, Eigen::Map<const Eigen::MatrixXf> * im_bo_dy_in, 
+                      const double * im_bo_sat_in = nullptr); // optional integral image of im_bo, for O(1) patch means
 
   #if (SELECTMODE==1) // Optical Flow
   void OptimizeIter(const Eigen::Vector2f p_in_arg, const bool untilconv);
@@ -68,10 +82,22 @@ public:
   void OptimizeIter(const Eigen::Matrix<float, 1, 1> p_in_arg, const bool untilconv);
   #endif
 
+  // Optimize n patches until convergence in lock-step, one patch per SIMD lane. Same iterations as OptimizeIter(p_init[i], true), 
+  // but with precomputed inverse Hessians, no per-patch reductions, and lanes of converged patches refilled with the next patch.
+  #if (SELECTMODE==1) // Optical Flow
+  static void OptimizeBatch(PatClass ** pat, const Eigen::Vector2f * p_init, const int n);
+  #else  // Depth from Stereo
+  static void OptimizeBatch(PatClass ** pat, const Eigen::Matrix<float, 1, 1> * p_init, const int n);
+  #endif
+
   inline const bool isConverged() const { return pc->hasconverged; }
   inline const bool hasOptStarted() const { return pc->hasoptstarted; }
   inline const Eigen::Vector2f GetPointPos() const { return pc->pt_iter; }  // get current iteration patch position (in this frame's opposite camera for OF, Depth)
   inline const bool IsValid() const { return (!pc->invalid) ; }
+  inline const bool IsLowTexture() const { return pc->lowtex; }
+  inline void SetUnchanged() { pc->unchanged = true; }
+  inline const bool IsOutlier() const { return pc->outlier; }
+  inline const float GetResidual() const { return pc->mares; } // mean absolute residual of the last iteration
   inline const float * GetpWeightPtr() const {return (float*) pc->pweight.data(); } // Return data pointer to image error patch, used in efficient indexing for densification in patchgrid class
 
   #if (SELECTMODE==1) // Optical Flow
@@ -96,8 +122,9 @@ private:
 
   void OptimizeComputeErrImg();
   void paramtopt();
+  inline bool InsideImage() const; // current position inside the valid image region
   void ResetPatch();
-  void ComputeHessian();
+  void ComputeHessian(const bool hasHes);
   void CreateStatusStruct(patchstate * psin);
   void LossComputeErrorImage(Eigen::Matrix<float, Eigen::Dynamic, 1>* patdest,  Eigen::Matrix<float, Eigen::Dynamic, 1>* wdest, const Eigen::Matrix<float, Eigen::Dynamic, 1>* patin,  const Eigen::Matrix<float, Eigen::Dynamic, 1>*  tmpin);
 
@@ -105,6 +132,11 @@ private:
   void getPatchStaticNNGrad    (const float* img, const float* img_dx, const float* img_dy,  const Eigen::Vector2f* mid_in, Eigen::Matrix<float, Eigen::Dynamic, 1>* tmp_in,  Eigen::Matrix<float, Eigen::Dynamic, 1>*  tmp_dx_in, Eigen::Matrix<float, Eigen::Dynamic, 1>* tmp_dy_in);
   // Extract patch on float position with bilinear interpolation, no gradients.
   void getPatchStaticBil(const float* img, const Eigen::Vector2f* mid_in,  Eigen::Matrix<float, Eigen::Dynamic, 1>* tmp_in_e);
+  // Error image of the batched optimizer in one pass: bilinear sampling, mean normalization, cost function, and the sums of dx*pdiff, dy*pdiff, pweight.
+  // Needs rows of whole v4sf (p_samp_s*channels divisible by 4) and, with patnorm, the integral image of the target. Writes pweight, not pdiff.
+  template<int costfct> void BatchErrImgFused(v4sf * accx, v4sf * accy, v4sf * acca);
+  // Sum of all channels in the p_samp_s*p_samp_s box with top-left (padded) pixel (x0,y0), from integral image
+  inline double BoxSum(const double * sat, const int x0, const int y0) const;
 
   Eigen::Vector2f pt_ref; // reference point location
   Eigen::Matrix<float, Eigen::Dynamic, 1> tmp;
@@ -113,6 +145,7 @@ private:
 
   Eigen::Map<const Eigen::MatrixXf> * im_ao, * im_ao_dx, * im_ao_dy;
   Eigen::Map<const Eigen::MatrixXf> * im_bo, * im_bo_dx, * im_bo_dy;
+  const double * im_ao_sat = nullptr, * im_bo_sat = nullptr; // integral images (tmp_w+1)*(tmp_h+1), leading zero row/column, only with patnorm
 
   const camparam* cpt;
   const camparam* cpo;
@@ -7,6 +7,8 @@
 #include <string>
 #include <vector>
 #include <valarray>
+#include <limits>
+#include <algorithm>
 
 #include <thread>
 
@@ -15,6 +17,7 @@
 #include <Eigen/Dense>
 
 #include <stdio.h>
+#include <smmintrin.h>
 
 #include "patch.h"
 #include "patchgrid.h"
@@ -38,18 +41,70 @@ namespace OFC
     op(op_in)
   {
 
-  // Generate grid on current scale
+  // Generate grid on current scale, centered on the image or on the frame it is a tile of
   steps = op->steps;
-  nopw = ceil( (float)cpt->width /  (float)steps );
-  noph = ceil( (float)cpt->height / (float)steps );
-  const int offsetw = floor((cpt->width - (nopw-1)*steps)/2);
-  const int offseth = floor((cpt->height - (noph-1)*steps)/2);
+  const int framew = (cpt->frame_w > 0) ? cpt->frame_w : cpt->width;
+  const int frameh = (cpt->frame_w > 0) ? cpt->frame_h : cpt->height;
+  const int nopfw = ceil( (float)framew / (float)steps );
+  const int nopfh = ceil( (float)frameh / (float)steps );
+  const int offsetw = ((framew - (nopfw-1)*steps)/2 - cpt->tile_x % steps + steps) % steps;
+  const int offseth = ((frameh - (nopfh-1)*steps)/2 - cpt->tile_y % steps + steps) % steps;
+  nopw = (cpt->width - 1 - offsetw) / steps + 1;
+  noph = (cpt->height - 1 - offseth) / steps + 1;
+
+  // Region of interest: count of its pixels in the rectangle left/above of each pixel, to test patch footprints in O(1)
+  std::vector<int> roisat;
+  if (cpt->roi != nullptr)
+  {
+    const int sw = cpt->width + 1;
+    roisat.assign((size_t)sw * (cpt->height + 1), 0);
+    for (int y = 0; y < cpt->height; ++y)
+    {
+      int acc = 0;
+      for (int x = 0; x < cpt->width; ++x)
+      {
+        acc += (cpt->roi[y*cpt->width + x] != 0);
+        roisat[(y+1)*sw + x+1] = roisat[y*sw + x+1] + acc;
+      }
+    }
+  }
 
-  nopatches = nopw*noph;
-  pt_ref.resize(nopatches);
-  p_init.resize(nopatches);
-  pat.reserve(nopatches);
 
+  #if (SELECTMODE==1)
+  for (int x = 0; x < nopw; ++x)
+    for (int y = 0; y < noph; ++y)
+  #else // Depth from stereo: row-major, consecutive patches (blocks of the batched optimizer) lie on the same image rows
+  for (int y = 0; y < noph; ++y)
+    for (int x = 0; x < nopw; ++x)
+  #endif
+    {
+      if (cpt->roi == nullptr || InRegionOfInterest(roisat, x * steps + offsetw, y * steps + offseth))
+        pt_ref.push_back(Eigen::Vector2f(x * steps + offsetw, y * steps + offseth));
+    }
+
+  CreatePatches(cpt->roi == nullptr);
+}
+
+  PatGridClass::PatGridClass(
+    const camparam* cpt_in,
+    const camparam* cpo_in,
+    const optparam* op_in,
+    const std::vector<Eigen::Vector2f> & pt_ref_in)
+  :
+    cpt(cpt_in),
+    cpo(cpo_in),
+    op(op_in),
+    pt_ref(pt_ref_in)
+  {
+  steps = op->steps;
+  nopw = 0;
+  noph = 0;
+
+  CreatePatches(false);
+}
+
+void PatGridClass::CreatePatches(const bool denseall)
+{
   im_ao_eg = new Eigen::Map<const Eigen::MatrixXf>(nullptr,cpt->height,cpt->width);
   im_ao_dx_eg = new Eigen::Map<const Eigen::MatrixXf>(nullptr,cpt->height,cpt->width);
   im_ao_dy_eg = new Eigen::Map<const Eigen::MatrixXf>(nullptr,cpt->height,cpt->width);
@@ -58,23 +113,45 @@ namespace OFC
   im_bo_dx_eg = new Eigen::Map<const Eigen::MatrixXf>(nullptr,cpt->height,cpt->width);
   im_bo_dy_eg = new Eigen::Map<const Eigen::MatrixXf>(nullptr,cpt->height,cpt->width);
 
-  int patchid=0;
-  for (int x = 0; x < nopw; ++x)
+  nopatches = pt_ref.size();
+  p_init.resize(nopatches);
+  pat.resize(nopatches);
+  for (int i = 0; i < nopatches; ++i)
   {
-    for (int y = 0; y < noph; ++y)
-    {
-      int i = x*noph + y;
+    p_init[i].setZero();
+    pat[i] = new OFC::PatClass(cpt, cpo, op, i);
+  }
 
-      pt_ref[i][0] = x * steps + offsetw;
-      pt_ref[i][1] = y * steps + offseth;
-      p_init[i].setZero();
+  // Per-patch Hessians and means touch p_samp_s^2 pixels per patch, summed-area tables all (padded) pixels once
+  usesat = denseall || ((double)nopatches * op->p_samp_s * op->p_samp_s > (double)cpt->tmp_w * cpt->tmp_h);
 
-      pat.push_back(new OFC::PatClass(cpt, cpo, op, patchid));
-      patchid++;
+  // columns covered by patches in each row, densification only touches these
+  const int lb = -op->p_samp_s/2;
+  const int ub = op->p_samp_s/2-1;
+  spanx0.assign(cpt->height, cpt->width);
+  spanx1.assign(cpt->height, -1);
+  for (int i = 0; i < nopatches; ++i)
+  {
+    const int px = round(pt_ref[i][0]), py = round(pt_ref[i][1]);
+    const int x0 = std::max(px + lb, 0), x1 = std::min(px + ub, cpt->width-1);
+    for (int y = std::max(py + lb, 0); y <= std::min(py + ub, cpt->height-1); ++y)
+    {
+      spanx0[y] = std::min(spanx0[y], x0);
+      spanx1[y] = std::max(spanx1[y], x1);
     }
   }
 }
 
+bool PatGridClass::InRegionOfInterest(const std::vector<int> & roisat, const int x, const int y) const
+{
+  const int sw = cpt->width + 1;
+  const int x0 = std::max(x - op->p_samp_s/2 - cpt->roimargin, 0), x1 = std::min(x + op->p_samp_s/2 + cpt->roimargin, cpt->width);  // [x0, x1)
+  const int y0 = std::max(y - op->p_samp_s/2 - cpt->roimargin, 0), y1 = std::min(y + op->p_samp_s/2 + cpt->roimargin, cpt->height);
+  if (x0 >= x1 || y0 >= y1)
+    return false;
+  return (roisat[y1*sw + x1] - roisat[y1*sw + x0] - roisat[y0*sw + x1] + roisat[y0*sw + x0]) > 0;
+}
+
 PatGridClass::~PatGridClass()
 {
   delete im_ao_eg;
@@ -106,13 +183,147 @@ void PatGridClass::InitializeGrid(const float * im_ao_in, const float * im_ao_dx
   new (im_ao_dy_eg) Eigen::Map<const Eigen::MatrixXf>(im_ao_dy,cpt->height,cpt->width);
 
 
+  // Hessians of all patches as box sums over summed-area tables of the gradient products: O(1) per patch, independent of patch overlap
+  #if (SELECTMODE==1)
+  std::vector<Eigen::Matrix<float, 2, 2>> hes(nopatches);
+  #else
+  std::vector<Eigen::Matrix<float, 1, 1>> hes(nopatches);
+  #endif
+  if (usesat)
+    ComputeHessians(hes.data());
+  
+  if (op->patnorm>0 && usesat)
+    ComputeIntegralImage(im_ao, &im_ao_sat);
+
   #pragma omp parallel for schedule(static)
   for (int i = 0; i < nopatches; ++i)
   {
-    pat[i]->InitializePatch(im_ao_eg, im_ao_dx_eg, im_ao_dy_eg, pt_ref[i]);
+    pat[i]->InitializePatch(im_ao_eg, im_ao_dx_eg, im_ao_dy_eg, pt_ref[i], usesat ? &(hes[i]) : nullptr, (op->patnorm>0 && usesat) ? im_ao_sat.data() : nullptr);
     p_init[i].setZero();
   }
 
+  // only read while extracting the reference patches, all grids live until the end of the constructor
+  im_ao_sat.clear();
+  im_ao_sat.shrink_to_fit();
+}
+
+#if (SELECTMODE==1)
+void PatGridClass::ComputeHessians(Eigen::Matrix<float, 2, 2> * hes) const
+#else
+void PatGridClass::ComputeHessians(Eigen::Matrix<float, 1, 1> * hes) const
+#endif
+{
+  #if (SELECTMODE==1)
+  const int nt = 3; // dx*dx, dx*dy, dy*dy
+  #else
+  const int nt = 1; // dx*dx
+  #endif
+  #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)
+  const int noc = 1;
+  #else
+  const int noc = 3;
+  #endif
+  
+  // summed-area table over the padded gradient images, with one leading zero row and column. Double precision, entries grow with image size.
+  const int sw = cpt->tmp_w + 1;
+  const int sh = cpt->tmp_h + 1;
+  std::vector<double> sat((size_t)sw * sh * nt);
+  std::fill(sat.begin(), sat.begin() + sw*nt, 0.0);
+  
+  // horizontal prefix sums, rows are independent
+  #pragma omp parallel for schedule(static)
+  for (int y = 0; y < cpt->tmp_h; ++y)
+  {
+    double * srow = &sat[(size_t)(y+1) * sw * nt];
+    const float * dx = im_ao_dx + (size_t)y * cpt->tmp_w * noc;
+    const float * dy = im_ao_dy + (size_t)y * cpt->tmp_w * noc;
+    double acc[3] = {0.0, 0.0, 0.0};
+    for (int k = 0; k < nt; ++k)
+      srow[k] = 0.0;
+    for (int x = 0; x < cpt->tmp_w; ++x)
+    {
+      for (int c = 0; c < noc; ++c, ++dx, ++dy)
+      {
+        acc[0] += (*dx) * (*dx);
+        #if (SELECTMODE==1)
+        acc[1] += (*dx) * (*dy);
+        acc[2] += (*dy) * (*dy);
+        #endif
+      }
+      for (int k = 0; k < nt; ++k)
+        srow[(x+1)*nt + k] = acc[k];
+    }
+  }
+  
+  // vertical prefix sums over every p_rowstep-th row (sparse sampling), columns are independent
+  const int rs = op->p_rowstep;
+  #pragma omp parallel for schedule(static)
+  for (int x = nt; x < sw*nt; x += 64)
+  {
+    const int xe = std::min(x + 64, sw*nt);
+    for (int y = 1 + rs; y < sh; ++y)
+    {
+      double * srow = &sat[(size_t)y * sw * nt];
+      const double * sprev = srow - rs * sw * nt;
+      for (int i = x; i < xe; ++i)
+        srow[i] += sprev[i];
+    }
+  }
+  
+  // box sum over the patch rows/columns [lb, ub] around each (integer) patch midpoint, same pixels as PatClass::getPatchStaticNNGrad(), 
+  // rows lb, lb+rs, ... only
+  const int lb = -op->p_samp_s/2;
+  const int ub = op->p_samp_s/2-1;
+  
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < nopatches; ++i)
+  {
+    const int x0 = round(pt_ref[i][0]) + cpt->imgpadding + lb;
+    const int x1 = x0 + (ub - lb + 1);
+    const int yt = round(pt_ref[i][1]) + cpt->imgpadding + lb;  // first patch row
+    const int y0 = std::max(yt + 1 - rs, 0);                   // table row before it in the same row chain, row 0 is zero
+    const int y1 = yt + ((ub - lb) / rs) * rs + 1;              // table row including the last sampled patch row
+    const double * s00 = &sat[((size_t)y0 * sw + x0) * nt];
+    const double * s01 = &sat[((size_t)y0 * sw + x1) * nt];
+    const double * s10 = &sat[((size_t)y1 * sw + x0) * nt];
+    const double * s11 = &sat[((size_t)y1 * sw + x1) * nt];
+    
+    hes[i](0,0) = s11[0] - s10[0] - s01[0] + s00[0];
+    #if (SELECTMODE==1)
+    hes[i](0,1) = s11[1] - s10[1] - s01[1] + s00[1];
+    hes[i](1,1) = s11[2] - s10[2] - s01[2] + s00[2];
+    hes[i](1,0) = hes[i](0,1);
+    #endif
+  }
+}
+
+void PatGridClass::ComputeIntegralImage(const float * img, std::vector<double> * sat) const
+{
+  #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)
+  const int noc = 1;
+  #else
+  const int noc = 3;
+  #endif
+  const int sw = cpt->tmp_w + 1;
+  const int sh = cpt->tmp_h + 1;
+  sat->resize((size_t)sw * sh);
+  double * s = sat->data();
+  
+  std::fill(s, s + sw, 0.0);
+  for (int y = 1; y < sh; ++y)
+  {
+    const float * irow = img + (size_t)(y-1) * cpt->tmp_w * noc;
+    double * srow = s + (size_t)y * sw;
+    const double * sprev = srow - sw;
+    double acc = 0.0;
+    srow[0] = 0.0;
+    for (int x = 1; x < sw; ++x)
+    {
+      for (int c = 0; c < noc; ++c, ++irow)
+        acc += *irow;
+      srow[x] = sprev[x] + acc;
+    }
+  }
 }
 
 void PatGridClass::SetTargetImage(const float * im_bo_in, const float * im_bo_dx_in, const float * im_bo_dy_in)
@@ -125,19 +336,54 @@ void PatGridClass::SetTargetImage(const float * im_bo_in, const float * im_bo_dx
   new (im_bo_dx_eg) Eigen::Map<const Eigen::MatrixXf>(im_bo_dx,cpt->height,cpt->width); // new placement operator
   new (im_bo_dy_eg) Eigen::Map<const Eigen::MatrixXf>(im_bo_dy,cpt->height,cpt->width); // new placement operator
 
+  // with sparse row sampling the batched optimizer needs O(1) target means for its fused kernel, also when a region of interest disables usesat
+  const bool usebosat = op->patnorm>0 && (usesat || op->p_rowstep > 1);
+  if (usebosat)
+    ComputeIntegralImage(im_bo, &im_bo_sat);
+
   #pragma omp parallel for schedule(static)
   for (int i = 0; i < nopatches; ++i)
-    pat[i]->SetTargetImage(im_bo_eg, im_bo_dx_eg, im_bo_dy_eg);
+    pat[i]->SetTargetImage(im_bo_eg, im_bo_dx_eg, im_bo_dy_eg, usebosat ? im_bo_sat.data() : nullptr);
 
 }
 
+int PatGridClass::GetNoLowTexPatches() const
+{
+  int cnt = 0;
+  for (int i = 0; i < nopatches; ++i)
+    cnt += pat[i]->IsLowTexture();
+  return cnt;
+}
+
+int PatGridClass::GetNoOutlierPatches() const
+{
+  int cnt = 0;
+  for (int i = 0; i < nopatches; ++i)
+    cnt += pat[i]->IsOutlier();
+  return cnt;
+}
+
 void PatGridClass::Optimize()
 {
+  if (op->usebatchopt)
+  {
+    // blocks of consecutive patches, each optimized in lock-step SIMD batches
+    #pragma omp parallel for schedule(dynamic,1)
+    for (int i = 0; i < nopatches; i += 64)
+      PatClass::OptimizeBatch(&(pat[i]), &(p_init[i]), std::min(64, nopatches-i));
+  }
+  else
+  {
     #pragma omp parallel for schedule(dynamic,10)
     for (int i = 0; i < nopatches; ++i)
     {
       pat[i]->OptimizeIter(p_init[i], true); // optimize until convergence
     }
+  }
+
+  // target means are only needed during the optimization
+  im_bo_sat.clear();
+  im_bo_sat.shrink_to_fit();
 }
 
 // void PatGridClass::OptimizeAndVisualize(const float sc_fct_tmp) // needed for verbosity >= 3, DISVISUAL
@@ -192,30 +438,129 @@ void PatGridClass::Optimize()
 //   }
 // }
 
-void PatGridClass::InitializeFromCoarserOF(const float * flow_prev)
+void PatGridClass::ReuseParams(const unsigned char * keep, const float * p_prev)
 {
-  #pragma omp parallel for schedule(dynamic,10)
   for (int ip = 0; ip < nopatches; ++ip)
   {
-    int x = floor(pt_ref[ip][0] / 2); // better, but slower: use bil. interpolation here
-    int y = floor(pt_ref[ip][1] / 2);
-    int i = y*(cpt->width/2) + x;
+    const float * pp = p_prev + ((int)round(pt_ref[ip][1]) * cpt->width + (int)round(pt_ref[ip][0])) * op->nop;
+    if (!keep[ip] || std::isnan(pp[0]))
+      continue;
+    for (int c = 0; c < op->nop; ++c)
+      p_init[ip](c) = pp[c];
+    pat[ip]->SetUnchanged();
+  }
+}
+
+void PatGridClass::GetParams(float * p) const
+{
+  for (int ip = 0; ip < nopatches; ++ip)
+  {
+    float * pp = p + ((int)round(pt_ref[ip][1]) * cpt->width + (int)round(pt_ref[ip][0])) * op->nop;
+    for (int c = 0; c < op->nop; ++c)
+      pp[c] = (*(pat[ip]->GetParam()))(c);
+  }
+}
+
+void PatGridClass::InitializeFromCoarserGrid(const PatGridClass * grid_prev)
+{
+  for (int ip = 0; ip < nopatches; ++ip)
+    p_init[ip] = *(grid_prev->pat[ip]->GetParam()) * 2;
+}
+
+void PatGridClass::InitializeFromCoarserOF(const flowfield * flow_prev)
+{
+  // bilinear interpolation of the coarser flow at the patch midpoints, 4 patches per v4sf. 
+  // Pixel x on this scale lies at x/2-1/4 on the coarser one, samples are clamped to the coarser image.
+  const int wc = cpt->width/2, hc = cpt->height/2;
+  const v4sf xmax = _mm_set1_ps(wc-1), ymax = _mm_set1_ps(hc-1);
+  const v4sf quarter = _mm_set1_ps(0.25f);
+  const float * flu = flow_prev->u;
+  #if (SELECTMODE==1)
+  const float * flv = flow_prev->v;
+  #endif
+  const int pxs = flow_prev->pxstep;
+  const int fls = flow_prev->stride;
 
+  #pragma omp parallel for schedule(static)
+  for (int ip = 0; ip < nopatches; ip += 4)
+  {
+    const int n = std::min(4, nopatches-ip);
+    v4sf ptx, pty;
+    for (int l = 0; l < 4; ++l)
+    {
+      ptx[l] = pt_ref[ip + std::min(l, n-1)][0];
+      pty[l] = pt_ref[ip + std::min(l, n-1)][1];
+    }
+    
+    const v4sf xc = _mm_min_ps(_mm_max_ps(ptx * op->half - quarter, op->zero), xmax);
+    const v4sf yc = _mm_min_ps(_mm_max_ps(pty * op->half - quarter, op->zero), ymax);
+    const v4sf x0 = _mm_floor_ps(xc), y0 = _mm_floor_ps(yc);
+    const v4sf fx = xc - x0, fy = yc - y0;
+    const __v4si i00 = (__v4si) _mm_cvtps_epi32(y0) * fls + (__v4si) _mm_cvtps_epi32(x0) * pxs;
+    const __v4si dx  = (__v4si) _mm_and_ps((v4sf) _mm_cmplt_ps(x0, xmax), (v4sf) _mm_set1_epi32(pxs)); // next column, 0 at the right border
+    const __v4si dy  = (__v4si) _mm_and_ps((v4sf) _mm_cmplt_ps(y0, ymax), (v4sf) _mm_set1_epi32(fls)); // next row, 0 at the bottom border
+    
+    v4sf u00, u01, u10, u11;
     #if (SELECTMODE==1)
-    p_init[ip](0) = flow_prev[2*i  ]*2;
-    p_init[ip](1) = flow_prev[2*i+1]*2;
-    #else
-    p_init[ip](0) = flow_prev[  i  ]*2;
+    v4sf v00, v01, v10, v11;
     #endif
+    for (int l = 0; l < 4; ++l)
+    {
+      const int i = i00[l];
+      u00[l] = flu[i];       u01[l] = flu[i+dx[l]];
+      u10[l] = flu[i+dy[l]]; u11[l] = flu[i+dy[l]+dx[l]];
+      #if (SELECTMODE==1)
+      v00[l] = flv[i];       v01[l] = flv[i+dx[l]];
+      v10[l] = flv[i+dy[l]]; v11[l] = flv[i+dy[l]+dx[l]];
+      #endif
+    }
+    
+    const v4sf w00 = (op->ones-fx)*(op->ones-fy), w01 = fx*(op->ones-fy), w10 = (op->ones-fx)*fy, w11 = fx*fy;
+    const v4sf u = (w00*u00 + w01*u01 + w10*u10 + w11*u11) * op->twos;
+    #if (SELECTMODE==1)
+    const v4sf v = (w00*v00 + w01*v01 + w10*v10 + w11*v11) * op->twos;
+    #endif
+    for (int l = 0; l < n; ++l)
+    {
+      p_init[ip+l](0) = u[l];
+      #if (SELECTMODE==1)
+      p_init[ip+l](1) = v[l];
+      #endif
+    }
   }
 }
 
-void PatGridClass::AggregateFlowDense(float *flowout) const
+void PatGridClass::AggregateFlowDense(const flowfield * flowout) const
 {
   float* we = new float[cpt->width * cpt->height];
 
-  memset(flowout, 0, sizeof(float) * (op->nop * cpt->width * cpt->height) );
-  memset(we,      0, sizeof(float) * (          cpt->width * cpt->height) );
+  float * flu = flowout->u;
+  #if (SELECTMODE==1)
+  float * flv = flowout->v;
+  #endif
+  const int pxs = flowout->pxstep;
+  const int fls = flowout->stride;
+
+  if (pxs==1) // planar, also clear row padding, so it never carries garbage into the refinement
+  {
+    memset(flu, 0, sizeof(float) * (fls * cpt->height) );
+    #if (SELECTMODE==1)
+    memset(flv, 0, sizeof(float) * (fls * cpt->height) );
+    #endif
+  }
+  else
+    memset(flu, 0, sizeof(float) * (op->nop * cpt->width * cpt->height) );
+
+  // with a region of interest, weights are only cleared, accumulated and normalized within the columns covered by patches
+  const bool useroi = (cpt->roi != nullptr);
+  if (useroi)
+  {
+    for (int y = 0; y < cpt->height; ++y)
+      if (spanx1[y] >= spanx0[y])
+        memset(we + y*cpt->width + spanx0[y], 0, sizeof(float) * (spanx1[y] - spanx0[y] + 1));
+  }
+  else
+    memset(we,    0, sizeof(float) * (          cpt->width * cpt->height) );
 
   #ifdef USE_PARALLEL_ON_FLOWAGGR // Using this enables OpenMP on flow aggregation. This can lead to race conditions. Experimentally we found that the result degrades only marginally. However, for our experiments we did not enable this.
     #pragma omp parallel for schedule(static)
@@ -240,7 +585,7 @@ void PatGridClass::AggregateFlowDense(float *flowout) const
 
       for (int y = lb; y <= ub; ++y)
       {
-        for (int x = lb; x <= ub; ++x, ++pweight)
+        for (int x = lb; x <= ub; ++x, pweight += op->noc)
         {
           int yt = (y + pt_ref[ip][1]);
           int xt = (x + pt_ref[ip][0]);
@@ -249,13 +594,14 @@ void PatGridClass::AggregateFlowDense(float *flowout) const
           {
 
             int i = yt*cpt->width + xt;
+            int io = yt*fls + xt*pxs;
 
             #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // single channel/gradient image
             float absw = 1.0f /  (float)(std::max(op->minerrval  ,*pweight));
             #else  // RGB image
-            float absw = (float)(std::max(op->minerrval  ,*pweight)); ++pweight;
-                  absw+= (float)(std::max(op->minerrval  ,*pweight)); ++pweight;
-                  absw+= (float)(std::max(op->minerrval  ,*pweight));
+            float absw = (float)(std::max(op->minerrval  ,pweight[0]));
+                  absw+= (float)(std::max(op->minerrval  ,pweight[1]));
+                  absw+= (float)(std::max(op->minerrval  ,pweight[2]));
             absw = 1.0f / absw;
             #endif
 
@@ -263,10 +609,10 @@ void PatGridClass::AggregateFlowDense(float *flowout) const
             we[i] += absw;
 
             #if (SELECTMODE==1)
-            flowout[2*i]   += flnew[0];
-            flowout[2*i+1] += flnew[1];
+            flu[io] += flnew[0];
+            flv[io] += flnew[1];
             #else
-            flowout[i] += flnew[0];
+            flu[io] += flnew[0];
             #endif
           }
         }
@@ -319,20 +665,21 @@ void PatGridClass::AggregateFlowDense(float *flowout) const
 
           for (int y = lb; y <= ub; ++y)
           {
-            for (int x = lb; x <= ub; ++x, ++pweight)
+            for (int x = lb; x <= ub; ++x, pweight += op->noc)
             {
 
               int yt = y + pos[1];
               int xt = x + pos[0];
-              if (xt >= 1 && yt >= 1 && xt < (cpt->width-1) && yt < (cpt->height-1))
+              if (xt >= 1 && yt >= 1 && xt < (cpt->width-1) && yt < (cpt->height-1) &&
+                  (!useroi || (xt-1 >= std::max(spanx0[yt-1], spanx0[yt]) && xt <= std::min(spanx1[yt-1], spanx1[yt]))))
               {
 
                 #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // single channel/gradient image
                 float absw = 1.0f /  (float)(std::max(op->minerrval  ,*pweight));
                 #else  // RGB
-                float absw = (float)(std::max(op->minerrval  ,*pweight)); ++pweight;
-                      absw+= (float)(std::max(op->minerrval  ,*pweight)); ++pweight;
-                      absw+= (float)(std::max(op->minerrval  ,*pweight));
+                float absw = (float)(std::max(op->minerrval  ,pweight[0]));
+                      absw+= (float)(std::max(op->minerrval  ,pweight[1]));
+                      absw+= (float)(std::max(op->minerrval  ,pweight[2]));
                 absw = 1.0f / absw;
                 #endif
 
@@ -349,23 +696,28 @@ void PatGridClass::AggregateFlowDense(float *flowout) const
                 we[idxcf] += wbil[2] * absw;
                 we[idxff] += wbil[3] * absw;
 
+                int iocc =  xt   *pxs +  yt   *fls;
+                int iofc = (xt-1)*pxs +  yt   *fls;
+                int iocf =  xt   *pxs + (yt-1)*fls;
+                int ioff = (xt-1)*pxs + (yt-1)*fls;
+
                 #if (SELECTMODE==1)
-                flowout[2*idxcc  ] -= wbil[0] * flnew[0];   // use reversed flow
-                flowout[2*idxcc+1] -= wbil[0] * flnew[1];
+                flu[iocc] -= wbil[0] * flnew[0];   // use reversed flow
+                flv[iocc] -= wbil[0] * flnew[1];
 
-                flowout[2*idxfc  ] -= wbil[1] * flnew[0];
-                flowout[2*idxfc+1] -= wbil[1] * flnew[1];
+                flu[iofc] -= wbil[1] * flnew[0];
+                flv[iofc] -= wbil[1] * flnew[1];
 
-                flowout[2*idxcf  ] -= wbil[2] * flnew[0];
-                flowout[2*idxcf+1] -= wbil[2] * flnew[1];
+                flu[iocf] -= wbil[2] * flnew[0];
+                flv[iocf] -= wbil[2] * flnew[1];
 
-                flowout[2*idxff  ] -= wbil[3] * flnew[0];
-                flowout[2*idxff+1] -= wbil[3] * flnew[1];
+                flu[ioff] -= wbil[3] * flnew[0];
+                flv[ioff] -= wbil[3] * flnew[1];
                 #else
-                flowout[idxcc] -= wbil[0] * flnew[0]; // simple averaging of inverse horizontal displacement
-                flowout[idxfc] -= wbil[1] * flnew[0];
-                flowout[idxcf] -= wbil[2] * flnew[0];
-                flowout[idxff] -= wbil[3] * flnew[0];
+                flu[iocc] -= wbil[0] * flnew[0]; // simple averaging of inverse horizontal displacement
+                flu[iofc] -= wbil[1] * flnew[0];
+                flu[iocf] -= wbil[2] * flnew[0];
+                flu[ioff] -= wbil[3] * flnew[0];
                 #endif
               }
             }
@@ -378,16 +730,19 @@ void PatGridClass::AggregateFlowDense(float *flowout) const
   // normalize each pixel by dividing displacement by aggregated weights from all patches
   for (int yi = 0; yi < cpt->height; ++yi)
   {
-    for (int xi = 0; xi < cpt->width; ++xi)
+    const int xb = useroi ? spanx0[yi] : 0;
+    const int xe = useroi ? spanx1[yi] : cpt->width-1;
+    for (int xi = xb; xi <= xe; ++xi)
     {
       int i    = yi*cpt->width + xi;
+      int io   = yi*fls + xi*pxs;
       if (we[i]>0)
       {
         #if (SELECTMODE==1)
-        flowout[2*i  ] /= we[i];
-        flowout[2*i+1] /= we[i];
+        flu[io] /= we[i];
+        flv[io] /= we[i];
         #else
-        flowout[i] /= we[i];
+        flu[io] /= we[i];
         #endif
       }
     }
@@ -396,6 +751,199 @@ void PatGridClass::AggregateFlowDense(float *flowout) const
   delete[] we;
 }
 
+void PatGridClass::GetPatchFlow(patchflow * pf) const
+{
+  const int ps = op->p_samp_s, nop = op->nop;
+  pf->width = cpt->width;
+  pf->height = cpt->height;
+  pf->p_samp_s = ps;
+  pf->nop = nop;
+  pf->ncw = (cpt->width + ps - 1) / ps;
+  pf->nch = (cpt->height + ps - 1) / ps;
+
+  // densification weight of each pixel of a patch, as in AggregateFlowDense()
+  auto weights = [&](const PatClass * pt, vector<float> * wgt)
+  {
+    const float * pweight = pt->GetpWeightPtr();
+    for (int j = 0; j < ps*ps; ++j, pweight += op->noc)
+    {
+      #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // single channel/gradient image
+      float absw = 1.0f /  (float)(std::max(op->minerrval  ,*pweight));
+      #else  // RGB image
+      float absw = (float)(std::max(op->minerrval  ,pweight[0]));
+            absw+= (float)(std::max(op->minerrval  ,pweight[1]));
+            absw+= (float)(std::max(op->minerrval  ,pweight[2]));
+      absw = 1.0f / absw;
+      #endif
+      wgt->push_back(absw);
+    }
+  };
+
+  // patches by cell of their position (clamped to the image), counting sort
+  auto bucket = [&](const vector<int> & pos, vector<int> * cell, vector<int> * idx)
+  {
+    const int n = pos.size() / 2;
+    vector<int> c(n);
+    cell->assign(pf->ncw * pf->nch + 1, 0);
+    for (int i = 0; i < n; ++i)
+    {
+      const int cx = std::min(std::max(pos[2*i],   0), cpt->width-1)  / ps;
+      const int cy = std::min(std::max(pos[2*i+1], 0), cpt->height-1) / ps;
+      c[i] = cy * pf->ncw + cx;
+      ++(*cell)[c[i]+1];
+    }
+    for (size_t k = 1; k < cell->size(); ++k)
+      (*cell)[k] += (*cell)[k-1];
+    idx->resize(n);
+    vector<int> fill(cell->begin(), cell->end()-1);
+    for (int i = 0; i < n; ++i)
+      (*idx)[fill[c[i]]++] = i;
+  };
+
+  pf->pos.clear(); pf->par.clear(); pf->wgt.clear();
+  for (int ip = 0; ip < nopatches; ++ip)
+  {
+    if (!pat[ip]->IsValid())
+      continue;
+    pf->pos.push_back((int)pt_ref[ip][0]);
+    pf->pos.push_back((int)pt_ref[ip][1]);
+    for (int k = 0; k < nop; ++k)
+      pf->par.push_back((*pat[ip]->GetParam())[k]);
+    weights(pat[ip], &(pf->wgt));
+  }
+  bucket(pf->pos, &(pf->cell), &(pf->idx));
+
+  // complementary grid, splatted bilinearly at its target position
+  pf->pos_bw.clear(); pf->par_bw.clear(); pf->wgt_bw.clear(); pf->bil_bw.clear();
+  if (cg)
+  {
+    for (int ip = 0; ip < cg->nopatches; ++ip)
+    {
+      if (!cg->pat[ip]->IsValid())
+        continue;
+      const Eigen::Vector2f rppos = cg->pat[ip]->GetPointPos();
+      const int px = ceil(rppos[0] +.00001), py = ceil(rppos[1] +.00001);
+      const float rx = rppos[0] - floor(rppos[0]), ry = rppos[1] - floor(rppos[1]);
+      pf->pos_bw.push_back(px);
+      pf->pos_bw.push_back(py);
+      pf->bil_bw.push_back(rx*ry);
+      pf->bil_bw.push_back((1-rx)*ry);
+      pf->bil_bw.push_back(rx*(1-ry));
+      pf->bil_bw.push_back((1-rx)*(1-ry));
+      for (int k = 0; k < nop; ++k)
+        pf->par_bw.push_back((*cg->pat[ip]->GetParam())[k]);
+      weights(cg->pat[ip], &(pf->wgt_bw));
+    }
+  }
+  bucket(pf->pos_bw, &(pf->cell_bw), &(pf->idx_bw));
+
+  if (cpt->roi != nullptr)
+  {
+    pf->spanx0 = spanx0;
+    pf->spanx1 = spanx1;
+  }
+  else
+  {
+    pf->spanx0.clear();
+    pf->spanx1.clear();
+  }
+}
+
+void PatGridClass::AggregateErrorTiles(float * tileerr, const int tilesz) const
+{
+  // per pixel: harmonic mean of the residuals of all covering patches, i.e. the same 1/error weighting used in AggregateFlowDense()
+  float* we  = new float[cpt->width * cpt->height];
+  float* cnt = new float[cpt->width * cpt->height];
+  const bool useroi = (cpt->roi != nullptr); // only the columns covered by patches are touched, see AggregateFlowDense()
+  if (useroi)
+  {
+    for (int y = 0; y < cpt->height; ++y)
+      if (spanx1[y] >= spanx0[y])
+      {
+        memset(we  + y*cpt->width + spanx0[y], 0, sizeof(float) * (spanx1[y] - spanx0[y] + 1));
+        memset(cnt + y*cpt->width + spanx0[y], 0, sizeof(float) * (spanx1[y] - spanx0[y] + 1));
+      }
+  }
+  else
+  {
+    memset(we,  0, sizeof(float) * (cpt->width * cpt->height) );
+    memset(cnt, 0, sizeof(float) * (cpt->width * cpt->height) );
+  }
+
+  for (int ip = 0; ip < nopatches; ++ip)
+  {
+    if (pat[ip]->IsValid())
+    {
+      const float * pweight = pat[ip]->GetpWeightPtr();
+
+      int lb = -op->p_samp_s/2;
+      int ub = op->p_samp_s/2-1;
+
+      for (int y = lb; y <= ub; ++y)
+      {
+        for (int x = lb; x <= ub; ++x, pweight += op->noc)
+        {
+          int yt = (y + pt_ref[ip][1]);
+          int xt = (x + pt_ref[ip][0]);
+
+          if (xt >= 0 && yt >= 0 && xt < cpt->width && yt < cpt->height)
+          {
+            int i = yt*cpt->width + xt;
+
+            #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)  // single channel/gradient image
+            float absw = 1.0f /  (float)(std::max(op->minerrval  ,*pweight));
+            #else  // RGB image, error per channel
+            float absw = (float)(std::max(op->minerrval  ,pweight[0]));
+                  absw+= (float)(std::max(op->minerrval  ,pweight[1]));
+                  absw+= (float)(std::max(op->minerrval  ,pweight[2]));
+            absw = 3.0f / absw;
+            #endif
+
+            we[i] += absw;
+            cnt[i] += 1.0f;
+          }
+        }
+      }
+    }
+  }
+
+  // mean over each tile, pixels not covered by any valid patch are ignored. Tiles without any covered pixel get infinite error,
+  // with a region of interest tiles without any patch get -infinity (never refined)
+  const int ntw = (cpt->width  + tilesz - 1) / tilesz;
+  const int nth = (cpt->height + tilesz - 1) / tilesz;
+  for (int ty = 0; ty < nth; ++ty)
+  {
+    for (int tx = 0; tx < ntw; ++tx)
+    {
+      float errsum = 0.0f;
+      int nopx = 0;
+      bool inroi = !useroi;
+      for (int yi = ty*tilesz; yi < std::min((ty+1)*tilesz, cpt->height); ++yi)
+      {
+        const int xb = useroi ? std::max(tx*tilesz, spanx0[yi]) : tx*tilesz;
+        const int xe = useroi ? std::min((tx+1)*tilesz-1, spanx1[yi]) : std::min((tx+1)*tilesz, cpt->width)-1;
+        inroi |= (xb <= xe);
+        for (int xi = xb; xi <= xe; ++xi)
+        {
+          int i = yi*cpt->width + xi;
+          if (we[i]>0)
+          {
+            errsum += cnt[i] / we[i];
+            ++nopx;
+          }
+        }
+      }
+      if (!inroi)
+        tileerr[ty*ntw + tx] = -std::numeric_limits<float>::infinity();
+      else
+        tileerr[ty*ntw + tx] = (nopx > 0) ? (errsum / nopx) : std::numeric_limits<float>::infinity();
+    }
+  }
+
+  delete[] we;
+  delete[] cnt;
+}
+
 }
 
 
@@ -20,13 +20,24 @@ public:
                const camparam* cpo_in,
                const optparam* op_in);
 
+  // Sparse grid: one patch per given midpoint (in this order), instead of a regular grid
+  PatGridClass(const camparam* cpt_in,
+               const camparam* cpo_in,
+               const optparam* op_in,
+               const std::vector<Eigen::Vector2f> & pt_ref_in);
+
   ~PatGridClass();
 
   void InitializeGrid(const float * im_ao_in, const float * im_ao_dx_in, const float * im_ao_dy_in);
   void SetTargetImage(const float * im_bo_in, const float * im_bo_dx_in, const float * im_bo_dy_in);
-  void InitializeFromCoarserOF(const float * flow_prev);
+  void InitializeFromCoarserOF(const flowfield * flow_prev);
+  void InitializeFromCoarserGrid(const PatGridClass * grid_prev); // sparse grids: each patch from the doubled displacement of the same patch on the coarser scale
+  void ReuseParams(const unsigned char * keep, const float * p_prev); // incremental mode: patches with nonzero keep start from p_prev and are not optimized, unless it is NaN
+  void GetParams(float * p) const;                                    // p_prev/p: nop parameters per pixel, the patch with midpoint (x,y) at (y*width+x)*nop
 
-  void AggregateFlowDense(float *flowout) const;
+  void AggregateFlowDense(const flowfield * flowout) const;
+  void AggregateErrorTiles(float * tileerr, const int tilesz) const; // mean image residual of the densified flow on tiles of tilesz*tilesz pixels, row-major
+  void GetPatchFlow(patchflow * pf) const;                            // valid patches (and those of the complementary grid) with their densification weights, for SampleFlow()
 
   // Optimizes grid to convergence of each patch
   void Optimize();
@@ -38,18 +49,34 @@ public:
   inline const int GetNoPatches() const { return nopatches; }
   inline const int GetNoph() const { return noph; }
   inline const int GetNopw() const { return nopw; }
+  int GetNoLowTexPatches() const; // number of textureless patches, kept at their initialization
+  int GetNoOutlierPatches() const; // number of patches reset to their initialization as outliers
 
   inline const Eigen::Vector2f GetRefPatchPos(int i) const { return pt_ref[i]; } // Get reference  patch position
   inline const Eigen::Vector2f GetQuePatchPos(int i) const { return pat[i]->GetPointPos(); } // Get target/query patch position
   inline const Eigen::Vector2f GetQuePatchDis(int i) const { return pt_ref[i]-pat[i]->GetPointPos(); } // Get query patch displacement from reference patch
+  inline const float GetQuePatchRes(int i) const { return pat[i]->GetResidual(); } // Get query patch mean absolute residual
+  inline const bool IsOptimizedPatch(int i) const { return pat[i]->IsValid() && !pat[i]->IsOutlier() && !pat[i]->IsLowTexture(); } // displacement from the optimization, not its initialization
 
 private:
 
+  #if (SELECTMODE==1)
+  void ComputeHessians(Eigen::Matrix<float, 2, 2> * hes) const; // Hessian of every reference patch via summed-area tables
+  #else
+  void ComputeHessians(Eigen::Matrix<float, 1, 1> * hes) const;
+  #endif
+  void ComputeIntegralImage(const float * img, std::vector<double> * sat) const; // summed over channels, (tmp_w+1)*(tmp_h+1) with leading zero row/column
+  void CreatePatches(const bool denseall); // patch objects, densification spans for midpoints pt_ref. denseall: regular grid on the whole image
+  bool InRegionOfInterest(const std::vector<int> & roisat, const int x, const int y) const; // patch footprint at (x,y) plus cpt->roimargin overlaps cpt->roi
+
   const float * im_ao, * im_ao_dx, * im_ao_dy;
   const float * im_bo, * im_bo_dx, * im_bo_dy;
 
   Eigen::Map<const Eigen::MatrixXf> * im_ao_eg, * im_ao_dx_eg, * im_ao_dy_eg;
   Eigen::Map<const Eigen::MatrixXf> * im_bo_eg, * im_bo_dx_eg, * im_bo_dy_eg;
+  std::vector<double> im_ao_sat, im_bo_sat; // integral images for O(1) patch means, only with patnorm, released after InitializeGrid() / Optimize()
+  bool usesat;                              // whole-image summed-area tables for Hessians and patch means, off if a region of interest makes per-patch sums cheaper
+  std::vector<int> spanx0, spanx1;          // per image row: first and last column covered by any patch, spanx0 > spanx1 if none
 
   const camparam* cpt;
   const camparam* cpo;
@@ -24,8 +24,8 @@ namespace OFC
   
   VarRefClass::VarRefClass(const float * im_ao_in, const float * im_ao_dx_in, const float * im_ao_dy_in, 
                             const float * im_bo_in, const float * im_bo_dx_in, const float * im_bo_dy_in,
-                           const camparam* cpt_in,const camparam* cpo_in,const optparam* op_in, float *flowout) 
-  : cpt(cpt_in), cpo(cpo_in), op(op_in)    
+                           const camparam* cpt_in,const camparam* cpo_in,const optparam* op_in, const flowfield * flowio, const float * tileerr) 
+  : it_inner(0), it_solver(0), refined_px(0), cpt(cpt_in), cpo(cpo_in), op(op_in)    
 {  
 
   // initialize parameters
@@ -36,6 +36,7 @@ namespace OFC
   tvparams.n_inner_iteration = op->tv_innerit * (cpt->curr_lv+1);
   tvparams.n_solver_iteration = op->tv_solverit;//5;
   tvparams.sor_omega = op->tv_sor;  
+  tvparams.restol = op->tv_restol;
   
   tvparams.tmp_quarter_alpha = 0.25f*tvparams.alpha;
   tvparams.tmp_half_gamma_over3 = tvparams.gamma*0.5f/3.0f;
@@ -47,106 +48,202 @@ namespace OFC
   float deriv_filter_flow[2] = {0.0f, -0.5f};
   deriv_flow = convolution_new(1, deriv_filter_flow, 0);  
   
-  // copy flow initialization into FV structs
-  #if (SELECTMODE==1)
-  static int noparam = 2; // Optical flow
-  #else
-  static int noparam = 1; // Only horizontal displacements for stereo depth
-  #endif
-  std::vector<image_t*> flow_sep(noparam);  
+  if (tileerr == nullptr) // refine whole image in-place
+  {
+    // wrap planar flow into FV structs, densification already wrote it with image_new() layout
+    image_t flow_u = {cpt->width, cpt->height, flowio->stride, flowio->u};
+    #if (SELECTMODE==1)
+    image_t flow_v = {cpt->width, cpt->height, flowio->stride, flowio->v};
+    RefineWindow(&flow_u, &flow_v, im_ao_in, im_bo_in, 0, 0);
+    #else
+    RefineWindow(&flow_u, nullptr, im_ao_in, im_bo_in, 0, 0);
+    #endif
+    refined_px = cpt->width * cpt->height;
+  }
+  else
+    RefineTiles(flowio, im_ao_in, im_bo_in, tileerr);
+
+  convolution_delete(deriv);
+  convolution_delete(deriv_flow);
+}
 
-  for (int i = 0; i < noparam; ++i )
-    flow_sep[i] = image_new(cpt->width,cpt->height);
-  
-  for (int iy = 0; iy < cpt->height; ++iy)
-    for (int ix = 0; ix < cpt->width; ++ix)
-    {
-      int i  = iy * cpt->width          + ix;
-      int is = iy * flow_sep[0]->stride + ix;
-      for (int j = 0; j < noparam; ++j)
-        flow_sep[j]->c1[is] = flowout[i*noparam + j];
-    }
 
-  // copy image data into FV structs
+void VarRefClass::RefineWindow(image_t *wx, image_t *wy, const float * im_ao_in, const float * im_bo_in, const int x0, const int y0)
+{
+  // reference images in-place, RGB pyramid is pixel-interleaved and has to be split into planes
   #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)    
-  image_t * im_ao, *im_bo;
-  im_ao = image_new(cpt->width,cpt->height);
-  im_bo = image_new(cpt->width,cpt->height);
+  image_t im_ao = viewimage(im_ao_in, x0, y0, wx->width, wx->height);
+  image_t im_bo = viewimage(im_bo_in, x0, y0, wx->width, wx->height);
   #else
   color_image_t * im_ao, *im_bo;
-  im_ao = color_image_new(cpt->width,cpt->height);
-  im_bo = color_image_new(cpt->width,cpt->height);
+  im_ao = color_image_new(wx->width, wx->height);
+  im_bo = color_image_new(wx->width, wx->height);
+  copyimage(im_ao_in, im_ao, x0, y0);
+  copyimage(im_bo_in, im_bo, x0, y0);  
   #endif
-      
-  copyimage(im_ao_in, im_ao);
-  copyimage(im_bo_in, im_bo);  
   
   // Call solver
-  #if (SELECTMODE==1)
-  RefLevelOF(flow_sep[0], flow_sep[1], im_ao, im_bo);
+  #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)    
+    #if (SELECTMODE==1)
+    RefLevelOF(wx, wy, &im_ao, &im_bo);
+    #else
+    (void)wy; // disparity only
+    RefLevelDE(wx, &im_ao, &im_bo);
+    #endif  
   #else
-  RefLevelDE(flow_sep[0], im_ao, im_bo);
-  #endif  
-  
-  // Copy flow result back
-  for (int iy = 0; iy < cpt->height; ++iy)
-    for (int ix = 0; ix < cpt->width; ++ix)
-    {
-      int i  = iy * cpt->width          + ix;
-      int is = iy * flow_sep[0]->stride + ix;
-      for (int j = 0; j < noparam; ++j)
-        flowout[i*noparam + j] = flow_sep[j]->c1[is];
-    }
-
-  // free FV structs
-  for (int i = 0; i < noparam; ++i )
-    image_delete(flow_sep[i]);
-  
-  convolution_delete(deriv);
-  convolution_delete(deriv_flow);
+    #if (SELECTMODE==1)
+    RefLevelOF(wx, wy, im_ao, im_bo);
+    #else
+    (void)wy; // disparity only
+    RefLevelDE(wx, im_ao, im_bo);
+    #endif  
+  #endif
 
-  
-  #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)
-  image_delete(im_ao); 
-  image_delete(im_bo);
-  #else
+  #if (SELECTCHANNEL==3)
   color_image_delete(im_ao); 
   color_image_delete(im_bo);
   #endif
 }
 
 
+void VarRefClass::RefineTiles(const flowfield * flowio, const float * im_ao_in, const float * im_bo_in, const float * tileerr)
+{
+  const int tsz = op->tv_tilesz;
+  const int ntw = (cpt->width  + tsz - 1) / tsz;
+  const int nth = (cpt->height + tsz - 1) / tsz;
+  const int not_ = ntw * nth;
+
+  // tiles to refine, and the same dilated by one tile as halo
+  std::vector<char> sel(not_, 0), selh(not_, 0);
+  int nosel = 0;
+  for (int t = 0; t < not_; ++t)
+    if (tileerr[t] > op->tv_tilethresh) { sel[t] = 1; ++nosel; }
+
+  if (nosel == 0) // DIS flow fits everywhere, keep it
+    return;
+
+  if (nosel == not_) // nothing to skip, refine whole image in-place
+  {
+    image_t flow_u = {cpt->width, cpt->height, flowio->stride, flowio->u};
+    #if (SELECTMODE==1)
+    image_t flow_v = {cpt->width, cpt->height, flowio->stride, flowio->v};
+    RefineWindow(&flow_u, &flow_v, im_ao_in, im_bo_in, 0, 0);
+    #else
+    RefineWindow(&flow_u, nullptr, im_ao_in, im_bo_in, 0, 0);
+    #endif
+    refined_px = cpt->width * cpt->height;
+    return;
+  }
+
+  for (int ty = 0; ty < nth; ++ty)
+    for (int tx = 0; tx < ntw; ++tx)
+      if (sel[ty*ntw + tx])
+        for (int dy = std::max(ty-1, 0); dy <= std::min(ty+1, nth-1); ++dy)
+          for (int dx = std::max(tx-1, 0); dx <= std::min(tx+1, ntw-1); ++dx)
+            selh[dy*ntw + dx] = 1;
+
+  // refine bounding box of each 4-connected region of halo tiles separately, write back only the selected tiles
+  std::vector<int> label(not_, -1), stack;
+  int nolabel = 0;
+  for (int t0 = 0; t0 < not_; ++t0)
+  {
+    if (!selh[t0] || label[t0] >= 0)
+      continue;
+
+    int bx0 = ntw, by0 = nth, bx1 = -1, by1 = -1;
+    label[t0] = nolabel;
+    stack.push_back(t0);
+    while (!stack.empty())
+    {
+      int t = stack.back(); stack.pop_back();
+      int tx = t % ntw, ty = t / ntw;
+      bx0 = std::min(bx0, tx); bx1 = std::max(bx1, tx);
+      by0 = std::min(by0, ty); by1 = std::max(by1, ty);
+
+      const int nb[4] = {(tx > 0) ? t-1 : -1, (tx < ntw-1) ? t+1 : -1, (ty > 0) ? t-ntw : -1, (ty < nth-1) ? t+ntw : -1};
+      for (int k = 0; k < 4; ++k)
+        if (nb[k] >= 0 && selh[nb[k]] && label[nb[k]] < 0)
+        {
+          label[nb[k]] = nolabel;
+          stack.push_back(nb[k]);
+        }
+    }
+
+    const int x0 = bx0*tsz, y0 = by0*tsz;
+    const int w = std::min((bx1+1)*tsz, cpt->width)  - x0;
+    const int h = std::min((by1+1)*tsz, cpt->height) - y0;
+
+    image_t *wx = image_new(w, h);
+    #if (SELECTMODE==1)
+    image_t *wy = image_new(w, h);
+    #else
+    image_t *wy = nullptr;
+    #endif
+    for (int yi = 0; yi < h; ++yi)
+    {
+      memcpy(wx->c1 + yi*wx->stride, flowio->u + (y0+yi)*flowio->stride + x0, w*sizeof(float));
+      #if (SELECTMODE==1)
+      memcpy(wy->c1 + yi*wy->stride, flowio->v + (y0+yi)*flowio->stride + x0, w*sizeof(float));
+      #endif
+    }
+
+    RefineWindow(wx, wy, im_ao_in, im_bo_in, x0, y0);
+    refined_px += w*h;
+
+    for (int ty = by0; ty <= by1; ++ty)
+    {
+      for (int tx = bx0; tx <= bx1; ++tx)
+      {
+        if (!sel[ty*ntw + tx] || label[ty*ntw + tx] != nolabel)
+          continue;
+
+        const int xs = tx*tsz, xe = std::min((tx+1)*tsz, cpt->width);
+        for (int yi = ty*tsz; yi < std::min((ty+1)*tsz, cpt->height); ++yi)
+        {
+          memcpy(flowio->u + yi*flowio->stride + xs, wx->c1 + (yi-y0)*wx->stride + (xs-x0), (xe-xs)*sizeof(float));
+          #if (SELECTMODE==1)
+          memcpy(flowio->v + yi*flowio->stride + xs, wy->c1 + (yi-y0)*wy->stride + (xs-x0), (xe-xs)*sizeof(float));
+          #endif
+        }
+      }
+    }
+
+    image_delete(wx);
+    #if (SELECTMODE==1)
+    image_delete(wy);
+    #endif
+    ++nolabel;
+  }
+}
+
+
 #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)    
-void VarRefClass::copyimage(const float* img, image_t * img_t)
+image_t VarRefClass::viewimage(const float* img, const int x0, const int y0, const int w, const int h)
+{
+  // start at pixel (x0,y0) of the valid region, rows keep the stride of the padded image. 
+  // Only read by image_warp() and get_derivatives(), which both accept a stride different from the work images.
+  image_t img_t = {w, h, cpt->tmp_w, (float*) img + (cpt->tmp_w + 1 ) * (cpt->imgpadding) + y0 * cpt->tmp_w + x0};
+  return img_t;
+}
 #else
-void VarRefClass::copyimage(const float* img, color_image_t * img_t)
-#endif
+void VarRefClass::copyimage(const float* img, color_image_t * img_t, const int x0, const int y0)
 {
-  #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)    
-  const float * img_st = img +     (cpt->tmp_w + 1 ) * (cpt->imgpadding); // remove image padding, start at first valid pixel
-  #else
-  const float * img_st = img + 3 * (cpt->tmp_w + 1 ) * (cpt->imgpadding); 
-  #endif
+  const float * img_st = img + 3 * ((cpt->tmp_w + 1 ) * (cpt->imgpadding) + y0 * cpt->tmp_w + x0); // remove image padding, start at pixel (x0,y0) of the valid region
     
-  for (int yi = 0; yi < cpt->height; ++yi)
+  for (int yi = 0; yi < img_t->height; ++yi)
   {
-    for (int xi = 0; xi < cpt->width; ++xi, ++img_st)
+    for (int xi = 0; xi < img_t->width; ++xi, ++img_st)
     {
       int i    = yi*img_t->stride+ xi;
       
       img_t->c1[i] =  (*img_st);
-      #if (SELECTCHANNEL==3)    
       ++img_st; img_t->c2[i] =  (*img_st);
       ++img_st; img_t->c3[i] =  (*img_st);
-      #endif
     }
-    #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)
-    img_st +=     2 * cpt->imgpadding;
-    #else
-    img_st += 3 * 2 * cpt->imgpadding;
-    #endif
+    img_st += 3 * (cpt->tmp_w - img_t->width);
   }
 }
+#endif
  
 
 #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)
@@ -188,6 +285,10 @@ void VarRefClass::RefLevelOF(image_t *wx, image_t *wy, const color_image_t *im1,
     // initialize uu and vv
     memcpy(uu->c1,wx->c1,wx->stride*wx->height*sizeof(float));
     memcpy(vv->c1,wy->c1,wy->stride*wy->height*sizeof(float));
+    // convergence monitor, reference is the first SOR sweep of the first fixed point iteration
+    sor_monitor_t mon = {tvparams.restol, 0.0f, 0.0f, 0};
+    sor_monitor_t *monp = (tvparams.restol > 0.0f) ? &mon : NULL;
+    float res_ref = 0.0f;
     // inner fixed point iterations
     for(i_inner_iteration = 0 ; i_inner_iteration < tvparams.n_inner_iteration ; i_inner_iteration++)
     {
@@ -200,10 +301,11 @@ void VarRefClass::RefLevelOF(image_t *wx, image_t *wy, const color_image_t *im1,
 
         // solve system
         #ifdef WITH_OPENMP
-        sor_coupled_slow_but_readable(du, dv, a11, a12, a22, b1, b2, smooth_horiz, smooth_vert, tvparams.n_solver_iteration, tvparams.sor_omega); // slower but parallelized
+        sor_coupled_slow_but_readable(du, dv, a11, a12, a22, b1, b2, smooth_horiz, smooth_vert, tvparams.n_solver_iteration, tvparams.sor_omega, monp); // slower but parallelized
         #else
-        sor_coupled(du, dv, a11, a12, a22, b1, b2, smooth_horiz, smooth_vert, tvparams.n_solver_iteration, tvparams.sor_omega);
+        sor_coupled(du, dv, a11, a12, a22, b1, b2, smooth_horiz, smooth_vert, tvparams.n_solver_iteration, tvparams.sor_omega, monp);
         #endif
+        it_solver += (monp ? mon.iterations : tvparams.n_solver_iteration);
         
         // update flow plus flow increment
         int i;
@@ -215,7 +317,19 @@ void VarRefClass::RefLevelOF(image_t *wx, image_t *wy, const color_image_t *im1,
           uup+=1; vvp+=1; wxp+=1; wyp+=1;dup+=1;dvp+=1;
         }
         
+        // stop fixed point iterations when the linearized system hardly changes: first SOR sweep only makes a small correction
+        if (monp)
+        {
+          if (i_inner_iteration == 0)
+            res_ref = mon.res_first;
+          else if (mon.res_first <= tvparams.restol*tvparams.restol*res_ref)
+          {
+            i_inner_iteration++;
+            break;
+          }
+        }
     }
+    it_inner += i_inner_iteration;
     // add flow increment to current flow
     memcpy(wx->c1,uu->c1,uu->stride*uu->height*sizeof(float));
     memcpy(wy->c1,vv->c1,vv->stride*vv->height*sizeof(float)); 
@@ -281,6 +395,11 @@ void VarRefClass::RefLevelDE(image_t *wx, const color_image_t *im1, const color_
       // initialize uu and vv
       memcpy(uu->c1,wx->c1,wx->stride*wx->height*sizeof(float));
       
+      // convergence monitor, reference is the first SOR sweep of the first fixed point iteration
+      sor_monitor_t mon = {tvparams.restol, 0.0f, 0.0f, 0};
+      sor_monitor_t *monp = (tvparams.restol > 0.0f) ? &mon : NULL;
+      float res_ref = 0.0f;
+
       // inner fixed point iterations
       for(i_inner_iteration = 0 ; i_inner_iteration < tvparams.n_inner_iteration ; i_inner_iteration++)
       {
@@ -290,7 +409,8 @@ void VarRefClass::RefLevelDE(image_t *wx, const color_image_t *im1, const color_
           sub_laplacian(b1, wx, smooth_horiz, smooth_vert);
           
           // solve system
-          sor_coupled_slow_but_readable_DE(du, a11, b1, smooth_horiz, smooth_vert, tvparams.n_solver_iteration, tvparams.sor_omega);
+          sor_coupled_DE(du, a11, b1, smooth_horiz, smooth_vert, tvparams.n_solver_iteration, tvparams.sor_omega, monp);
+          it_solver += (monp ? mon.iterations : tvparams.n_solver_iteration);
           
           // update flow plus flow increment
           int i;
@@ -312,7 +432,20 @@ void VarRefClass::RefLevelDE(image_t *wx, const color_image_t *im1, const color_
                 uup+=1; wxp+=1; dup+=1;
             }
           }
+
+          // stop fixed point iterations when the linearized system hardly changes
+          if (monp)
+          {
+            if (i_inner_iteration == 0)
+              res_ref = mon.res_first;
+            else if (mon.res_first <= tvparams.restol*tvparams.restol*res_ref)
+            {
+              i_inner_iteration++;
+              break;
+            }
+          }
       }
+      it_inner += i_inner_iteration;
       // add flow increment to current flow
       memcpy(wx->c1,uu->c1,uu->stride*uu->height*sizeof(float));
 
@@ -21,6 +21,7 @@ typedef struct
   int n_inner_iteration;   // number of inner fixed point iterations
   int n_solver_iteration;  // number of solver iterations 
   float sor_omega;         // omega parameter of sor method
+  float restol;            // relative residual tolerance for early stopping of inner and solver iterations, 0: disabled
   
   float tmp_quarter_alpha;
   float tmp_half_gamma_over3;
@@ -36,26 +37,38 @@ class VarRefClass
 public:
   VarRefClass(const float * im_ao_in, const float * im_ao_dx_in, const float * im_ao_dy_in, // expects #sc_f_in pointers to float arrays for images and gradients. 
               const float * im_bo_in, const float * im_bo_dx_in, const float * im_bo_dy_in,
-              const camparam* cpt_in, const camparam* cpo_in,const optparam* op_in, float *flowout);
+              const camparam* cpt_in, const camparam* cpo_in,const optparam* op_in, 
+              const flowfield * flowio,        // planar flow (pxstep==1, stride%4==0, 16-byte aligned planes), refined in-place
+              const float * tileerr = nullptr); // optional image residual on tiles of op->tv_tilesz (see PatGridClass::AggregateErrorTiles()), 
+                                                // refine only tiles above op->tv_tilethresh plus one tile halo, nullptr: refine whole image
   ~VarRefClass();  
 
+  int GetInnerIterations() const { return it_inner; }   // fixed point iterations actually performed
+  int GetSolverIterations() const { return it_solver; } // SOR sweeps actually performed, summed over fixed point iterations
+  int GetRefinedPixels() const { return refined_px; }   // pixels passed through the refinement, including halo tiles
+
 private:
 
+  void RefineWindow(image_t *wx, image_t *wy, const float * im_ao_in, const float * im_bo_in, const int x0, const int y0); // refine flow window at (x0,y0), wy unused for depth
+  void RefineTiles(const flowfield * flowio, const float * im_ao_in, const float * im_bo_in, const float * tileerr);
+
   convolution_t *deriv, *deriv_flow;
   
 
   #if (SELECTCHANNEL==1 | SELECTCHANNEL==2)    // Intensity image, or gradient image
-  void copyimage(const float* img, image_t * img_t);
+  image_t viewimage(const float* img, const int x0, const int y0, const int w, const int h); // strided view on padded pyramid level, no copy
   void RefLevelOF(image_t *wx, image_t *wy, const image_t *im1, const image_t *im2);
   void RefLevelDE(image_t *wx, const image_t *im1, const image_t *im2);
   #else // 3-Color RGB image
-  void copyimage(const float* img, color_image_t * img_t);
+  void copyimage(const float* img, color_image_t * img_t, const int x0, const int y0);
   void RefLevelOF(image_t *wx, image_t *wy, const color_image_t *im1, const color_image_t *im2);
   void RefLevelDE(image_t *wx, const color_image_t *im1, const color_image_t *im2);    
   #endif
   
   TVparams tvparams;
 
+  int it_inner, it_solver, refined_px;
+
   const camparam* cpt;
   const camparam* cpo;
   const optparam* op;    
@@ -6,6 +6,13 @@
 #include <iostream>
 #include <sys/time.h>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
     
 #include "oflow.h"
 
@@ -127,6 +134,58 @@ void ReadFlowFile(cv::Mat& img, const char* filename)
   fclose(stream);
 }
 
+// Read a preset (e.g. written by tune_dense): one "name value" pair per line, '#' starts a comment
+bool ReadPresetFile(std::map<std::string, double> & preset, const char* filename)
+{
+  std::ifstream stream(filename);
+  if (!stream.is_open())
+    return false;
+
+  std::string line, name;
+  double value;
+  while (std::getline(stream, line))
+  {
+    line = line.substr(0, line.find('#'));
+    std::istringstream ls(line);
+    if (ls >> name >> value)
+      preset[name] = value;
+  }
+  return true;
+}
+
+// Read query points: one "x y" pair per line (pixels of the input image)
+std::vector<float> ReadPointsFile(const char* filename)
+{
+  std::vector<float> pts;
+  std::ifstream stream(filename);
+  float x, y;
+  while (stream >> x >> y)
+  {
+    pts.push_back(x);
+    pts.push_back(y);
+  }
+  return pts;
+}
+
+// Save the flow at query points as text: "x y u v" (OF) or "x y d" (depth) per line
+void SavePointsFile(const std::vector<float> & pts, const std::vector<float> & fl, const int nop, const char* filename)
+{
+  FILE *stream = fopen(filename, "w");
+  if (stream == 0)
+  {
+    cout << "WriteFile: could not open file" << endl;
+    return;
+  }
+  for (size_t i = 0; i < pts.size()/2; ++i)
+  {
+    fprintf(stream, "%g %g", pts[2*i], pts[2*i+1]);
+    for (int c = 0; c < nop; ++c)
+      fprintf(stream, " %g", fl[i*nop + c]);
+    fprintf(stream, "\n");
+  }
+  fclose(stream);
+}
+
 void ConstructImgPyramide(const cv::Mat & img_ao_fmat, cv::Mat * img_ao_fmat_pyr, cv::Mat * img_ao_dx_fmat_pyr, cv::Mat * img_ao_dy_fmat_pyr, const float ** img_ao_pyr, const float ** img_ao_dx_pyr, const float ** img_ao_dy_pyr, const int lv_f, const int lv_l, const int rpyrtype, const bool getgrad, const int imgpadding, const int padw, const int padh)
 {
     for (int i=0; i<=lv_f; ++i)  // Construct image and gradient pyramides
@@ -177,6 +236,23 @@ void ConstructImgPyramide(const cv::Mat & img_ao_fmat, cv::Mat * img_ao_fmat_pyr
     }
 }
 
+// Downscale by 2^lv (mean of 2^lv x 2^lv pixels, as repeated halving in ConstructImgPyramide) to float, converting strips of rows 
+// at a time, such that the full-resolution image is never held as float
+void DownscaleImage(const cv::Mat & img, const int lv, cv::Mat & img_out)
+{
+  const int fct = 1 << lv;
+  const int striph = fct * std::max(1, 256 / fct); // rows per strip, multiple of fct
+  img_out.create(img.rows / fct, img.cols / fct, CV_MAKETYPE(CV_32F, img.channels()));
+  cv::Mat strip;
+  for (int y = 0; y < img.rows; y += striph)
+  {
+    const int h = std::min(striph, img.rows - y);
+    img(cv::Rect(0, y, img.cols, h)).convertTo(strip, CV_32F);
+    cv::Mat dst = img_out(cv::Rect(0, y / fct, img_out.cols, h / fct));
+    cv::resize(strip, dst, dst.size(), 0, 0, cv::INTER_AREA);
+  }
+}
+
 int AutoFirstScaleSelect(int imgwidth, int fratio, int patchsize)
 {
   return std::max(0,(int)std::floor(log2((2.0f*(float)imgwidth) / ((float)fratio * (float)patchsize))));
@@ -216,9 +292,19 @@ int main( int argc, char** argv )
   
   
   // *** Parse rest of parameters, See oflow.h for definitions.
-  int lv_f, lv_l, maxiter, miniter, patchsz, patnorm, costfct, tv_innerit, tv_solverit, verbosity;
-  float mindprate, mindrrate, minimgerr, poverl, tv_alpha, tv_gamma, tv_delta, tv_sor;
-  bool usefbcon, usetvref;
+  int lv_f, lv_l, maxiter, miniter, patchsz, patnorm, costfct, tv_innerit, tv_solverit, verbosity, p_rowstep;
+  float mindprate, mindrrate, minimgerr, poverl, tv_alpha, tv_gamma, tv_delta, tv_sor, tv_restol, tv_tilethresh, lowtex_thresh;
+  bool usefbcon, usetvref, usebatchopt;
+  const char * roifile = nullptr; // region of interest mask image, nonzero pixels: flow needed
+  float budget_ms = 0.0f;         // latency budget of the flow computation, 0: none
+  const char * schedstr = nullptr; // per-scale patch size:overlap:max. iterations:min. iterations, comma-separated from the coarsest scale
+  int tilesz = 0;                  // tiled mode: tile edge length in input pixels, 0: off
+  int tilethreads = 0;             // tiles processed in parallel, 0: one per core
+  int ups_radius = 0;              // edge-aware upsampling from a coarser last scale: window radius, 0: bilinear
+  float ups_eps = 10.0;            // edge-aware upsampling: regularization (squared intensity levels)
+  const char * pointsfile = nullptr; // query points: flow only sampled there from the last scale's patches, no dense flow
+  int gmmodel = -1;                // global motion on the last scale: 0 similarity, 1 homography, -1: off
+  int gmonly = 0;                  // 1: only the global motion, no flow
   //bool hasinfile; // initialization flow file
   //char *infile = nullptr;
   
@@ -227,14 +313,23 @@ int main( int argc, char** argv )
     mindprate = 0.05; mindrrate = 0.95; minimgerr = 0.0;    
     usefbcon = 0; patnorm = 1; costfct = 0; 
     tv_alpha = 10.0; tv_gamma = 10.0; tv_delta = 5.0;
-    tv_innerit = 1; tv_solverit = 3; tv_sor = 1.6;
+    tv_innerit = 1; tv_solverit = 3; tv_sor = 1.6; tv_restol = 0.0; tv_tilethresh = 0.0; usebatchopt = 0; lowtex_thresh = 0.0; p_rowstep = 1;
     verbosity = 2; // Default: Plot detailed timings
         
     int fratio = 5; // For automatic selection of coarsest scale: 1/fratio * width = maximum expected motion magnitude in image. Set lower to restrict search space.
     
     int sel_oppoint = 2; // Default operating point
+    const char * presetfile = nullptr; // preset file instead of an operating point, starts from operating point 2
     if (argc==5)         // Use provided operating point
-      sel_oppoint=atoi(argv[4]);
+    {
+      char * numend;
+      sel_oppoint = strtol(argv[4], &numend, 10);
+      if (*numend != '\0')
+      {
+        presetfile = argv[4];
+        sel_oppoint = 2;
+      }
+    }
       
     switch (sel_oppoint)
     {
@@ -256,6 +351,12 @@ int main( int argc, char** argv )
         lv_l = std::max(lv_f-5,0); maxiter = 128; miniter = 128; 
         usetvref = 1; 
         break;        
+      case 5: // ultrafast, batched optimizer. All patch rows, sparse sampling (p_rowstep 2) trades accuracy for latency, see README
+        patchsz = 12; poverl = 0.3; 
+        lv_f = AutoFirstScaleSelect(width_org, fratio, patchsz);
+        lv_l = std::max(lv_f-2,0); maxiter = 16; miniter = 16; 
+        usetvref = 0; p_rowstep = 1; usebatchopt = 1;
+        break;
       case 2:
       default:
         patchsz = 8; poverl = 0.4; 
@@ -265,6 +366,29 @@ int main( int argc, char** argv )
         break;
 
     }
+
+    if (presetfile != nullptr) // names as in the explicit parameter list below, scales as fratio (see above) and number of levels computed
+    {
+      std::map<std::string, double> preset;
+      if (!ReadPresetFile(preset, presetfile))
+      {
+        cout << "Could not read preset " << presetfile << endl;
+        return 1;
+      }
+      auto get = [&preset](const char * name, double def) { return preset.count(name) ? preset[name] : def; };
+      patchsz = get("patchsz", patchsz);             poverl = get("poverl", poverl);
+      maxiter = get("maxiter", maxiter);             miniter = get("miniter", miniter);
+      mindprate = get("mindprate", mindprate);       mindrrate = get("mindrrate", mindrrate);       minimgerr = get("minimgerr", minimgerr);
+      usefbcon = get("usefbcon", usefbcon);          patnorm = get("patnorm", patnorm);             costfct = get("costfct", costfct);
+      usetvref = get("usetvref", usetvref);          tv_alpha = get("tv_alpha", tv_alpha);          tv_gamma = get("tv_gamma", tv_gamma);
+      tv_delta = get("tv_delta", tv_delta);          tv_innerit = get("tv_innerit", tv_innerit);    tv_solverit = get("tv_solverit", tv_solverit);
+      tv_sor = get("tv_sor", tv_sor);                tv_restol = get("tv_restol", tv_restol);       tv_tilethresh = get("tv_tilethresh", tv_tilethresh);
+      usebatchopt = get("usebatchopt", usebatchopt); lowtex_thresh = get("lowtex_thresh", lowtex_thresh); p_rowstep = get("p_rowstep", p_rowstep);
+      verbosity = get("verbosity", verbosity);
+      fratio = get("fratio", fratio);
+      lv_f = AutoFirstScaleSelect(width_org, fratio, patchsz);
+      lv_l = std::max(lv_f - (int)get("levels", 2), 0);
+    }
   }
   else //  Parse explicitly provided parameters
   {
@@ -289,9 +413,35 @@ int main( int argc, char** argv )
     tv_solverit = atoi(argv[acnt++]);
     tv_sor = atof(argv[acnt++]);    
     verbosity = atoi(argv[acnt++]);
+    tv_restol = (argc > acnt) ? atof(argv[acnt++]) : 0.0; // optional
+    tv_tilethresh = (argc > acnt) ? atof(argv[acnt++]) : 0.0; // optional
+    usebatchopt = (argc > acnt) ? atoi(argv[acnt++]) : 0; // optional
+    lowtex_thresh = (argc > acnt) ? atof(argv[acnt++]) : 0.0; // optional
+    p_rowstep = (argc > acnt) ? atoi(argv[acnt++]) : 1; // optional
+    roifile = (argc > acnt) ? argv[acnt++] : nullptr; // optional
+    if (roifile != nullptr && std::string(roifile) == "-") // placeholder, to pass later parameters
+      roifile = nullptr;
+    budget_ms = (argc > acnt) ? atof(argv[acnt++]) : 0.0; // optional
+    schedstr = (argc > acnt) ? argv[acnt++] : nullptr; // optional
+    if (schedstr != nullptr && std::string(schedstr) == "-") // placeholder, to pass later parameters
+      schedstr = nullptr;
+    tilesz = (argc > acnt) ? atoi(argv[acnt++]) : 0; // optional
+    tilethreads = (argc > acnt) ? atoi(argv[acnt++]) : 0; // optional
+    ups_radius = (argc > acnt) ? atoi(argv[acnt++]) : 0; // optional
+    ups_eps = (argc > acnt) ? atof(argv[acnt++]) : 10.0; // optional
+    pointsfile = (argc > acnt) ? argv[acnt++] : nullptr; // optional
+    if (pointsfile != nullptr && std::string(pointsfile) == "-") // placeholder, to pass later parameters
+      pointsfile = nullptr;
+    gmmodel = (argc > acnt) ? atoi(argv[acnt++]) : -1; // optional
+    gmonly = (argc > acnt) ? atoi(argv[acnt++]) : 0; // optional
     //hasinfile = (bool)atoi(argv[acnt++]);   // initialization flow file
     //if (hasinfile) infile = argv[acnt++];  
   }
+  if (tilesz > 0 && (budget_ms > 0 || pointsfile != nullptr || gmmodel >= 0)) // see OFC::CheckModes
+  {
+    cout << "Tiled mode (param. 29) cannot be combined with a latency budget, query points or global motion" << endl;
+    return 1;
+  }
 
   
   
@@ -308,6 +458,36 @@ int main( int argc, char** argv )
     copyMakeBorder(img_ao_mat,img_ao_mat,floor((float)padh/2.0f),ceil((float)padh/2.0f),floor((float)padw/2.0f),ceil((float)padw/2.0f),cv::BORDER_REPLICATE);
     copyMakeBorder(img_bo_mat,img_bo_mat,floor((float)padh/2.0f),ceil((float)padh/2.0f),floor((float)padw/2.0f),ceil((float)padw/2.0f),cv::BORDER_REPLICATE);
   }
+  
+  // Per-scale schedule, omitted trailing or 0 fields (negative overlap) keep the global parameter. Images are padded for the largest patch
+  std::vector<OFC::scaleschedule> sched;
+  int imgpadding = patchsz;
+  if (schedstr != nullptr)
+  {
+    sched.resize(lv_f+1);
+    std::istringstream ss(schedstr);
+    std::string entry;
+    for (int sl = lv_f; sl >= lv_l && std::getline(ss, entry, ','); --sl)
+    {
+      std::replace(entry.begin(), entry.end(), ':', ' ');
+      std::istringstream es(entry);
+      es >> sched[sl].p_samp_s >> sched[sl].patove >> sched[sl].max_iter >> sched[sl].min_iter;
+      imgpadding = std::max(imgpadding, sched[sl].p_samp_s);
+    }
+  }
+
+  cv::Mat roi_mat;
+  if (roifile != nullptr)
+  {
+    roi_mat = cv::imread(roifile, CV_LOAD_IMAGE_GRAYSCALE);
+    if (roi_mat.size() != cv::Size(width_org, height_org))
+    {
+      cout << "Region of interest mask " << roifile << " must have the size of the input images" << endl;
+      return 1;
+    }
+    if (padh>0 || padw>0) // padded area is never of interest
+      copyMakeBorder(roi_mat,roi_mat,floor((float)padh/2.0f),ceil((float)padh/2.0f),floor((float)padw/2.0f),ceil((float)padw/2.0f),cv::BORDER_CONSTANT, 0);
+  }
   sz = img_ao_mat.size();  // padded image size, ensures divisibility by 2 on all scales (except last)
   
   // Timing, image loading
@@ -322,9 +502,19 @@ int main( int argc, char** argv )
   
   
   
+  // Tiled mode: scales lv_f to lv_t on the full frame, lv_t the first one on which the frame is no larger than a tile, 
+  // finer scales in overlapping tiles. Only the pyramid scales of the full-frame part are built here, the tiles build their own
+  const bool tiled = (tilesz > 0 && lv_f > lv_l);
+  int lv_t = lv_l+1;
+  while (tiled && lv_t < lv_f && (sz.width >> lv_t) * (sz.height >> lv_t) > tilesz*tilesz)
+    ++lv_t;
+  
   //  *** Generate scale pyramides
-  img_ao_mat.convertTo(img_ao_fmat, CV_32F); // convert to float
-  img_bo_mat.convertTo(img_bo_fmat, CV_32F);
+  if (!tiled)
+  {
+    img_ao_mat.convertTo(img_ao_fmat, CV_32F); // convert to float
+    img_bo_mat.convertTo(img_bo_fmat, CV_32F);
+  }
   
   const float* img_ao_pyr[lv_f+1];
   const float* img_bo_pyr[lv_f+1];
@@ -340,8 +530,20 @@ int main( int argc, char** argv )
   cv::Mat img_bo_dx_fmat_pyr[lv_f+1];
   cv::Mat img_bo_dy_fmat_pyr[lv_f+1];
   
-  ConstructImgPyramide(img_ao_fmat, img_ao_fmat_pyr, img_ao_dx_fmat_pyr, img_ao_dy_fmat_pyr, img_ao_pyr, img_ao_dx_pyr, img_ao_dy_pyr, lv_f, lv_l, rpyrtype, 1, patchsz, padw, padh);
-  ConstructImgPyramide(img_bo_fmat, img_bo_fmat_pyr, img_bo_dx_fmat_pyr, img_bo_dy_fmat_pyr, img_bo_pyr, img_bo_dx_pyr, img_bo_dy_pyr, lv_f, lv_l, rpyrtype, 1, patchsz, padw, padh);
+  if (tiled) // from the input downscaled to lv_t (SELECTCHANNEL==2: gradient magnitude of the downscaled image, also in the tiles)
+  {
+    DownscaleImage(img_ao_mat, lv_t, img_ao_fmat);
+    DownscaleImage(img_bo_mat, lv_t, img_bo_fmat);
+    ConstructImgPyramide(img_ao_fmat, img_ao_fmat_pyr+lv_t, img_ao_dx_fmat_pyr+lv_t, img_ao_dy_fmat_pyr+lv_t, img_ao_pyr+lv_t, img_ao_dx_pyr+lv_t, img_ao_dy_pyr+lv_t, lv_f-lv_t, 0, rpyrtype, 1, imgpadding, padw, padh);
+    ConstructImgPyramide(img_bo_fmat, img_bo_fmat_pyr+lv_t, img_bo_dx_fmat_pyr+lv_t, img_bo_dy_fmat_pyr+lv_t, img_bo_pyr+lv_t, img_bo_dx_pyr+lv_t, img_bo_dy_pyr+lv_t, lv_f-lv_t, 0, rpyrtype, 1, imgpadding, padw, padh);
+    img_ao_fmat.release();
+    img_bo_fmat.release();
+  }
+  else
+  {
+    ConstructImgPyramide(img_ao_fmat, img_ao_fmat_pyr, img_ao_dx_fmat_pyr, img_ao_dy_fmat_pyr, img_ao_pyr, img_ao_dx_pyr, img_ao_dy_pyr, lv_f, lv_l, rpyrtype, 1, imgpadding, padw, padh);
+    ConstructImgPyramide(img_bo_fmat, img_bo_fmat_pyr, img_bo_dx_fmat_pyr, img_bo_dy_fmat_pyr, img_bo_pyr, img_bo_dx_pyr, img_bo_dy_pyr, lv_f, lv_l, rpyrtype, 1, imgpadding, padw, padh);
+  }
 
   // Timing, image gradients and pyramid
   if (verbosity > 1)
@@ -388,30 +590,233 @@ int main( int argc, char** argv )
   cv::Mat flowout(sz.height / sc_fct , sz.width / sc_fct, CV_32FC1); // Depth
   #endif       
   
-  OFC::OFClass ofc(img_ao_pyr, img_ao_dx_pyr, img_ao_dy_pyr, 
-                    img_bo_pyr, img_bo_dx_pyr, img_bo_dy_pyr, 
-                    patchsz,  // extra image padding to avoid border violation check
-                    (float*)flowout.data,   // pointer to n-band output float array
-                    nullptr,  // pointer to n-band input float array of size of first (coarsest) scale, pass as nullptr to disable
-                    sz.width, sz.height, 
-                    lv_f, lv_l, maxiter, miniter, mindprate, mindrrate, minimgerr, patchsz, poverl, 
-                    usefbcon, costfct, nochannels, patnorm, 
-                    usetvref, tv_alpha, tv_gamma, tv_delta, tv_innerit, tv_solverit, tv_sor,
-                    verbosity);    
+  OFC::deadlinestate dl;
+  dl.budget_ms = budget_ms;
+  OFC::patchflow pf;
+  pf.densify = false;
+  OFC::globalmotion gm;
+  gm.model = gmmodel;
+  gm.onlymotion = (gmonly != 0);
+  OFC::densemodes modes;
+  modes.roi = roi_mat.empty() ? nullptr : roi_mat.data;
+  modes.sched = sched.empty() ? nullptr : sched.data();
+  if (!tiled)
+  {
+    modes.dl = (budget_ms > 0) ? &dl : nullptr;       // anytime mode, stops before the scale that would exceed the budget
+    modes.pf = (pointsfile != nullptr) ? &pf : nullptr; // lazy densification, only at the query points
+    modes.gm = (gmmodel >= 0) ? &gm : nullptr;         // global motion, fitted to the patches of the last scale
+    OFC::OFClass ofc(img_ao_pyr, img_ao_dx_pyr, img_ao_dy_pyr, 
+                      img_bo_pyr, img_bo_dx_pyr, img_bo_dy_pyr, 
+                      imgpadding,  // extra image padding to avoid border violation check
+                      (float*)flowout.data,   // pointer to n-band output float array
+                      nullptr,  // pointer to n-band input float array of size of first (coarsest) scale, pass as nullptr to disable
+                      sz.width, sz.height, 
+                      lv_f, lv_l, maxiter, miniter, mindprate, mindrrate, minimgerr, patchsz, poverl, 
+                      usefbcon, costfct, nochannels, patnorm, 
+                      usetvref, tv_alpha, tv_gamma, tv_delta, tv_innerit, tv_solverit, tv_sor, tv_restol, tv_tilethresh, usebatchopt, lowtex_thresh, p_rowstep,
+                      &modes,
+                      verbosity);    
+  }
+  else
+  {
+    // One flow computation on scales sc_f to sc_l of the frame or a tile of it, initialized from 'init' on scale sc_f+1 if given
+    auto runflow = [&](const float ** ao, const float ** ao_dx, const float ** ao_dy, const float ** bo, const float ** bo_dx, const float ** bo_dy,
+                       float * out, const float * init, const int width, const int height, const int sc_f, const int sc_l, const unsigned char * roi, 
+                       const OFC::tileinfo * tile)
+    {
+      OFC::densemodes tilemodes = modes;
+      tilemodes.roi = roi;
+      tilemodes.tile = tile;
+      OFC::OFClass ofc(ao, ao_dx, ao_dy, bo, bo_dx, bo_dy, imgpadding, out, init, width, height, 
+                       sc_f, sc_l, maxiter, miniter, mindprate, mindrrate, minimgerr, patchsz, poverl, 
+                       usefbcon, costfct, nochannels, patnorm, 
+                       usetvref, tv_alpha, tv_gamma, tv_delta, tv_innerit, tv_solverit, tv_sor, tv_restol, tv_tilethresh, usebatchopt, lowtex_thresh, p_rowstep,
+                       &tilemodes, 0);
+    };
+    struct timeval tv_start_tiled, tv_end_tiled;
+    gettimeofday(&tv_start_tiled, NULL);
+
+    // Full frame, scales lv_f to lv_t
+    const int fct = 1 << lv_t;
+    cv::Mat flow_crs(sz.height / fct, sz.width / fct, flowout.type());
+    runflow(img_ao_pyr, img_ao_dx_pyr, img_ao_dy_pyr, img_bo_pyr, img_bo_dx_pyr, img_bo_dy_pyr, 
+            (float*)flow_crs.data, nullptr, sz.width, sz.height, lv_f, lv_t, roi_mat.empty() ? nullptr : roi_mat.data, nullptr);
+    for (int i = lv_t; i <= lv_f; ++i)
+    {
+      img_ao_fmat_pyr[i].release(); img_ao_dx_fmat_pyr[i].release(); img_ao_dy_fmat_pyr[i].release();
+      img_bo_fmat_pyr[i].release(); img_bo_dx_fmat_pyr[i].release(); img_bo_dy_fmat_pyr[i].release();
+    }
+
+    if (verbosity > 1)
+    {
+      gettimeofday(&tv_end_tiled, NULL);
+      double tt = (tv_end_tiled.tv_sec-tv_start_tiled.tv_sec)*1000.0f + (tv_end_tiled.tv_usec-tv_start_tiled.tv_usec)/1000.0f;
+      printf("TIME (Full frame, sc %i-%i) (ms): %3g\n", lv_f, lv_t, tt);
+    }
+
+    // Tiles of tsz x tsz pixels on scales lv_t-1 to lv_l, each extended by a halo of its largest displacement on scale lv_t 
+    // plus the patch size on scale lv_t-1 and initialized from the full-frame flow. Only the core of each tile is kept.
+    // Tiles are processed in parallel, memory is bounded by the number of threads times the tile size
+    const int tsz = ((tilesz + fct - 1) / fct) * fct; // multiple of 2^lv_t, as all tile corners and halos
+    const int tiles_x = (sz.width + tsz - 1) / tsz;
+    const int notiles = tiles_x * ((sz.height + tsz - 1) / tsz);
+    const int nop = flowout.channels();
+    std::vector<int> halo(notiles, 0);
+    std::atomic<int> nexttile(0);
+    flowout.setTo(0);
+    auto tileworker = [&]()
+    {
+      for (int t = nexttile++; t < notiles; t = nexttile++)
+      {
+        const int x0 = (t % tiles_x) * tsz, y0 = (t / tiles_x) * tsz;
+        const cv::Rect core(x0, y0, std::min(tsz, sz.width - x0), std::min(tsz, sz.height - y0));
+        if (!roi_mat.empty() && cv::countNonZero(roi_mat(core)) == 0) // no flow needed, stays 0
+          continue;
+
+        const cv::Mat fc = flow_crs(cv::Rect(core.x / fct, core.y / fct, core.width / fct, core.height / fct));
+        float maxd = 0; // squared
+        for (int y = 0; y < fc.rows; ++y)
+        {
+          const float * f = fc.ptr<float>(y);
+          for (int i = 0; i < fc.cols*nop; i += nop)
+          {
+            float d = 0;
+            for (int c = 0; c < nop; ++c)
+              d += f[i+c] * f[i+c];
+            maxd = std::max(maxd, d);
+          }
+        }
+        halo[t] = (int)ceil(sqrt(maxd) * fct) + imgpadding * fct / 2;
+        halo[t] = ((halo[t] + fct - 1) / fct) * fct;
+        const int hx0 = std::max(core.x - halo[t], 0), hx1 = std::min(core.x + core.width + halo[t], sz.width);
+        const int hy0 = std::max(core.y - halo[t], 0), hy1 = std::min(core.y + core.height + halo[t], sz.height);
+        const cv::Rect rect(hx0, hy0, hx1-hx0, hy1-hy0);
+
+        cv::Mat tile_ao, tile_bo; // pyramid scales lv_l to lv_t-1 only
+        DownscaleImage(img_ao_mat(rect), lv_l, tile_ao);
+        DownscaleImage(img_bo_mat(rect), lv_l, tile_bo);
+        std::vector<cv::Mat> ao_fmat(lv_t), ao_dx_fmat(lv_t), ao_dy_fmat(lv_t), bo_fmat(lv_t), bo_dx_fmat(lv_t), bo_dy_fmat(lv_t);
+        std::vector<const float*> ao(lv_t, nullptr), ao_dx(lv_t, nullptr), ao_dy(lv_t, nullptr), bo(lv_t, nullptr), bo_dx(lv_t, nullptr), bo_dy(lv_t, nullptr);
+        ConstructImgPyramide(tile_ao, ao_fmat.data()+lv_l, ao_dx_fmat.data()+lv_l, ao_dy_fmat.data()+lv_l, ao.data()+lv_l, ao_dx.data()+lv_l, ao_dy.data()+lv_l, lv_t-1-lv_l, 0, rpyrtype, 1, imgpadding, padw, padh);
+        ConstructImgPyramide(tile_bo, bo_fmat.data()+lv_l, bo_dx_fmat.data()+lv_l, bo_dy_fmat.data()+lv_l, bo.data()+lv_l, bo_dx.data()+lv_l, bo_dy.data()+lv_l, lv_t-1-lv_l, 0, rpyrtype, 1, imgpadding, padw, padh);
+        tile_ao.release();
+        tile_bo.release();
+
+        const cv::Mat tile_init = flow_crs(cv::Rect(rect.x / fct, rect.y / fct, rect.width / fct, rect.height / fct)).clone();
+        const cv::Mat tile_roi = roi_mat.empty() ? cv::Mat() : roi_mat(rect).clone();
+        cv::Mat tile_out(rect.height >> lv_l, rect.width >> lv_l, flowout.type());
+        OFC::tileinfo ti;
+        ti.x = rect.x; ti.y = rect.y;
+        ti.frame_width = sz.width; ti.frame_height = sz.height;
+        runflow(ao.data(), ao_dx.data(), ao_dy.data(), bo.data(), bo_dx.data(), bo_dy.data(), 
+                (float*)tile_out.data, (const float*)tile_init.data, rect.width, rect.height, lv_t-1, lv_l, tile_roi.empty() ? nullptr : tile_roi.data, &ti);
+
+        cv::Mat dst = flowout(cv::Rect(core.x >> lv_l, core.y >> lv_l, core.width >> lv_l, core.height >> lv_l));
+        tile_out(cv::Rect((core.x - rect.x) >> lv_l, (core.y - rect.y) >> lv_l, core.width >> lv_l, core.height >> lv_l)).copyTo(dst);
+      }
+    };
+    const int nothreads = std::max(1, std::min(notiles, (tilethreads > 0) ? tilethreads : (int)std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nothreads; ++i)
+      threads.emplace_back(tileworker);
+    tileworker();
+    for (std::thread & th : threads)
+      th.join();
+
+    if (verbosity > 0)
+    {
+      gettimeofday(&tv_end_tiled, NULL);
+      double tt = (tv_end_tiled.tv_sec-tv_start_tiled.tv_sec)*1000.0f + (tv_end_tiled.tv_usec-tv_start_tiled.tv_usec)/1000.0f;
+      if (verbosity > 1)
+        printf("Tiles: %i of %ix%i px, halo up to %i px, scales %i-%i, %i in parallel\n", notiles, tsz, tsz, *std::max_element(halo.begin(), halo.end()), lv_t-1, lv_l, nothreads);
+      printf("TIME (O.Flow Run-Time   ) (ms): %3g\n", tt);
+    }
+  }
 
   if (verbosity > 1) gettimeofday(&tv_start_all, NULL);
+
+  // *** Global motion, in pixels of the unpadded image: H' = T(-o) H T(o), o the offset of the padding
+  if (gmmodel >= 0)
+  {
+    const double ox = floor((float)padw/2.0f), oy = floor((float)padh/2.0f);
+    double H[9];
+    for (int i = 0; i < 9; ++i)
+      H[i] = gm.H[i];
+    for (int r = 0; r < 3; ++r) // H T(o)
+      H[r*3+2] += H[r*3+0]*ox + H[r*3+1]*oy;
+    for (int c = 0; c < 3; ++c) // T(-o) H
+    {
+      H[0*3+c] -= ox*H[2*3+c];
+      H[1*3+c] -= oy*H[2*3+c];
+    }
+    for (int i = 8; i >= 0; --i)
+      H[i] /= H[8];
+    if (gmonly != 0 || verbosity > 0)
+    {
+      FILE * stream = (gmonly != 0) ? fopen(outfile, "w") : stdout;
+      if (stream == 0)
+        cout << "WriteFile: could not open file" << endl;
+      else
+      {
+        if (gmonly == 0)
+          fprintf(stream, "Global motion (scale %i, %i patches, %.1f%% inliers):\n", gm.sc_fit, gm.nopatches, 100.0f * gm.inlierfrac);
+        fprintf(stream, "%.9g %.9g %.9g\n%.9g %.9g %.9g\n%.9g %.9g %.9g\n", H[0], H[1], H[2], H[3], H[4], H[5], H[6], H[7], H[8]);
+        if (gmonly != 0)
+          fclose(stream);
+      }
+    }
+    if (gmonly != 0)
+      return 0;
+  }
       
-  
+  // *** Query points: flow sampled from the patches of the last scale, instead of the dense flow
+  if (pointsfile != nullptr)
+  {
+    std::vector<float> pts = ReadPointsFile(pointsfile), pts_pad(pts);
+    for (size_t i = 0; i < pts.size(); i += 2)
+    {
+      pts_pad[i]   += floor((float)padw/2.0f);
+      pts_pad[i+1] += floor((float)padh/2.0f);
+    }
+    std::vector<float> fl(pts.size()/2 * flowout.channels());
+    OFC::SampleFlow(&pf, pts.size()/2, pts_pad.data(), fl.data());
+    SavePointsFile(pts, fl, flowout.channels(), outfile);
+
+    if (verbosity > 1)
+    {
+      gettimeofday(&tv_end_all, NULL);
+      double tt = (tv_end_all.tv_sec-tv_start_all.tv_sec)*1000.0f + (tv_end_all.tv_usec-tv_start_all.tv_usec)/1000.0f;
+      printf("TIME (Sampling %i points) (ms): %3g\n", (int)pts.size()/2, tt);
+    }
+    return 0;
+  }
   
   // *** Resize to original scale, if not run to finest level
-  if (lv_l != 0)
+  if (lv_l != 0 && ups_radius > 0) // edge-aware, guided by the first image, also removes the padding
   {
-    flowout *= sc_fct;
-    cv::resize(flowout, flowout, cv::Size(), sc_fct, sc_fct , cv::INTER_LINEAR);
+    cv::Mat guide;
+    #if (SELECTCHANNEL==3)
+    cv::cvtColor(img_ao_mat, guide, CV_BGR2GRAY);
+    guide.convertTo(guide, CV_32F);
+    #else
+    img_ao_mat.convertTo(guide, CV_32F);
+    #endif
+    cv::Mat flowup(height_org, width_org, flowout.type());
+    OFC::UpsampleFlowGuided((const float*)flowout.data, (const float*)guide.data, sz.width, sz.height, lv_l, ups_radius, ups_eps,
+                            (float*)flowup.data, (int)floor((float)padw/2.0f), (int)floor((float)padh/2.0f), width_org, height_org);
+    flowout = flowup;
+  }
+  else
+  {
+    if (lv_l != 0)
+    {
+      flowout *= sc_fct;
+      cv::resize(flowout, flowout, cv::Size(), sc_fct, sc_fct , cv::INTER_LINEAR);
+    }
+    
+    // If image was padded, remove padding before saving to file
+    flowout = flowout(cv::Rect((int)floor((float)padw/2.0f),(int)floor((float)padh/2.0f),width_org,height_org));
   }
-  
-  // If image was padded, remove padding before saving to file
-  flowout = flowout(cv::Rect((int)floor((float)padw/2.0f),(int)floor((float)padh/2.0f),width_org,height_org));
 
   // Save Result Image    
   #if (SELECTMODE==1)
@@ -0,0 +1,342 @@
+// Auto-tuner for the operating point parameters of run_dense. Runs a run_OF_* executable on sample frame pairs with ground truth
+// over a grid of settings (default: patch size, overlap, number of scales, iterations, TV refinement), measures latency on this machine
+// (pyramid and flow computation, best of several runs, mean over frames) and mean endpoint error, prints the Pareto-optimal settings,
+// and writes the most accurate one within a latency target as a preset, to be passed to run_dense instead of an operating point.
+// Each setting is passed to run_dense as a preset as well, parameters outside the search space are those of operating point 2.
+//
+// Build: see CMakeLists.txt (target tune_dense), no dependencies
+// Usage: ./tune_dense ./run_OF_INT samples.txt latency_ms preset_out [repetitions] [searchspace.txt]
+//   samples.txt: one frame pair per line, "image1 image2 groundtruth.flo", e.g. ../images/alley_1/frame_0001.png ../images/alley_1/frame_0002.png ../flows/alley_0001.flo
+//   searchspace.txt: one "name value1 value2 ..." line per swept or fixed parameter, names as in presets ('#' starts a comment),
+//                    replaces the default search space. miniter follows maxiter unless given
+// Then: ./run_OF_INT image1.png image2.png out.flo preset_out
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+struct sample
+{
+  string im_ao, im_bo;      // frame pair
+  vector<float> gt;         // ground truth flow, interleaved u,v
+  int width, height;
+};
+
+struct setting
+{
+  vector<double> val;       // one value per dimension of the search space
+  double ms;                // mean latency per frame
+  double epe;               // mean endpoint error
+};
+
+// Search space: preset names (see run_dense.cpp) with their values, every combination is run
+typedef vector<std::pair<string, vector<double> > > searchspace;
+static const searchspace sp_default = {
+  {"patchsz",  {8, 12}},
+  {"poverl",   {0.3, 0.5, 0.75}},
+  {"levels",   {1, 2, 3, 4}},     // number of scales below the coarsest, run_dense chooses the coarsest from the image width (fratio)
+  {"maxiter",  {8, 16, 32}},      // min. = max. iterations
+  {"usetvref", {0, 1}}};
+static const char * sp_names[] = {"patchsz", "poverl", "maxiter", "miniter", "mindprate", "mindrrate", "minimgerr", "usefbcon", "patnorm",
+                                  "costfct", "usetvref", "tv_alpha", "tv_gamma", "tv_delta", "tv_innerit", "tv_solverit", "tv_sor",
+                                  "tv_restol", "tv_tilethresh", "usebatchopt", "lowtex_thresh", "p_rowstep", "fratio", "levels"};
+
+// Value of 'name' in a setting, 'def' if it is not part of the search space
+static double Get(const searchspace & sp, const setting & st, const char * name, double def)
+{
+  for (size_t d = 0; d < sp.size(); ++d)
+    if (sp[d].first == name)
+      return st.val[d];
+  return def;
+}
+
+// Read a search space file, false on error or unknown names
+static bool ReadSearchSpace(searchspace & sp, const char * filename)
+{
+  std::ifstream file(filename);
+  if (!file)
+    return false;
+  sp.clear();
+  string line;
+  while (std::getline(file, line))
+  {
+    std::istringstream ls(line.substr(0, line.find('#')));
+    string name;
+    if (!(ls >> name))
+      continue;
+    if (std::find_if(std::begin(sp_names), std::end(sp_names), [&name](const char * n) { return name == n; }) == std::end(sp_names))
+    {
+      cout << "Unknown parameter " << name << " in " << filename << endl;
+      return false;
+    }
+    vector<double> vals;
+    double v;
+    while (ls >> v)
+      vals.push_back(v);
+    if (vals.empty())
+    {
+      cout << "No values for " << name << " in " << filename << endl;
+      return false;
+    }
+    sp.push_back(std::make_pair(name, vals));
+  }
+  return !sp.empty();
+}
+
+// Write a setting as preset (missing miniter follows maxiter), false on error
+static bool WritePreset(const char * filename, const searchspace & sp, const setting & st, const char * comment, const int verbosity)
+{
+  FILE * stream = fopen(filename, "w");
+  if (stream == 0)
+    return false;
+  if (comment != nullptr)
+    fprintf(stream, "# %s\n", comment);
+  bool hasmin = false;
+  for (size_t d = 0; d < sp.size(); ++d)
+  {
+    fprintf(stream, "%s %g\n", sp[d].first.c_str(), st.val[d]);
+    hasmin |= (sp[d].first == "miniter");
+  }
+  if (!hasmin && Get(sp, st, "maxiter", -1) >= 0)
+    fprintf(stream, "miniter %g\n", Get(sp, st, "maxiter", 0));
+  if (verbosity >= 0)
+    fprintf(stream, "verbosity %i\n", verbosity);
+  return fclose(stream) == 0;
+}
+
+// Single-quoted for the shell
+static string Quote(const string & arg)
+{
+  string q = "'";
+  for (char c : arg)
+    q += (c == '\'') ? string("'\\''") : string(1, c);
+  return q + "'";
+}
+
+// Next whitespace-separated field, or one in double quotes (paths with spaces), false at the end of the line
+static bool ReadField(std::istream & in, string & field)
+{
+  if (!(in >> std::ws) || in.peek() != '"')
+    return (bool)(in >> field);
+  in.get();
+  return (bool)std::getline(in, field, '"');
+}
+
+// "name value" pairs of a setting
+static string Describe(const searchspace & sp, const setting & st)
+{
+  std::ostringstream os;
+  for (size_t d = 0; d < sp.size(); ++d)
+    os << (d > 0 ? "  " : "") << sp[d].first << " " << st.val[d];
+  return os.str();
+}
+
+// Read a .flo file, false on error
+static bool ReadFlo(const char * filename, vector<float> & fl, int & width, int & height)
+{
+  FILE * stream = fopen(filename, "rb");
+  if (stream == 0)
+    return false;
+
+  float tag;
+  bool ok = fread(&tag, sizeof(float), 1, stream) == 1 && fread(&width, sizeof(int), 1, stream) == 1 && fread(&height, sizeof(int), 1, stream) == 1;
+  if (ok)
+  {
+    fl.resize(2 * width * height);
+    ok = (int)fread(fl.data(), sizeof(float), fl.size(), stream) == (int)fl.size();
+  }
+  fclose(stream);
+  return ok;
+}
+
+static int AutoFirstScaleSelect(int imgwidth, int fratio, int patchsize)
+{
+  return std::max(0,(int)std::floor(log2((2.0f*(float)imgwidth) / ((float)fratio * (float)patchsize))));
+}
+
+// Run one setting on one sample 'reps' times: best latency (ms) and endpoint error, false if the run failed
+static bool RunSample(const string & exe, const sample & s, const searchspace & sp, const setting & st, const int reps, double * ms, double * epe)
+{
+  char outfile[] = "/tmp/tune_dense_XXXXXX";
+  char presetfile[] = "/tmp/tune_dense_preset_XXXXXX";
+  int fd = mkstemp(outfile);
+  if (fd < 0)
+    return false;
+  close(fd);
+  fd = mkstemp(presetfile);
+  if (fd < 0)
+  {
+    remove(outfile);
+    return false;
+  }
+  close(fd);
+
+  // the setting as preset, verbosity 2 for the pyramid and flow timings
+  if (!WritePreset(presetfile, sp, st, nullptr, 2))
+  {
+    remove(outfile);
+    remove(presetfile);
+    return false;
+  }
+  const string cmd = Quote(exe) + " " + Quote(s.im_ao) + " " + Quote(s.im_bo) + " " + Quote(outfile) + " " + Quote(presetfile);
+
+  *ms = 1e20;
+  for (int r = 0; r < reps; ++r)
+  {
+    FILE * pipe = popen(cmd.c_str(), "r");
+    if (pipe == 0)
+      break;
+    char line[256];
+    double tt, tt_pyr = -1, tt_flow = -1;
+    while (fgets(line, sizeof(line), pipe))
+    {
+      if (sscanf(line, "TIME (Pyramide+Gradients) (ms): %lf", &tt) == 1)
+        tt_pyr = tt;
+      else if (sscanf(line, "TIME (O.Flow Run-Time   ) (ms): %lf", &tt) == 1)
+        tt_flow = tt;
+    }
+    if (pclose(pipe) != 0 || tt_pyr < 0 || tt_flow < 0)
+      break;
+    *ms = std::min(*ms, tt_pyr + tt_flow);
+  }
+
+  vector<float> fl;
+  int w, h;
+  bool ok = *ms < 1e20 && ReadFlo(outfile, fl, w, h) && w == s.width && h == s.height;
+  remove(outfile);
+  remove(presetfile);
+  if (!ok)
+    return false;
+
+  // mean over pixels with known ground truth (Middlebury: unknown flow > 1e9)
+  double sum = 0;
+  int cnt = 0;
+  for (int i = 0; i < w*h; ++i)
+  {
+    const float gu = s.gt[2*i], gv = s.gt[2*i+1];
+    if (std::abs(gu) > 1e9 || std::abs(gv) > 1e9)
+      continue;
+    sum += sqrt((fl[2*i]-gu)*(fl[2*i]-gu) + (fl[2*i+1]-gv)*(fl[2*i+1]-gv));
+    ++cnt;
+  }
+  *epe = sum / std::max(cnt, 1);
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 5)
+  {
+    cout << "Usage: " << argv[0] << " run_OF_executable samples.txt latency_ms preset_out [repetitions] [searchspace.txt]" << endl;
+    return 1;
+  }
+  const string exe = argv[1];
+  const double target = atof(argv[3]);
+  const char * presetfile = argv[4];
+  const int reps = (argc > 5) ? atoi(argv[5]) : 3;
+  searchspace sp = sp_default;
+  if (argc > 6 && !ReadSearchSpace(sp, argv[6]))
+  {
+    cout << "Could not read search space " << argv[6] << endl;
+    return 1;
+  }
+
+  // Samples
+  vector<sample> samples;
+  std::ifstream list(argv[2]);
+  string line;
+  while (std::getline(list, line))
+  {
+    std::istringstream ls(line);
+    sample s;
+    string gtfile;
+    if (!(ReadField(ls, s.im_ao) && ReadField(ls, s.im_bo) && ReadField(ls, gtfile)))
+      continue;
+    if (!ReadFlo(gtfile.c_str(), s.gt, s.width, s.height))
+    {
+      cout << "Could not read ground truth " << gtfile << endl;
+      return 1;
+    }
+    samples.push_back(s);
+  }
+  if (samples.empty())
+  {
+    cout << "No samples in " << argv[2] << endl;
+    return 1;
+  }
+
+  // Run all settings, skip the ones which would only repeat a coarser number of levels
+  vector<setting> res;
+  setting st = {vector<double>(sp.size()), 0, 0};
+  vector<size_t> idx(sp.size(), 0);
+  for (bool more = true; more; )
+  {
+    for (size_t d = 0; d < sp.size(); ++d)
+      st.val[d] = sp[d].second[idx[d]];
+    for (size_t d = 0; d < sp.size() && !(more = (++idx[d] < sp[d].second.size())); ++d) // next combination, last dimension slowest
+      idx[d] = 0;
+
+    if (AutoFirstScaleSelect(samples[0].width, (int)Get(sp, st, "fratio", 5), (int)Get(sp, st, "patchsz", 8)) - (int)Get(sp, st, "levels", 2) < 0)
+      continue;
+    st.ms = st.epe = 0;
+    for (const sample & s : samples)
+    {
+      double ms = 0, epe = 0;
+      if (!RunSample(exe, s, sp, st, reps, &ms, &epe))
+      {
+        cout << "Run failed: " << exe << " on " << s.im_ao << ", " << Describe(sp, st) << endl;
+        return 1;
+      }
+      st.ms += ms / samples.size();
+      st.epe += epe / samples.size();
+    }
+    printf("%s:  %8.2f ms  EPE %.4f\n", Describe(sp, st).c_str(), st.ms, st.epe);
+    res.push_back(st);
+  }
+  if (res.empty())
+  {
+    cout << "No setting in the search space fits the image width" << endl;
+    return 1;
+  }
+
+  // Pareto front: by increasing latency, each one more accurate than all faster ones
+  std::sort(res.begin(), res.end(), [](const setting & a, const setting & b) { return a.ms < b.ms || (a.ms == b.ms && a.epe < b.epe); });
+  vector<setting> front;
+  for (const setting & st : res)
+    if (front.empty() || st.epe < front.back().epe)
+      front.push_back(st);
+
+  printf("\nPareto-optimal settings (%i frames):\n", (int)samples.size());
+  for (const setting & st : front)
+    printf("%s:  %8.2f ms  EPE %.4f\n", Describe(sp, st).c_str(), st.ms, st.epe);
+
+  // Most accurate within the target, else the fastest
+  const setting * sel = &front[0];
+  for (const setting & st : front)
+    if (st.ms <= target)
+      sel = &st;
+  if (sel->ms > target)
+    printf("\nNo setting within %.2f ms, using the fastest one\n", target);
+
+  char comment[256];
+  snprintf(comment, sizeof(comment), "run_dense preset, written by tune_dense for a latency of %.2f ms: %.2f ms, EPE %.4f on %i frames", 
+           target, sel->ms, sel->epe, (int)samples.size());
+  if (!WritePreset(presetfile, sp, *sel, comment, -1))
+  {
+    cout << "Could not write preset " << presetfile << endl;
+    return 1;
+  }
+  printf("\nSelected: %s: %.2f ms, EPE %.4f -> %s\n", Describe(sp, *sel).c_str(), sel->ms, sel->epe, presetfile);
+
+  return 0;
+}